@@ -0,0 +1,81 @@
+-- Copyright (c) 2015, Tamas Foldi, Starschema
+--
+-- Synthetic Tableau repository for the TableauFS benchmarks.
+--
+-- Creates the tables and columns the TableauFS queries rely on and fills
+-- them with sites x projects x files workbooks plus the same number of
+-- datasources. File contents are large objects of size_kb / 4 to size_kb
+-- kilobytes; every second file starts with PK and shows up as .twbx/.tdsx.
+--
+-- Meant for a dedicated database: ALL large objects of it are dropped.
+--
+--   createdb workgroup
+--   psql -d workgroup -v sites=2 -v projects=5 -v files=20 -v size_kb=1024 \
+--        -f bench/generate.sql
+
+\set ON_ERROR_STOP on
+
+drop table if exists workbooks, datasources, repository_data, projects, sites;
+select count(lo_unlink(oid)) as dropped_large_objects from pg_largeobject_metadata;
+
+create table sites (
+  id serial primary key,
+  name text not null,
+  updated_at timestamp default now()
+);
+
+create table projects (
+  id serial primary key,
+  site_id integer not null references sites,
+  name text not null,
+  updated_at timestamp default now()
+);
+
+create table repository_data (
+  id serial primary key,
+  tracking_id integer not null,
+  content oid not null
+);
+
+create table workbooks (
+  id serial primary key,
+  project_id integer not null references projects,
+  name text not null,
+  updated_at timestamp default now(),
+  data_id integer,
+  reduced_data_id integer
+);
+
+create table datasources (
+  id serial primary key,
+  project_id integer not null references projects,
+  name text not null,
+  updated_at timestamp default now(),
+  data_id integer,
+  reduced_data_id integer
+);
+
+insert into sites (name)
+  select 'Site ' || s from generate_series(1, :sites) s;
+
+insert into projects (site_id, name)
+  select s.id, 'Project ' || p from sites s, generate_series(1, :projects) p;
+
+-- odd tracking ids belong to workbooks, even ones to datasources
+insert into repository_data (tracking_id, content)
+  select n, lo_from_bytea(0,
+      case when n % 4 < 2 then '\x504b0304'::bytea else ''::bytea end ||
+      convert_to(repeat(md5(n::text), :size_kb * 8 * (1 + n % 4)), 'UTF8'))
+  from generate_series(1, :sites * :projects * :files * 2) n;
+
+insert into workbooks (project_id, name, data_id)
+  select p.id, 'Workbook ' || f, 2 * ((p.id - 1) * :files + f) - 1
+  from projects p, generate_series(1, :files) f;
+
+insert into datasources (project_id, name, data_id)
+  select p.id, 'Datasource ' || f, 2 * ((p.id - 1) * :files + f)
+  from projects p, generate_series(1, :files) f;
+
+create index on repository_data (tracking_id);
+
+analyze;
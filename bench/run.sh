@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Build a synthetic repository on a local Postgres, mount it with
+# TableauFS and run the benchmark workloads.
+#
+#   run.sh path/to/tfsbench path/to/tableaufs
+#
+# Configured through the environment:
+#   PGHOST PGPORT PGUSER PGPASSWORD   the benchmark server (libpq defaults)
+#   BENCH_SITES BENCH_PROJECTS BENCH_FILES BENCH_SIZE_KB   repository scale
+#   BENCH_SKIP_GENERATE=1             reuse the data of an earlier run
+#   BENCH_MOUNT                       mount point (default: ./bench_mnt)
+#   BENCH_OPTS                        extra tableaufs mount options
+#   BENCH_THREADS BENCH_RANDOM BENCH_REWRITE   tfsbench -t, -r and -w
+#   BENCH_OUT                         results (default: bench_results.json)
+#
+# TableauFS always connects to the database called workgroup: point PGHOST
+# at a server dedicated to benchmarking, the generator drops its content.
+
+set -e
+
+TFSBENCH=${1:?usage: run.sh tfsbench tableaufs}
+TABLEAUFS=${2:?usage: run.sh tfsbench tableaufs}
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+: "${PGHOST:=localhost}" "${PGPORT:=5432}" "${PGUSER:=$(id -un)}"
+: "${BENCH_MOUNT:=$(pwd)/bench_mnt}" "${BENCH_OUT:=bench_results.json}"
+export PGHOST PGPORT PGUSER
+
+if [ -z "$BENCH_SKIP_GENERATE" ]; then
+  psql -d postgres -tAc "select 1 from pg_database where datname = 'workgroup'" \
+    | grep -q 1 || createdb workgroup
+  psql -q -d workgroup \
+    -v sites="${BENCH_SITES:-2}" -v projects="${BENCH_PROJECTS:-5}" \
+    -v files="${BENCH_FILES:-20}" -v size_kb="${BENCH_SIZE_KB:-1024}" \
+    -f "$HERE/generate.sql"
+fi
+
+mkdir -p "$BENCH_MOUNT"
+
+"$TFSBENCH" -t "${BENCH_THREADS:-4}" -r "${BENCH_RANDOM:-200}" \
+  -w "${BENCH_REWRITE:-0}" \
+  -m "$TABLEAUFS -o pghost=$PGHOST,pgport=$PGPORT,pguser=$PGUSER,pgpass=${PGPASSWORD:-}${BENCH_OPTS:+,$BENCH_OPTS} $BENCH_MOUNT" \
+  "$BENCH_MOUNT" > "$BENCH_OUT"
+
+echo "Results written to $BENCH_OUT"
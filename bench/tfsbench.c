@@ -0,0 +1,465 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+
+/*
+ * End-to-end benchmark driver for a mounted TableauFS.
+ *
+ * Runs a cold recursive listing, parallel sequential copies, random reads
+ * and optionally a rewrite of files against a mount point, then prints
+ * ops/s, MB/s and latency percentiles of every workload as JSON.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define TFS_BENCH_BUFSIZE (128 * 1024)
+
+typedef struct {
+  const char * mount;
+  const char * mount_cmd;      // run before the workloads, NULL if mounted
+  int threads;
+  int random_reads;            // per thread
+  size_t random_size;
+  int rewrite;                 // number of files to rewrite, 0 skips it
+} tfs_bench_opts_t;
+
+/** Latency samples of one workload, in microseconds */
+typedef struct {
+  uint64_t * v;
+  size_t n, cap;
+  pthread_mutex_t mutex;
+} tfs_bench_samples_t;
+
+typedef struct {
+  const char * name;
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t errors;
+  double seconds;
+  tfs_bench_samples_t lat;
+} tfs_bench_result_t;
+
+/** The files found by the listing, shared by the later workloads */
+static char ** files;
+static off_t * file_sizes;
+static size_t nfiles, files_cap;
+
+static tfs_bench_opts_t opts;
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void add_sample(tfs_bench_samples_t * s, uint64_t us)
+{
+  uint64_t * v;
+
+  pthread_mutex_lock(&s->mutex);
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    if ((v = realloc(s->v, s->cap * sizeof(uint64_t))) == NULL) {
+      pthread_mutex_unlock(&s->mutex);
+      return;
+    }
+    s->v = v;
+  }
+  s->v[s->n++] = us;
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static int cmp_u64(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const tfs_bench_samples_t * s, double p)
+{
+  size_t i;
+
+  if (s->n == 0)
+    return 0;
+
+  i = (size_t)(p * (double)(s->n - 1) + 0.5);
+  return s->v[i];
+}
+
+static void add_file(const char * path, off_t size)
+{
+  char ** f;
+  off_t * sz;
+
+  if (nfiles == files_cap) {
+    files_cap = files_cap ? files_cap * 2 : 256;
+    if ((f = realloc(files, files_cap * sizeof(char *))) == NULL ||
+        (files = f, (sz = realloc(file_sizes, files_cap * sizeof(off_t))) == NULL))
+      return;
+    file_sizes = sz;
+  }
+
+  if ((files[nfiles] = strdup(path)) != NULL)
+    file_sizes[nfiles++] = size;
+}
+
+/** ls -lR: one op per readdir entry stat */
+static void walk(const char * dir, tfs_bench_result_t * r)
+{
+  char path[PATH_MAX];
+  struct dirent * de;
+  struct stat st;
+  uint64_t start;
+  DIR * d;
+
+  if ((d = opendir(dir)) == NULL) {
+    r->errors++;
+    return;
+  }
+
+  while ((de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+        strcmp(de->d_name, ".tableaufs") == 0)
+      continue;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    start = now_us();
+    if (lstat(path, &st) != 0) {
+      r->errors++;
+      continue;
+    }
+    add_sample(&r->lat, now_us() - start);
+    r->ops++;
+
+    if (S_ISDIR(st.st_mode))
+      walk(path, r);
+    else if (S_ISREG(st.st_mode))
+      add_file(path, st.st_size);
+  }
+
+  closedir(d);
+}
+
+static size_t next_file;
+static pthread_mutex_t next_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Hand out the next file of the listing, -1 when done */
+static long take_file(size_t limit)
+{
+  long ret = -1;
+
+  pthread_mutex_lock(&next_mutex);
+  if (next_file < limit)
+    ret = (long)next_file++;
+  pthread_mutex_unlock(&next_mutex);
+
+  return ret;
+}
+
+/** Parallel sequential copy: one op per file, read to the end */
+static void * copy_thread(void * arg)
+{
+  tfs_bench_result_t * r = arg;
+  char * buf = malloc(TFS_BENCH_BUFSIZE);
+  uint64_t start, bytes;
+  ssize_t n;
+  long i;
+  int fd;
+
+  while (buf != NULL && (i = take_file(nfiles)) >= 0) {
+    start = now_us();
+    if ((fd = open(files[i], O_RDONLY)) < 0) {
+      __atomic_fetch_add(&r->errors, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    bytes = 0;
+    while ((n = read(fd, buf, TFS_BENCH_BUFSIZE)) > 0)
+      bytes += (uint64_t)n;
+    if (n < 0)
+      __atomic_fetch_add(&r->errors, 1, __ATOMIC_RELAXED);
+    close(fd);
+
+    add_sample(&r->lat, now_us() - start);
+    __atomic_fetch_add(&r->ops, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&r->bytes, bytes, __ATOMIC_RELAXED);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+/** Random reads: one op per pread of random_size bytes */
+static void * random_thread(void * arg)
+{
+  tfs_bench_result_t * r = arg;
+  char * buf = malloc(opts.random_size);
+  unsigned int seed = (unsigned int)(uintptr_t)&seed ^ (unsigned int)now_us();
+  uint64_t start;
+  size_t f;
+  off_t off;
+  ssize_t n;
+  int i, fd;
+
+  for (i = 0; buf != NULL && i < opts.random_reads; i++) {
+    f = (size_t)rand_r(&seed) % nfiles;
+    off = file_sizes[f] > (off_t)opts.random_size ?
+      (off_t)((uint64_t)rand_r(&seed) * (uint64_t)rand_r(&seed) %
+          (uint64_t)(file_sizes[f] - (off_t)opts.random_size)) : 0;
+
+    if ((fd = open(files[f], O_RDONLY)) < 0) {
+      __atomic_fetch_add(&r->errors, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    start = now_us();
+    n = pread(fd, buf, opts.random_size, off);
+    add_sample(&r->lat, now_us() - start);
+    close(fd);
+
+    if (n < 0) {
+      __atomic_fetch_add(&r->errors, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    __atomic_fetch_add(&r->ops, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&r->bytes, (uint64_t)n, __ATOMIC_RELAXED);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+/** Rewrite: read a file and write the same content back, open to close */
+static void * rewrite_thread(void * arg)
+{
+  tfs_bench_result_t * r = arg;
+  uint64_t start;
+  char * content;
+  size_t len, done;
+  ssize_t n;
+  long i;
+  int fd, err;
+
+  while ((i = take_file((size_t)opts.rewrite < nfiles ?
+          (size_t)opts.rewrite : nfiles)) >= 0) {
+    len = (size_t)file_sizes[i];
+    if ((content = malloc(len ? len : 1)) == NULL)
+      break;
+
+    err = (fd = open(files[i], O_RDONLY)) < 0;
+    for (done = 0; !err && done < len; done += (size_t)n)
+      if ((n = read(fd, content + done, len - done)) <= 0)
+        err = 1;
+    if (fd >= 0)
+      close(fd);
+
+    start = now_us();
+    if (!err && (fd = open(files[i], O_WRONLY | O_TRUNC)) >= 0) {
+      for (done = 0; !err && done < len; done += (size_t)n) {
+        n = write(fd, content + done, len - done < TFS_BENCH_BUFSIZE ?
+            len - done : TFS_BENCH_BUFSIZE);
+        err = n <= 0;
+      }
+      // the commit happens on close
+      err |= close(fd) != 0;
+    } else {
+      err = 1;
+    }
+
+    if (err) {
+      __atomic_fetch_add(&r->errors, 1, __ATOMIC_RELAXED);
+    } else {
+      add_sample(&r->lat, now_us() - start);
+      __atomic_fetch_add(&r->ops, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&r->bytes, (uint64_t)len, __ATOMIC_RELAXED);
+    }
+    free(content);
+  }
+
+  return NULL;
+}
+
+static void run_threads(void * (* fn)(void *), tfs_bench_result_t * r)
+{
+  pthread_t * threads = calloc((size_t)opts.threads, sizeof(pthread_t));
+  uint64_t start = now_us();
+  int i;
+
+  next_file = 0;
+  for (i = 0; threads != NULL && i < opts.threads; i++)
+    pthread_create(&threads[i], NULL, fn, r);
+  for (i = 0; threads != NULL && i < opts.threads; i++)
+    pthread_join(threads[i], NULL);
+
+  r->seconds = (double)(now_us() - start) / 1e6;
+  free(threads);
+}
+
+static void print_result(const tfs_bench_result_t * r, int last)
+{
+  qsort(r->lat.v, r->lat.n, sizeof(uint64_t), cmp_u64);
+
+  printf("    {\"name\":\"%s\",\"ops\":%llu,\"errors\":%llu,\"seconds\":%.3f,"
+      "\"ops_per_s\":%.1f,\"mb_per_s\":%.2f,\"latency_us\":{\"p50\":%llu,"
+      "\"p90\":%llu,\"p99\":%llu,\"max\":%llu}}%s\n", r->name,
+      (unsigned long long)r->ops, (unsigned long long)r->errors, r->seconds,
+      r->seconds > 0 ? (double)r->ops / r->seconds : 0.0,
+      r->seconds > 0 ? (double)r->bytes / r->seconds / 1048576.0 : 0.0,
+      (unsigned long long)percentile(&r->lat, 0.5),
+      (unsigned long long)percentile(&r->lat, 0.9),
+      (unsigned long long)percentile(&r->lat, 0.99),
+      (unsigned long long)(r->lat.n ? r->lat.v[r->lat.n - 1] : 0),
+      last ? "" : ",");
+}
+
+/** Wait until something is mounted on opts.mount */
+static int wait_for_mount()
+{
+  char parent[PATH_MAX];
+  struct stat st, pst;
+  int i;
+
+  snprintf(parent, sizeof(parent), "%s/..", opts.mount);
+  for (i = 0; i < 100; i++) {
+    if (stat(opts.mount, &st) == 0 && stat(parent, &pst) == 0 &&
+        st.st_dev != pst.st_dev)
+      return 0;
+    usleep(100000);
+  }
+
+  return -1;
+}
+
+/** Copy the live counters of the mount into the output, if it has them */
+static void print_server_stats()
+{
+  char path[PATH_MAX], buf[4096];
+  size_t n;
+  FILE * f;
+
+  snprintf(path, sizeof(path), "%s/.tableaufs/stats.json", opts.mount);
+  if ((f = fopen(path, "r")) == NULL) {
+    printf("  \"server_stats\":null\n");
+    return;
+  }
+
+  printf("  \"server_stats\":");
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    fwrite(buf, 1, n, stdout);
+  fclose(f);
+}
+
+static void usage(const char * argv0)
+{
+  fprintf(stderr,
+      "usage: %s [-t threads] [-r random_reads] [-s random_size] "
+      "[-w files_to_rewrite] [-m mount_command] mountpoint\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char * argv[])
+{
+  tfs_bench_result_t results[4];
+  char cmd[PATH_MAX + 32];
+  int c, i, n = 0;
+
+  opts.threads = 4;
+  opts.random_reads = 200;
+  opts.random_size = 4096;
+
+  while ((c = getopt(argc, argv, "t:r:s:w:m:")) != -1) {
+    switch (c) {
+      case 't': opts.threads = atoi(optarg); break;
+      case 'r': opts.random_reads = atoi(optarg); break;
+      case 's': opts.random_size = (size_t)atol(optarg); break;
+      case 'w': opts.rewrite = atoi(optarg); break;
+      case 'm': opts.mount_cmd = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || opts.threads < 1 || opts.random_size == 0)
+    usage(argv[0]);
+  opts.mount = argv[optind];
+
+  if (opts.mount_cmd != NULL &&
+      (system(opts.mount_cmd) != 0 || wait_for_mount() != 0)) {
+    fprintf(stderr, "Mounting with '%s' failed\n", opts.mount_cmd);
+    return 1;
+  }
+
+  memset(results, 0, sizeof(results));
+  for (i = 0; i < 4; i++)
+    pthread_mutex_init(&results[i].lat.mutex, NULL);
+
+  results[n].name = "ls_lR";
+  {
+    uint64_t start = now_us();
+    walk(opts.mount, &results[n]);
+    results[n].seconds = (double)(now_us() - start) / 1e6;
+  }
+  n++;
+
+  if (nfiles > 0) {
+    results[n].name = "sequential_copy";
+    run_threads(copy_thread, &results[n++]);
+
+    results[n].name = "random_read";
+    run_threads(random_thread, &results[n++]);
+
+    if (opts.rewrite > 0) {
+      results[n].name = "rewrite";
+      run_threads(rewrite_thread, &results[n++]);
+    }
+  }
+
+  printf("{\n  \"mount\":\"%s\",\"threads\":%d,\"files\":%zu,\n"
+      "  \"workloads\":[\n", opts.mount, opts.threads, nfiles);
+  for (i = 0; i < n; i++)
+    print_result(&results[i], i == n - 1);
+  printf("  ],\n");
+  print_server_stats();
+  printf("}\n");
+
+  if (opts.mount_cmd != NULL) {
+    snprintf(cmd, sizeof(cmd), "fusermount -u '%s' 2>/dev/null || umount '%s'",
+        opts.mount, opts.mount);
+    if (system(cmd) != 0)
+      fprintf(stderr, "Unmounting %s failed\n", opts.mount);
+  }
+
+  return 0;
+}
@@ -0,0 +1,336 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "blockcache.h"
+#include "log.h"
+
+#define TFS_BC_BUCKETS 8192
+
+/** Room for cache_dir plus a block file name */
+#define TFS_BC_PATH_MAX (PATH_MAX + NAME_MAX + 2)
+
+/**
+ * One cached block. The file of the block is named
+ * <loid>.<block>.<mtime> inside the cache directory.
+ */
+typedef struct tfs_bc_entry_t {
+  uint64_t loid;
+  uint64_t block;
+  time_t mtime;
+  size_t len;
+  struct tfs_bc_entry_t * hnext;  // hash chain
+  struct tfs_bc_entry_t * prev;   // LRU list, most recent first
+  struct tfs_bc_entry_t * next;
+} tfs_bc_entry_t;
+
+static char cache_dir[PATH_MAX];
+static uint64_t cache_max_bytes;
+static uint64_t cache_bytes;
+
+static tfs_bc_entry_t * buckets[TFS_BC_BUCKETS];
+static tfs_bc_entry_t * lru_head;
+static tfs_bc_entry_t * lru_tail;
+
+static pthread_mutex_t bc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_block(uint64_t loid, uint64_t block)
+{
+  return (unsigned int)((loid * 2654435761u + block) % TFS_BC_BUCKETS);
+}
+
+static void block_file(char * path, size_t len, uint64_t loid, uint64_t block,
+    time_t mtime)
+{
+  snprintf(path, len, "%s/%llu.%llu.%lld", cache_dir,
+      (unsigned long long)loid, (unsigned long long)block, (long long)mtime);
+}
+
+static void lru_unlink(tfs_bc_entry_t * e)
+{
+  if (e->prev) e->prev->next = e->next; else lru_head = e->next;
+  if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void lru_push(tfs_bc_entry_t * e)
+{
+  e->prev = NULL;
+  e->next = lru_head;
+  if (lru_head) lru_head->prev = e; else lru_tail = e;
+  lru_head = e;
+}
+
+/** Find the entry of a block. Must be called with bc_mutex held */
+static tfs_bc_entry_t ** find_entry(uint64_t loid, uint64_t block)
+{
+  tfs_bc_entry_t ** ep = &buckets[hash_block(loid, block)];
+
+  while (*ep != NULL && ((*ep)->loid != loid || (*ep)->block != block))
+    ep = &(*ep)->hnext;
+
+  return ep;
+}
+
+/** Remove an entry and its file. Must be called with bc_mutex held */
+static void remove_entry(tfs_bc_entry_t ** ep)
+{
+  tfs_bc_entry_t * e = *ep;
+  char path[TFS_BC_PATH_MAX];
+
+  block_file(path, sizeof(path), e->loid, e->block, e->mtime);
+  unlink(path);
+
+  *ep = e->hnext;
+  lru_unlink(e);
+  cache_bytes -= e->len;
+  free(e);
+}
+
+/** Add an entry as most recently used. Must be called with bc_mutex held */
+static void add_entry(uint64_t loid, uint64_t block, time_t mtime, size_t len)
+{
+  tfs_bc_entry_t * e = calloc(1, sizeof(tfs_bc_entry_t));
+  unsigned int h = hash_block(loid, block);
+
+  if (e == NULL)
+    return;
+
+  e->loid = loid;
+  e->block = block;
+  e->mtime = mtime;
+  e->len = len;
+  e->hnext = buckets[h];
+  buckets[h] = e;
+  lru_push(e);
+  cache_bytes += len;
+}
+
+/** Evict least recently used blocks above the cap. Needs bc_mutex */
+static void evict()
+{
+  while (cache_bytes > cache_max_bytes && lru_tail != NULL)
+    remove_entry(find_entry(lru_tail->loid, lru_tail->block));
+}
+
+typedef struct {
+  unsigned long long loid, block;
+  long long mtime;
+  size_t len;
+  time_t used;
+} tfs_bc_scan_t;
+
+static int cmp_scan_used(const void * a, const void * b)
+{
+  const tfs_bc_scan_t * x = a, * y = b;
+  return (x->used > y->used) - (x->used < y->used);
+}
+
+/** Index the blocks left in the cache directory by earlier mounts */
+static void scan_cache_dir()
+{
+  DIR * dir;
+  struct dirent * de;
+  struct stat st;
+  char path[TFS_BC_PATH_MAX];
+  tfs_bc_scan_t * found = NULL, * tmp;
+  size_t n = 0, cap = 0, i;
+  tfs_bc_scan_t f;
+
+  if ((dir = opendir(cache_dir)) == NULL)
+    return;
+
+  while ((de = readdir(dir)) != NULL) {
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+    if (sscanf(de->d_name, "%llu.%llu.%lld", &f.loid, &f.block, &f.mtime) != 3
+        || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      // leftovers of interrupted stores
+      if (strncmp(de->d_name, ".tmp.", 5) == 0)
+        unlink(path);
+      continue;
+    }
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 1024;
+      if ((tmp = realloc(found, cap * sizeof(tfs_bc_scan_t))) == NULL)
+        break;
+      found = tmp;
+    }
+    f.len = (size_t)st.st_size;
+    f.used = st.st_mtime;
+    found[n++] = f;
+  }
+  closedir(dir);
+
+  // oldest first, so the most recently stored blocks end up at the head
+  qsort(found, n, sizeof(tfs_bc_scan_t), cmp_scan_used);
+
+  pthread_mutex_lock(&bc_mutex);
+  for (i = 0; i < n; i++) {
+    tfs_bc_entry_t ** ep = find_entry(found[i].loid, found[i].block);
+    if (*ep != NULL)
+      remove_entry(ep);
+    add_entry(found[i].loid, found[i].block, (time_t)found[i].mtime,
+        found[i].len);
+  }
+  evict();
+  pthread_mutex_unlock(&bc_mutex);
+
+  free(found);
+}
+
+int TFS_BC_init(const char * dir, unsigned int max_mb)
+{
+  if (dir == NULL)
+    return 0;
+
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    TFS_LOG(TFS_LOG_ERROR, "Cannot create cache_dir '%s': %s", dir,
+        strerror(errno));
+    return -1;
+  }
+
+  // fuse changes to / when it goes to the background
+  if (realpath(dir, cache_dir) == NULL) {
+    TFS_LOG(TFS_LOG_ERROR, "Invalid cache_dir '%s': %s", dir,
+        strerror(errno));
+    cache_dir[0] = '\0';
+    return -1;
+  }
+  cache_max_bytes = (uint64_t)(max_mb ? max_mb : TFS_BC_DEFAULT_SIZE_MB)
+    * 1024 * 1024;
+  scan_cache_dir();
+
+  return 0;
+}
+
+int TFS_BC_enabled()
+{
+  return cache_dir[0] != '\0';
+}
+
+int TFS_BC_open_block(uint64_t loid, time_t mtime, uint64_t block,
+    size_t * len)
+{
+  tfs_bc_entry_t ** ep;
+  char path[TFS_BC_PATH_MAX];
+  int fd;
+
+  pthread_mutex_lock(&bc_mutex);
+  ep = find_entry(loid, block);
+  if (*ep == NULL) {
+    pthread_mutex_unlock(&bc_mutex);
+    return -ENOENT;
+  } else if ((*ep)->mtime != mtime) {
+    // the file was republished since this block was stored
+    remove_entry(ep);
+    pthread_mutex_unlock(&bc_mutex);
+    return -ENOENT;
+  }
+  *len = (*ep)->len;
+  lru_unlink(*ep);
+  lru_push(*ep);
+  pthread_mutex_unlock(&bc_mutex);
+
+  // an eviction running in parallel may remove the file: that is a miss.
+  // Once open, the content stays readable even if the file is evicted
+  block_file(path, sizeof(path), loid, block, mtime);
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -ENOENT;
+
+  return fd;
+}
+
+ssize_t TFS_BC_read_block(uint64_t loid, time_t mtime, uint64_t block,
+    char * buf)
+{
+  ssize_t ret;
+  size_t len;
+  int fd;
+
+  if ((fd = TFS_BC_open_block(loid, mtime, block, &len)) < 0)
+    return fd;
+  ret = pread(fd, buf, len, 0);
+  close(fd);
+
+  return ret == (ssize_t)len ? ret : -ENOENT;
+}
+
+void TFS_BC_store_block(uint64_t loid, time_t mtime, uint64_t block,
+    const char * buf, size_t len)
+{
+  tfs_bc_entry_t ** ep;
+  char path[TFS_BC_PATH_MAX], tmp[TFS_BC_PATH_MAX];
+  int fd;
+
+  // write a temp file first, so a crash never leaves half blocks behind
+  snprintf(tmp, sizeof(tmp), "%s/.tmp.%lx", cache_dir,
+      (unsigned long)pthread_self());
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+    return;
+  if (write(fd, buf, len) != (ssize_t)len) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  close(fd);
+
+  pthread_mutex_lock(&bc_mutex);
+  ep = find_entry(loid, block);
+  if (*ep != NULL)
+    remove_entry(ep);
+
+  block_file(path, sizeof(path), loid, block, mtime);
+  if (rename(tmp, path) == 0) {
+    add_entry(loid, block, mtime, len);
+    evict();
+  } else {
+    unlink(tmp);
+  }
+  pthread_mutex_unlock(&bc_mutex);
+}
+
+void TFS_BC_invalidate(uint64_t loid)
+{
+  tfs_bc_entry_t * e, * next;
+
+  if (!TFS_BC_enabled())
+    return;
+
+  pthread_mutex_lock(&bc_mutex);
+  for (e = lru_head; e != NULL; e = next) {
+    next = e->next;
+    if (e->loid == loid)
+      remove_entry(find_entry(e->loid, e->block));
+  }
+  pthread_mutex_unlock(&bc_mutex);
+}
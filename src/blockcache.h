@@ -0,0 +1,71 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_blockcache_h
+#define tableaufs_blockcache_h
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/** Size of one cached block of large object content */
+#define TFS_BC_BLOCKSIZE (128 * 1024)
+
+/** Default size cap of the cache directory in megabytes */
+#define TFS_BC_DEFAULT_SIZE_MB 1024
+
+/**
+ * Enable the cache in dir, capped at max_mb megabytes.
+ *
+ * Blocks left in dir by earlier mounts are indexed, so the cache
+ * survives remounts.
+ */
+extern int TFS_BC_init(const char * dir, unsigned int max_mb);
+
+/** Returns non-zero if a cache directory was set up */
+extern int TFS_BC_enabled();
+
+/**
+ * Copy block number block of loid into buf (TFS_BC_BLOCKSIZE bytes).
+ *
+ * Blocks cached for a different mtime are stale and get dropped. Returns
+ * the length of the block (short for the last one) or -ENOENT on a miss.
+ */
+extern ssize_t TFS_BC_read_block(uint64_t loid, time_t mtime, uint64_t block,
+    char * buf);
+
+/**
+ * Open the file of block number block of loid, so its content can be
+ * spliced without copying it. Returns the descriptor, to be closed by
+ * the caller, and the length of the block in len, or -ENOENT on a miss.
+ */
+extern int TFS_BC_open_block(uint64_t loid, time_t mtime, uint64_t block,
+    size_t * len);
+
+/** Store len bytes of block number block of loid, evicting LRU blocks */
+extern void TFS_BC_store_block(uint64_t loid, time_t mtime, uint64_t block,
+    const char * buf, size_t len);
+
+/** Drop every block of loid (after a write or a truncate) */
+extern void TFS_BC_invalidate(uint64_t loid);
+
+#endif /* tableaufs_blockcache_h */
@@ -0,0 +1,199 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "cache.h"
+
+#define TFS_CACHE_BUCKETS 4096
+
+typedef struct tfs_cache_entry_t {
+  char * path;
+  int negative;            // cached ENOENT
+  time_t expires;
+  tfs_wg_node_t node;
+  struct tfs_cache_entry_t * hnext;   // hash chain
+  struct tfs_cache_entry_t * prev;    // LRU list, most recent first
+  struct tfs_cache_entry_t * next;
+} tfs_cache_entry_t;
+
+static tfs_cache_entry_t * buckets[TFS_CACHE_BUCKETS];
+static tfs_cache_entry_t * lru_head;
+static tfs_cache_entry_t * lru_tail;
+static unsigned int entries;
+
+static unsigned int cache_ttl = TFS_CACHE_DEFAULT_TTL;
+static unsigned int cache_negative_ttl = TFS_CACHE_DEFAULT_NEGATIVE_TTL;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** FNV-1a hash of the path */
+static unsigned int hash_path(const char * path)
+{
+  uint32_t h = 2166136261u;
+
+  while (*path) {
+    h ^= (unsigned char)*path++;
+    h *= 16777619u;
+  }
+
+  return h % TFS_CACHE_BUCKETS;
+}
+
+static void lru_unlink(tfs_cache_entry_t * e)
+{
+  if (e->prev) e->prev->next = e->next; else lru_head = e->next;
+  if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void lru_push(tfs_cache_entry_t * e)
+{
+  e->prev = NULL;
+  e->next = lru_head;
+  if (lru_head) lru_head->prev = e; else lru_tail = e;
+  lru_head = e;
+}
+
+/** Find the entry for path. Must be called with cache_mutex held */
+static tfs_cache_entry_t ** find_entry(const char * path)
+{
+  tfs_cache_entry_t ** ep = &buckets[hash_path(path)];
+
+  while (*ep != NULL && strcmp((*ep)->path, path) != 0)
+    ep = &(*ep)->hnext;
+
+  return ep;
+}
+
+/** Unlink and free *ep. Must be called with cache_mutex held */
+static void remove_entry(tfs_cache_entry_t ** ep)
+{
+  tfs_cache_entry_t * e = *ep;
+
+  *ep = e->hnext;
+  lru_unlink(e);
+  free(e->path);
+  free(e);
+  entries--;
+}
+
+void TFS_CACHE_init(unsigned int ttl, unsigned int negative_ttl)
+{
+  cache_ttl = ttl;
+  cache_negative_ttl = negative_ttl;
+}
+
+int TFS_CACHE_lookup(const char * path, tfs_wg_node_t * node)
+{
+  tfs_cache_entry_t ** ep;
+  int ret = 0;
+
+  pthread_mutex_lock(&cache_mutex);
+  ep = find_entry(path);
+
+  if (*ep != NULL) {
+    if ((*ep)->expires <= time(NULL)) {
+      remove_entry(ep);
+    } else if ((*ep)->negative) {
+      ret = -ENOENT;
+    } else {
+      memcpy(node, &(*ep)->node, sizeof(tfs_wg_node_t));
+      lru_unlink(*ep);
+      lru_push(*ep);
+      ret = 1;
+    }
+  }
+
+  pthread_mutex_unlock(&cache_mutex);
+  return ret;
+}
+
+void TFS_CACHE_store(const char * path, const tfs_wg_node_t * node, int ret)
+{
+  tfs_cache_entry_t ** ep;
+  tfs_cache_entry_t * e;
+  unsigned int ttl;
+
+  if (ret == 0)
+    ttl = cache_ttl;
+  else if (ret == -ENOENT)
+    ttl = cache_negative_ttl;
+  else
+    return;
+
+  if (ttl == 0)
+    return;
+
+  pthread_mutex_lock(&cache_mutex);
+  ep = find_entry(path);
+
+  if (*ep != NULL) {
+    e = *ep;
+    lru_unlink(e);
+  } else {
+    // make room by dropping the least recently used entry
+    if (entries >= TFS_CACHE_MAX_ENTRIES)
+      remove_entry(find_entry(lru_tail->path));
+
+    e = calloc(1, sizeof(tfs_cache_entry_t));
+    if (e == NULL || (e->path = strdup(path)) == NULL) {
+      free(e);
+      pthread_mutex_unlock(&cache_mutex);
+      return;
+    }
+    e->hnext = buckets[hash_path(path)];
+    buckets[hash_path(path)] = e;
+    entries++;
+  }
+
+  e->negative = (ret != 0);
+  e->expires = time(NULL) + (time_t)ttl;
+  if (ret == 0)
+    memcpy(&e->node, node, sizeof(tfs_wg_node_t));
+  lru_push(e);
+
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+void TFS_CACHE_clear()
+{
+  pthread_mutex_lock(&cache_mutex);
+  while (lru_tail != NULL)
+    remove_entry(find_entry(lru_tail->path));
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+void TFS_CACHE_invalidate(const char * path)
+{
+  tfs_cache_entry_t ** ep;
+
+  pthread_mutex_lock(&cache_mutex);
+  ep = find_entry(path);
+  if (*ep != NULL)
+    remove_entry(ep);
+  pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,62 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_cache_h
+#define tableaufs_cache_h
+#include "workgroup.h"
+
+/** Default lifetime (sec) of a cached stat result */
+#define TFS_CACHE_DEFAULT_TTL 5
+
+/** Default lifetime (sec) of a cached ENOENT result */
+#define TFS_CACHE_DEFAULT_NEGATIVE_TTL 10
+
+/** Maximum number of cached paths */
+#define TFS_CACHE_MAX_ENTRIES 16384
+
+/** Set the entry lifetimes. A ttl of 0 disables that kind of caching */
+extern void TFS_CACHE_init(unsigned int ttl, unsigned int negative_ttl);
+
+/**
+ * Look up the node for path.
+ *
+ * Returns 1 and fills node on a hit, -ENOENT on a negative hit and 0 if
+ * the path has to be resolved from the repository.
+ */
+extern int TFS_CACHE_lookup(const char * path, tfs_wg_node_t * node);
+
+/**
+ * Remember the result of resolving path. ret is the return value of
+ * TFS_WG_stat_file: 0 stores node, -ENOENT stores a negative entry and
+ * other errors are not cached.
+ */
+extern void TFS_CACHE_store(const char * path, const tfs_wg_node_t * node,
+    int ret);
+
+/** Drop path from the cache (after a write or a truncate) */
+extern void TFS_CACHE_invalidate(const char * path);
+
+/** Drop every entry (after rows were deleted in the repository) */
+extern void TFS_CACHE_clear();
+
+#endif /* tableaufs_cache_h */
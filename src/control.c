@@ -0,0 +1,355 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include "control.h"
+#include "stats.h"
+#include "log.h"
+#include "cache.h"
+#include "blockcache.h"
+#include "xattr.h"
+#include "inode.h"
+#include "package.h"
+#include "watch.h"
+
+/** An open control file: its content, or the commands written to it */
+typedef struct {
+  int file;       // index in files
+  size_t len;
+  size_t cap;
+  char * data;
+} tfs_ctl_buf_t;
+
+static size_t render_stats(char * buf, size_t len)
+{
+  return TFS_STATS_format(buf, len, 0);
+}
+
+static size_t render_stats_json(char * buf, size_t len)
+{
+  return TFS_STATS_format(buf, len, 1);
+}
+
+static size_t render_empty(char * buf, size_t len)
+{
+  return (size_t)snprintf(buf, len, "%s", "");
+}
+
+/** Drop every cached view of a file whose content was replaced */
+static void invalidate_file(const char * path, const tfs_wg_node_t * node)
+{
+  uint64_t ino;
+
+  TFS_CACHE_invalidate(path);
+  TFS_BC_invalidate(node->loid);
+  TFS_XATTR_invalidate(node->loid);
+  TFS_PKG_invalidate(node->loid);
+  // same mtime and size: the kernel would keep the old pages otherwise
+  TFS_WG_forget_cache(node->loid);
+
+  // the inode table of the low-level frontend, empty otherwise
+  if ((ino = TFS_INO_child(TFS_INO_ROOT, node->site)) != 0 &&
+      (ino = TFS_INO_child(ino, node->project)) != 0 &&
+      (ino = TFS_INO_child(ino, node->file)) != 0)
+    TFS_INO_invalidate(ino);
+
+  // the copies run on the close of a control file, never from a
+  // request on the destination or its directory
+  TFS_WATCH_notify(node->site, node->project, node->file);
+}
+
+/** Copy the content of the file at src over the file at dst */
+static int copy_file(const char * src, const char * dst)
+{
+  tfs_wg_node_t from, to;
+  int ret;
+
+  if ((ret = TFS_WG_parse_path(src, &from)) != 0 ||
+      (ret = TFS_WG_parse_path(dst, &to)) != 0)
+    return ret;
+  if (from.level != TFS_WG_FILE || to.level != TFS_WG_FILE)
+    return -EISDIR;
+
+  // the flush of pending writes would silently undo the copy
+  if (TFS_WG_dirty(to.loid)) {
+    TFS_LOG(TFS_LOG_WARN, "Not copying over %s: it has unflushed writes", dst);
+    return -EBUSY;
+  }
+
+  ret = TFS_WG_copy(from.loid, to.loid);
+  invalidate_file(dst, &to);
+
+  if (ret != 0)
+    TFS_LOG(TFS_LOG_ERROR, "Copying %s to %s failed: %d", src, dst, ret);
+  else
+    TFS_LOG(TFS_LOG_INFO, "Copied %s to %s", src, dst);
+
+  return ret;
+}
+
+/**
+ * Run the lines "SOURCE<tab>DESTINATION" written to the copy file.
+ * Stops at the first failing copy.
+ */
+static int run_copy(char * cmds)
+{
+  char * line, * save, * dst;
+  int ret = 0;
+
+  for (line = strtok_r(cmds, "\n", &save); line != NULL && ret == 0;
+      line = strtok_r(NULL, "\n", &save)) {
+    if ((dst = strchr(line, '\t')) == NULL)
+      return -EINVAL;
+    *dst++ = '\0';
+    ret = copy_file(line, dst);
+  }
+
+  return ret;
+}
+
+/**
+ * The control files. render works like snprintf, run executes the
+ * commands written to the file, NULL for read-only files
+ */
+static const struct {
+  const char * name;
+  size_t (* render)(char * buf, size_t len);
+  int (* run)(char * cmds);
+} files[] = {
+  { "stats", render_stats, NULL },
+  { "stats.json", render_stats_json, NULL },
+  { "copy", render_empty, run_copy },
+};
+
+#define TFS_CTL_FILES (sizeof(files) / sizeof(files[0]))
+
+int TFS_CTL_is_control(const char * path)
+{
+  size_t len = strlen(TFS_CTL_DIR);
+
+  return strncmp(path, TFS_CTL_DIR, len) == 0 &&
+    (path[len] == '\0' || path[len] == '/');
+}
+
+/** Index of the control file at path, -1 for the directory, -ENOENT */
+static int find_file(const char * path)
+{
+  const char * name = path + strlen(TFS_CTL_DIR);
+  size_t i;
+
+  if (*name == '\0')
+    return -1;
+
+  for (i = 0; i < TFS_CTL_FILES; i++)
+    if (strcmp(name + 1, files[i].name) == 0)
+      return (int)i;
+
+  return -ENOENT;
+}
+
+static void free_buf(tfs_ctl_buf_t * b)
+{
+  free(b->data);
+  free(b);
+}
+
+/** Render a control file into a new buffer */
+static tfs_ctl_buf_t * render(int file)
+{
+  tfs_ctl_buf_t * b;
+  char * tmp;
+  size_t cap = 4096, len;
+
+  if ((b = calloc(1, sizeof(tfs_ctl_buf_t))) == NULL)
+    return NULL;
+  b->file = file;
+
+  // the content may grow between sizing and rendering: retry until it fits
+  for (;;) {
+    if ((tmp = realloc(b->data, cap)) == NULL) {
+      free_buf(b);
+      return NULL;
+    }
+    b->data = tmp;
+
+    len = files[file].render(b->data, cap);
+    if (len < cap)
+      break;
+    cap = len + 1024;
+  }
+
+  b->len = len;
+  b->cap = cap;
+  return b;
+}
+
+/** Permissions of a control file */
+static mode_t file_mode(int file)
+{
+  return files[file].run != NULL ? 0644 : 0444;
+}
+
+int TFS_CTL_getattr(const char * path, struct stat * st)
+{
+  tfs_ctl_buf_t * b;
+  int file = find_file(path);
+
+  if (file == -ENOENT)
+    return -ENOENT;
+
+  memset(st, 0, sizeof(struct stat));
+  st->st_mtime = time(NULL);
+
+  if (file < 0) {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    return 0;
+  }
+
+  // the size has to be right for readers that trust it
+  if ((b = render(file)) == NULL)
+    return -ENOMEM;
+
+  st->st_mode = S_IFREG | file_mode(file);
+  st->st_nlink = 1;
+  st->st_size = (off_t)b->len;
+  free_buf(b);
+
+  return 0;
+}
+
+int TFS_CTL_readdir(const char * path, void * buffer, tfs_wg_add_dir_t filler)
+{
+  struct stat st;
+  size_t i;
+
+  if (find_file(path) != -1)
+    return -ENOTDIR;
+
+  for (i = 0; i < TFS_CTL_FILES; i++) {
+    memset(&st, 0, sizeof(struct stat));
+    st.st_mode = S_IFREG | file_mode((int)i);
+    if (filler(buffer, files[i].name, &st, 0) != 0)
+      break;
+  }
+
+  return 0;
+}
+
+int TFS_CTL_open(const char * path, int flags, uint64_t * fh)
+{
+  tfs_ctl_buf_t * b;
+  int file = find_file(path);
+
+  if (file == -ENOENT)
+    return -ENOENT;
+  else if (file < 0)
+    return -EISDIR;
+  else if ((flags & O_ACCMODE) != O_RDONLY && files[file].run == NULL)
+    return -EACCES;
+
+  if ((b = render(file)) == NULL)
+    return -ENOMEM;
+
+  *fh = (uint64_t)(uintptr_t)b;
+  return 0;
+}
+
+int TFS_CTL_read(uint64_t fh, char * buf, size_t size, off_t offset)
+{
+  tfs_ctl_buf_t * b = (tfs_ctl_buf_t *)(uintptr_t)fh;
+
+  if (offset >= (off_t)b->len)
+    return 0;
+  if (size > b->len - (size_t)offset)
+    size = b->len - (size_t)offset;
+
+  memcpy(buf, b->data + offset, size);
+  return (int)size;
+}
+
+int TFS_CTL_write(uint64_t fh, const char * buf, size_t size, off_t offset)
+{
+  tfs_ctl_buf_t * b = (tfs_ctl_buf_t *)(uintptr_t)fh;
+  size_t end;
+  char * tmp;
+
+  // command files render empty, writes are appended in arrival order
+  (void)offset;
+  if (files[b->file].run == NULL)
+    return -EACCES;
+
+  end = b->len + size;
+  if (end >= TFS_CTL_MAX_INPUT)
+    return -EFBIG;
+
+  if (end + 1 > b->cap) {
+    if ((tmp = realloc(b->data, end + 1)) == NULL)
+      return -ENOMEM;
+    b->data = tmp;
+    b->cap = end + 1;
+  }
+
+  memcpy(b->data + b->len, buf, size);
+  b->len = end;
+  return (int)size;
+}
+
+int TFS_CTL_flush(uint64_t fh)
+{
+  tfs_ctl_buf_t * b = (tfs_ctl_buf_t *)(uintptr_t)fh;
+  int ret;
+
+  if (files[b->file].run == NULL || b->len == 0)
+    return 0;
+
+  b->data[b->len] = '\0';
+  ret = files[b->file].run(b->data);
+  b->len = 0;
+
+  return ret;
+}
+
+int TFS_CTL_truncate(const char * path)
+{
+  int file = find_file(path);
+
+  if (file == -ENOENT)
+    return -ENOENT;
+  else if (file < 0)
+    return -EISDIR;
+
+  // opening the command files with O_TRUNC has to work
+  return files[file].run != NULL ? 0 : -EACCES;
+}
+
+int TFS_CTL_release(uint64_t fh)
+{
+  free_buf((tfs_ctl_buf_t *)(uintptr_t)fh);
+  return 0;
+}
@@ -0,0 +1,65 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_control_h
+#define tableaufs_control_h
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "workgroup.h"
+
+/** Hidden directory of the virtual control files, at the mount root */
+#define TFS_CTL_DIR "/.tableaufs"
+
+/** Most bytes of commands buffered by one open command file */
+#define TFS_CTL_MAX_INPUT (64 * 1024)
+
+/** Returns non-zero if path is the control directory or inside it */
+extern int TFS_CTL_is_control(const char * path);
+
+extern int TFS_CTL_getattr(const char * path, struct stat * st);
+
+extern int TFS_CTL_readdir(const char * path, void * buffer,
+    tfs_wg_add_dir_t filler);
+
+/**
+ * Open a control file. Its content is rendered once, at open. Only
+ * command files (copy) can be opened for writing.
+ */
+extern int TFS_CTL_open(const char * path, int flags, uint64_t * fh);
+
+extern int TFS_CTL_read(uint64_t fh, char * buf, size_t size, off_t offset);
+
+/** Buffer commands written to a command file */
+extern int TFS_CTL_write(uint64_t fh, const char * buf, size_t size,
+    off_t offset);
+
+/** Run the commands buffered since the last flush, returns the first error */
+extern int TFS_CTL_flush(uint64_t fh);
+
+/** Truncating a command file is a no-op, the others are read-only */
+extern int TFS_CTL_truncate(const char * path);
+
+extern int TFS_CTL_release(uint64_t fh);
+
+#endif /* tableaufs_control_h */
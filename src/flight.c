@@ -0,0 +1,112 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <string.h>
+#include "flight.h"
+#include "stats.h"
+
+/** Requests in flight. Few at a time: at most one per FUSE thread */
+static tfs_fl_call_t * calls;
+
+/** Protects calls and the state of every call on it */
+static pthread_mutex_t calls_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Broadcast when a result is ready and when a waiter copied it */
+static pthread_cond_t calls_cond = PTHREAD_COND_INITIALIZER;
+
+int TFS_FL_join(tfs_fl_call_t * call, const char * key, void * result,
+    size_t size, int * ret)
+{
+  tfs_fl_call_t * c;
+
+  memset(call, 0, sizeof(tfs_fl_call_t));
+  call->key = key;
+  call->leader = pthread_self();
+
+  pthread_mutex_lock(&calls_mutex);
+  for (c = calls; c != NULL; c = c->next)
+    if (strcmp(c->key, key) == 0)
+      break;
+
+  if (c == NULL) {
+    call->next = calls;
+    calls = call;
+    pthread_mutex_unlock(&calls_mutex);
+    return 1;
+  }
+
+  // a request issuing itself again further down, e.g. a handle read
+  // falling back to a one-shot read of the same range
+  if (pthread_equal(c->leader, call->leader)) {
+    call->nested = 1;
+    pthread_mutex_unlock(&calls_mutex);
+    return 1;
+  }
+
+  c->waiters++;
+  while (!c->done)
+    pthread_cond_wait(&calls_cond, &calls_mutex);
+
+  *ret = c->ret;
+  memcpy(result, c->result, c->len < size ? c->len : size);
+
+  c->waiters--;
+  pthread_cond_broadcast(&calls_cond);
+  pthread_mutex_unlock(&calls_mutex);
+
+  TFS_STATS_add(TFS_STATS_COALESCED, 1);
+  return 0;
+}
+
+void TFS_FL_finish(tfs_fl_call_t * call, int ret, const void * result,
+    size_t len)
+{
+  tfs_fl_call_t ** p;
+
+  if (call->nested)
+    return;
+
+  pthread_mutex_lock(&calls_mutex);
+  for (p = &calls; *p != call; p = &(*p)->next)
+    ;
+  *p = call->next;
+
+  call->ret = ret;
+  call->result = result;
+  call->len = len;
+  call->done = 1;
+  pthread_cond_broadcast(&calls_cond);
+
+  // result and call belong to the caller, keep them until copied
+  while (call->waiters > 0)
+    pthread_cond_wait(&calls_cond, &calls_mutex);
+  pthread_mutex_unlock(&calls_mutex);
+}
+
+void TFS_FL_read_key(char * key, const char * kind, uint64_t loid,
+    off_t offset, size_t size)
+{
+  snprintf(key, TFS_FL_READ_KEY_LEN, "%s/%llu/%lld/%llu", kind,
+      (unsigned long long)loid, (long long)offset, (unsigned long long)size);
+}
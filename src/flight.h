@@ -0,0 +1,75 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_flight_h
+#define tableaufs_flight_h
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/** Room for a key made by TFS_FL_read_key */
+#define TFS_FL_READ_KEY_LEN 80
+
+/**
+ * A request in flight. Lives on the stack of the thread running it,
+ * duplicates of the request wait for it and copy its result.
+ */
+typedef struct tfs_fl_call_t {
+  const char * key;       // identifies the request
+  pthread_t leader;       // thread running the request
+  int nested;             // joined by its own leader, nothing to publish
+  int done;               // result is ready
+  int ret;                // return value of the request
+  const void * result;    // result buffer of the leader
+  size_t len;             // valid bytes in result
+  unsigned int waiters;   // threads still copying the result
+  struct tfs_fl_call_t * next;
+} tfs_fl_call_t;
+
+/**
+ * Join the request key.
+ *
+ * If no identical request is in flight, the caller becomes its leader:
+ * returns 1, and the caller has to run the request and hand its outcome
+ * to TFS_FL_finish. Otherwise waits for the leader, copies at most size
+ * bytes of its result to result, sets ret and returns 0. key has to stay
+ * valid until TFS_FL_finish.
+ */
+extern int TFS_FL_join(tfs_fl_call_t * call, const char * key, void * result,
+    size_t size, int * ret);
+
+/**
+ * Publish the outcome of a request: ret and the first len bytes of
+ * result. Returns once every waiting duplicate has copied it.
+ */
+extern void TFS_FL_finish(tfs_fl_call_t * call, int ret, const void * result,
+    size_t len);
+
+/**
+ * Key of a read of size bytes at offset of loid. Reads of a different
+ * kind do not share results, their errors may mean something else.
+ */
+extern void TFS_FL_read_key(char * key, const char * kind, uint64_t loid,
+    off_t offset, size_t size);
+
+#endif /* tableaufs_flight_h */
@@ -0,0 +1,721 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "workgroup.h"
+#include "pgpool.h"
+#include "blockcache.h"
+#include "readahead.h"
+#include "worker.h"
+#include "writeback.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "log.h"
+#include "xattr.h"
+#include "flight.h"
+#include "stripe.h"
+#include "package.h"
+#include "libpq-fe.h"
+#include "libpq/libpq-fs.h"
+
+/** Open handles, walked by the idle reaper */
+static tfs_wg_handle_t * open_handles;
+static pthread_mutex_t open_handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int idle_timeout = TFS_WG_DEFAULT_IDLE_TIMEOUT;
+
+#define TFS_WG_SEEN_SLOTS 4096
+
+/** Version of a file at its last open, to decide about the page cache */
+typedef struct {
+  uint64_t loid;
+  time_t mtime;
+  off_t size;
+} tfs_wg_seen_t;
+
+static tfs_wg_seen_t seen[TFS_WG_SEEN_SLOTS];
+static pthread_mutex_t seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline tfs_wg_handle_t * handle_of(uint64_t fh)
+{
+  return (tfs_wg_handle_t *)(uintptr_t)fh;
+}
+
+/**
+ * Bind a connection, a transaction and a read LO descriptor to the handle.
+ *
+ * Only takes a connection if one is free right away: handles held open
+ * by idle clients must not starve the rest of the file system. Returns
+ * 0 if the handle could not be attached, callers fall back to one-shot
+ * TFS_WG_IO_operation calls then.
+ */
+static int attach(tfs_wg_handle_t * h)
+{
+  PGresult * res;
+  PGconn * conn;
+
+  h->pc = TFS_PG_try_checkout_read();
+  if (h->pc == NULL)
+    return 0;
+  conn = h->pc->conn;
+
+  res = PQexec(conn, "BEGIN");
+  PQclear(res);
+
+  // writes are buffered and committed separately by TFS_WB_commit
+  h->fd = lo_open(conn, (Oid)h->loid, INV_READ);
+  if (h->fd < 0) {
+    TFS_LOG(TFS_LOG_WARN, "lo_open failed on %lu: %s",
+        (unsigned long)h->loid, PQerrorMessage(conn));
+    TFS_PG_checkin(h->pc);
+    h->pc = NULL;
+    return 0;
+  }
+
+  h->pos = 0;
+  return 1;
+}
+
+/** Close the LO descriptor, end the transaction and give back pc */
+static void release_conn(tfs_pg_conn_t * pc, int fd)
+{
+  PGresult * res;
+
+  lo_close(pc->conn, fd);
+
+  res = PQexec(pc->conn, "END");
+  PQclear(res);
+
+  TFS_PG_checkin(pc);
+}
+
+/** Give back the connection bound to the handle */
+static void detach(tfs_wg_handle_t * h)
+{
+  if (h->pc == NULL)
+    return;
+
+  release_conn(h->pc, h->fd);
+  h->pc = NULL;
+  h->fd = -1;
+}
+
+/** Position fd, skipping the round trip for sequential access */
+static int seek_to(tfs_wg_handle_t * h, off_t offset)
+{
+  if (h->pos == offset)
+    return 0;
+
+#ifdef HAVE_LO_LSEEK64
+  if ( lo_lseek64(h->pc->conn, h->fd, offset, SEEK_SET) < 0 )
+#else
+  if ( lo_lseek(h->pc->conn, h->fd, (int)offset, SEEK_SET) < 0 )
+#endif // HAVE_LO_LSEEK64
+  {
+    h->pos = -1;
+    return -EINVAL;
+  }
+
+  h->pos = offset;
+  return 0;
+}
+
+/** Read through the bound descriptor, or one-shot if detached */
+static int handle_fetch(tfs_wg_handle_t * h, char * dst, size_t size,
+    off_t offset)
+{
+  uint64_t start;
+  int ret;
+
+  // the page engine needs neither a transaction nor a descriptor
+  if (TFS_WG_get_readmode() == TFS_WG_READMODE_PAGES)
+    return TFS_WG_IO_operation(TFS_WG_READ, h->loid, NULL, dst, size, offset);
+
+  pthread_mutex_lock(&h->mutex);
+  h->last_used = time(NULL);
+
+  if (h->pc == NULL && !attach(h)) {
+    pthread_mutex_unlock(&h->mutex);
+    return TFS_WG_IO_operation(TFS_WG_READ, h->loid, NULL, dst, size, offset);
+  }
+
+  TFS_PG_stamp(h->pc);
+  ret = seek_to(h, offset);
+  if (ret == 0) {
+    start = TFS_STATS_now();
+    ret = lo_read(h->pc->conn, h->fd, dst, size);
+    TFS_STATS_record(TFS_STATS_SQL_LO_READ, start, ret);
+
+    if (ret < 0) {
+      TFS_LOG(TFS_LOG_ERROR, "LO I/O failed on %lu: %s",
+          (unsigned long)h->loid, PQerrorMessage(h->pc->conn));
+      ret = -EIO;
+      h->pos = -1;
+    } else {
+      h->pos += ret;
+      TFS_STATS_add(TFS_STATS_BYTES_FETCHED, (uint64_t)ret);
+    }
+  }
+
+  // an aborted transaction is of no use for further reads
+  if (ret < 0)
+    detach(h);
+
+  pthread_mutex_unlock(&h->mutex);
+  return ret;
+}
+
+/**
+ * Read from the repository. Clients opening the same file at once read
+ * the same ranges: only the first of them is sent, the others wait for
+ * its result.
+ */
+static int handle_read(tfs_wg_handle_t * h, char * dst, size_t size,
+    off_t offset)
+{
+  tfs_fl_call_t call;
+  char key[TFS_FL_READ_KEY_LEN];
+  int ret;
+
+  // the same key as TFS_WG_IO_operation, which the fallback joins
+  TFS_FL_read_key(key, "read", h->loid, offset, size);
+  if (!TFS_FL_join(&call, key, dst, size, &ret))
+    return ret;
+
+  ret = handle_fetch(h, dst, size, offset);
+  TFS_FL_finish(&call, ret, dst, ret > 0 ? (size_t)ret : 0);
+  return ret;
+}
+
+/** Read a full cache block from the repository */
+static ssize_t fetch_block(tfs_wg_handle_t * h, uint64_t block, char * buf)
+{
+  size_t len = 0;
+  int ret;
+
+  while (len < TFS_BC_BLOCKSIZE) {
+    ret = handle_read(h, buf + len, TFS_BC_BLOCKSIZE - len,
+        (off_t)(block * TFS_BC_BLOCKSIZE + len));
+    if (ret < 0)
+      return ret;
+    else if (ret == 0)
+      break;
+    len += (size_t)ret;
+  }
+
+  return (ssize_t)len;
+}
+
+/**
+ * Fetch blocks first to first+n-1 in one pipeline and store them in the
+ * block cache. Returns 0 if the cache could not be filled this way.
+ */
+static int fill_blocks(tfs_wg_handle_t * h, uint64_t first, uint64_t n)
+{
+  char * span;
+  uint64_t i;
+  size_t len;
+  int got;
+
+  if ((span = malloc(n * TFS_BC_BLOCKSIZE)) == NULL)
+    return 0;
+
+  // long spans go faster over several connections than pipelined on one
+  if (TFS_STRIPE_worth(n * TFS_BC_BLOCKSIZE))
+    got = TFS_STRIPE_read(h->loid, span, n * TFS_BC_BLOCKSIZE,
+        (off_t)(first * TFS_BC_BLOCKSIZE));
+  else
+    got = TFS_WG_read_chunks(h->loid, span, n * TFS_BC_BLOCKSIZE,
+        (off_t)(first * TFS_BC_BLOCKSIZE), TFS_BC_BLOCKSIZE);
+
+  for (i = 0; got >= 0 && i < n && (size_t)got > i * TFS_BC_BLOCKSIZE; i++) {
+    len = (size_t)got - i * TFS_BC_BLOCKSIZE;
+    if (len > TFS_BC_BLOCKSIZE)
+      len = TFS_BC_BLOCKSIZE;
+    TFS_BC_store_block(h->loid, h->mtime, first + i,
+        span + i * TFS_BC_BLOCKSIZE, len);
+  }
+
+  free(span);
+  return got >= 0;
+}
+
+/**
+ * Serve a read from the local block cache, filling missing blocks from
+ * the repository. Reads hitting the cache never touch Postgres.
+ */
+static int cached_read(tfs_wg_handle_t * h, char * buf, size_t size,
+    off_t offset)
+{
+  char * block;
+  uint64_t blk, last;
+  size_t done = 0, skip, n;
+  ssize_t len = 0;
+  int filled = 0;
+
+  if ((block = malloc(TFS_BC_BLOCKSIZE)) == NULL)
+    return -ENOMEM;
+
+  while (done < size) {
+    blk = (uint64_t)(offset + (off_t)done) / TFS_BC_BLOCKSIZE;
+    skip = (size_t)((uint64_t)(offset + (off_t)done) % TFS_BC_BLOCKSIZE);
+
+    len = TFS_BC_read_block(h->loid, h->mtime, blk, block);
+    TFS_STATS_add(len < 0 ? TFS_STATS_CACHE_MISSES : TFS_STATS_CACHE_HITS, 1);
+
+    // several blocks missing: get all of them with one round trip
+    last = (uint64_t)(offset + (off_t)size - 1) / TFS_BC_BLOCKSIZE;
+    if (len < 0 && !filled && last > blk) {
+      filled = 1;
+      if (last - blk >= TFS_PL_MAX)
+        last = blk + TFS_PL_MAX - 1;
+      if (fill_blocks(h, blk, last - blk + 1))
+        len = TFS_BC_read_block(h->loid, h->mtime, blk, block);
+    }
+
+    if (len < 0) {
+      if ((len = fetch_block(h, blk, block)) < 0)
+        break;
+      if (len > 0)
+        TFS_BC_store_block(h->loid, h->mtime, blk, block, (size_t)len);
+    }
+
+    // end of file
+    if ((size_t)len <= skip)
+      break;
+
+    n = (size_t)len - skip;
+    if (n > size - done)
+      n = size - done;
+    memcpy(buf + done, block + skip, n);
+    done += n;
+
+    if (len < TFS_BC_BLOCKSIZE)
+      break;
+  }
+
+  free(block);
+
+  if (len < 0 && done == 0)
+    return (int)len;
+  return (int)done;
+}
+
+/**
+ * Open the cache file of block blk, fetching it into the cache on a
+ * miss. last is the last block of the read, missing blocks up to it are
+ * fetched together with blk.
+ */
+static int open_block(tfs_wg_handle_t * h, uint64_t blk, uint64_t last,
+    size_t * len)
+{
+  char * block;
+  ssize_t got;
+  int fd;
+
+  fd = TFS_BC_open_block(h->loid, h->mtime, blk, len);
+  TFS_STATS_add(fd < 0 ? TFS_STATS_CACHE_MISSES : TFS_STATS_CACHE_HITS, 1);
+  if (fd >= 0)
+    return fd;
+
+  if (last > blk) {
+    if (last - blk >= TFS_PL_MAX)
+      last = blk + TFS_PL_MAX - 1;
+    if (fill_blocks(h, blk, last - blk + 1) &&
+        (fd = TFS_BC_open_block(h->loid, h->mtime, blk, len)) >= 0)
+      return fd;
+  }
+
+  if ((block = malloc(TFS_BC_BLOCKSIZE)) == NULL)
+    return -ENOMEM;
+
+  if ((got = fetch_block(h, blk, block)) > 0) {
+    TFS_BC_store_block(h->loid, h->mtime, blk, block, (size_t)got);
+    fd = TFS_BC_open_block(h->loid, h->mtime, blk, len);
+  } else {
+    // nothing at or after the end of the file
+    *len = 0;
+    fd = got < 0 ? (int)got : -ENODATA;
+  }
+
+  free(block);
+  return fd;
+}
+
+int TFS_WG_read_extents(uint64_t fh, size_t size, off_t offset,
+    tfs_wg_extent_t * ext, int max)
+{
+  tfs_wg_handle_t * h = handle_of(fh);
+  uint64_t blk, last;
+  size_t done = 0, skip, len;
+  int n = 0, fd;
+
+  if (!TFS_BC_enabled() || (h->mode & INV_WRITE))
+    return -ENOTSUP;
+
+  last = (uint64_t)(offset + (off_t)size - 1) / TFS_BC_BLOCKSIZE;
+
+  while (done < size && n < max) {
+    blk = (uint64_t)(offset + (off_t)done) / TFS_BC_BLOCKSIZE;
+    skip = (size_t)((uint64_t)(offset + (off_t)done) % TFS_BC_BLOCKSIZE);
+
+    if ((fd = open_block(h, blk, last, &len)) < 0) {
+      if (fd == -ENODATA || n > 0)
+        break;
+      return fd;
+    }
+
+    // end of file
+    if (len <= skip) {
+      close(fd);
+      break;
+    }
+
+    ext[n].fd = fd;
+    ext[n].pos = (off_t)skip;
+    ext[n].len = len - skip < size - done ? len - skip : size - done;
+    done += ext[n].len;
+    n++;
+
+    if (len < TFS_BC_BLOCKSIZE)
+      break;
+  }
+
+  // keeps the prefetch going, which fills the cache ahead of the reader
+  TFS_RA_update(&h->ra, offset, done);
+  return n;
+}
+
+int TFS_WG_open(const tfs_wg_node_t * node, int mode, uint64_t * fh)
+{
+  tfs_wg_handle_t * h;
+
+  if (node->level != TFS_WG_FILE )
+    return -EISDIR;
+
+  h = calloc(1, sizeof(tfs_wg_handle_t));
+  if (h == NULL)
+    return -ENOMEM;
+
+  h->loid = node->loid;
+  h->mtime = node->st.st_mtime;
+  h->mode = (mode & O_ACCMODE) == O_RDONLY ? INV_READ : INV_READ | INV_WRITE;
+  h->fd = -1;
+  h->last_used = time(NULL);
+  pthread_mutex_init(&h->mutex, NULL);
+  TFS_RA_init(&h->ra, h->loid, h->mtime, node->st.st_size);
+  TFS_WB_init(&h->wb, node->st.st_size);
+  if ((h->mode & INV_WRITE) && (mode & O_TRUNC))
+    TFS_WB_truncate(&h->wb, 0);
+
+  pthread_mutex_lock(&open_handles_mutex);
+  h->next = open_handles;
+  if (open_handles)
+    open_handles->prev = h;
+  open_handles = h;
+  pthread_mutex_unlock(&open_handles_mutex);
+
+  *fh = (uint64_t)(uintptr_t)h;
+  return 0;
+}
+
+/** Read the committed content with the uncommitted changes on top */
+static int buffered_read(tfs_wg_handle_t * h, char * buf, size_t size,
+    off_t offset)
+{
+  off_t file_size, base_size;
+  size_t done = 0, base_len;
+  int ret;
+
+  pthread_mutex_lock(&h->mutex);
+  file_size = h->wb.size;
+  base_size = h->wb.base_size;
+  pthread_mutex_unlock(&h->mutex);
+
+  if (offset >= file_size)
+    return 0;
+  if ((off_t)size > file_size - offset)
+    size = (size_t)(file_size - offset);
+
+  base_len = offset < base_size ? (size_t)(base_size - offset) : 0;
+  if (base_len > size)
+    base_len = size;
+
+  while (done < base_len) {
+    ret = handle_read(h, buf + done, base_len - done, offset + (off_t)done);
+    if (ret < 0)
+      return ret;
+    else if (ret == 0)
+      break;
+    done += (size_t)ret;
+  }
+  memset(buf + done, 0, size - done);
+
+  pthread_mutex_lock(&h->mutex);
+  TFS_WB_overlay(&h->wb, buf, size, offset);
+  pthread_mutex_unlock(&h->mutex);
+
+  return (int)size;
+}
+
+int TFS_WG_read(uint64_t fh, char * buf, size_t size, off_t offset)
+{
+  tfs_wg_handle_t * h = handle_of(fh);
+  size_t done = 0;
+  int ret;
+
+  if (h->mode & INV_WRITE)
+    return buffered_read(h, buf, size, offset);
+
+  done = TFS_RA_read(&h->ra, buf, size, offset);
+
+  if (done < size) {
+    if (TFS_BC_enabled())
+      ret = cached_read(h, buf + done, size - done, offset + (off_t)done);
+    else if (TFS_STRIPE_worth(size - done))
+      ret = TFS_STRIPE_read(h->loid, buf + done, size - done,
+          offset + (off_t)done);
+    else
+      ret = handle_read(h, buf + done, size - done, offset + (off_t)done);
+
+    if (ret < 0 && done == 0)
+      return ret;
+    else if (ret > 0)
+      done += (size_t)ret;
+  }
+
+  TFS_RA_update(&h->ra, offset, done);
+  return (int)done;
+}
+
+int TFS_WG_write(uint64_t fh, const char * buf, size_t size, off_t offset)
+{
+  tfs_wg_handle_t * h = handle_of(fh);
+  int ret;
+
+  pthread_mutex_lock(&h->mutex);
+  h->last_used = time(NULL);
+  ret = TFS_WB_write(&h->wb, buf, size, offset);
+  pthread_mutex_unlock(&h->mutex);
+
+  return ret;
+}
+
+int TFS_WG_ftruncate(uint64_t fh, off_t size)
+{
+  tfs_wg_handle_t * h = handle_of(fh);
+
+  if (!(h->mode & INV_WRITE))
+    return -EBADF;
+
+  pthread_mutex_lock(&h->mutex);
+  TFS_WB_truncate(&h->wb, size);
+  pthread_mutex_unlock(&h->mutex);
+
+  return 0;
+}
+
+off_t TFS_WG_size(uint64_t fh, off_t size)
+{
+  tfs_wg_handle_t * h = handle_of(fh);
+
+  if (h->mode & INV_WRITE) {
+    pthread_mutex_lock(&h->mutex);
+    size = h->wb.size;
+    pthread_mutex_unlock(&h->mutex);
+  }
+
+  return size;
+}
+
+int TFS_WG_keep_cache(const tfs_wg_node_t * node)
+{
+  tfs_wg_seen_t * slot = &seen[node->loid % TFS_WG_SEEN_SLOTS];
+  int ret;
+
+  pthread_mutex_lock(&seen_mutex);
+  ret = slot->loid == node->loid && slot->mtime == node->st.st_mtime &&
+    slot->size == node->st.st_size;
+  slot->loid = node->loid;
+  slot->mtime = node->st.st_mtime;
+  slot->size = node->st.st_size;
+  pthread_mutex_unlock(&seen_mutex);
+
+  return ret;
+}
+
+void TFS_WG_forget_cache(uint64_t loid)
+{
+  tfs_wg_seen_t * slot = &seen[loid % TFS_WG_SEEN_SLOTS];
+
+  pthread_mutex_lock(&seen_mutex);
+  if (slot->loid == loid)
+    memset(slot, 0, sizeof(tfs_wg_seen_t));
+  pthread_mutex_unlock(&seen_mutex);
+}
+
+/** Commit the buffered changes. Must be called with h->mutex held */
+static int commit(tfs_wg_handle_t * h)
+{
+  int ret;
+
+  if (!TFS_WB_dirty(&h->wb))
+    return 0;
+
+  if ((ret = TFS_WB_commit(&h->wb, h->loid)) == 0) {
+    // cached blocks and the snapshot of the read descriptor are outdated
+    TFS_BC_invalidate(h->loid);
+    TFS_XATTR_invalidate(h->loid);
+    TFS_PKG_invalidate(h->loid);
+    TFS_WG_forget_cache(h->loid);
+    detach(h);
+  }
+
+  return ret;
+}
+
+int TFS_WG_flush(uint64_t fh)
+{
+  tfs_wg_handle_t * h = handle_of(fh);
+  int ret = 0;
+
+  // writes become visible to others with the commit; plain readers keep
+  // their descriptor for the next read
+  pthread_mutex_lock(&h->mutex);
+  if (h->mode & INV_WRITE)
+    ret = commit(h);
+  pthread_mutex_unlock(&h->mutex);
+
+  return ret;
+}
+
+int TFS_WG_dirty(uint64_t loid)
+{
+  tfs_wg_handle_t * h;
+  int dirty = 0;
+
+  pthread_mutex_lock(&open_handles_mutex);
+  for (h = open_handles; h != NULL && !dirty; h = h->next) {
+    if (h->loid != loid || !(h->mode & INV_WRITE))
+      continue;
+
+    pthread_mutex_lock(&h->mutex);
+    dirty = TFS_WB_dirty(&h->wb);
+    pthread_mutex_unlock(&h->mutex);
+  }
+  pthread_mutex_unlock(&open_handles_mutex);
+
+  return dirty;
+}
+
+int TFS_WG_release(uint64_t fh)
+{
+  tfs_wg_handle_t * h = handle_of(fh);
+  int ret;
+
+  pthread_mutex_lock(&open_handles_mutex);
+  if (h->prev) h->prev->next = h->next; else open_handles = h->next;
+  if (h->next) h->next->prev = h->prev;
+  pthread_mutex_unlock(&open_handles_mutex);
+
+  pthread_mutex_lock(&h->mutex);
+  ret = commit(h);
+  detach(h);
+  pthread_mutex_unlock(&h->mutex);
+
+  TFS_WB_destroy(&h->wb);
+  TFS_RA_destroy(&h->ra);
+  pthread_mutex_destroy(&h->mutex);
+  free(h);
+
+  return ret;
+}
+
+/** Background thread giving back the connections of idle handles */
+static void * idle_reaper(void * arg)
+{
+  tfs_wg_handle_t * h;
+  tfs_pg_conn_t * pcs[TFS_WG_REAP_BATCH];
+  int fds[TFS_WG_REAP_BATCH];
+  size_t i, n;
+  time_t now;
+
+  for (;;) {
+    sleep(1);
+    now = time(NULL);
+
+    // only take the connections away under the lock, the round trips
+    // to give them back must not block opening and releasing handles
+    n = 0;
+    pthread_mutex_lock(&open_handles_mutex);
+    for (h = open_handles; h != NULL && n < TFS_WG_REAP_BATCH; h = h->next) {
+      // a busy handle is not idle: skip it instead of waiting
+      if (pthread_mutex_trylock(&h->mutex) != 0)
+        continue;
+
+      if (h->pc != NULL && now - h->last_used >= (time_t)idle_timeout) {
+        pcs[n] = h->pc;
+        fds[n++] = h->fd;
+        h->pc = NULL;
+        h->fd = -1;
+      }
+
+      pthread_mutex_unlock(&h->mutex);
+    }
+    pthread_mutex_unlock(&open_handles_mutex);
+
+    for (i = 0; i < n; i++)
+      release_conn(pcs[i], fds[i]);
+
+    TFS_WG_reap_dirs(now, idle_timeout);
+  }
+
+  return NULL;
+}
+
+int TFS_WG_start_handles(unsigned int timeout)
+{
+  pthread_t thread;
+
+  if (timeout > 0)
+    idle_timeout = timeout;
+
+  if (pthread_create(&thread, NULL, idle_reaper, NULL) != 0)
+    return -1;
+
+  pthread_detach(thread);
+  return 0;
+}
+
+int TFS_WG_start_workers()
+{
+  // striped reads need a worker for every stripe beyond the first
+  return TFS_WORKER_start(TFS_WORKER_THREADS + TFS_STRIPE_width() - 1);
+}
@@ -0,0 +1,481 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "inode.h"
+#include "cache.h"
+#include "control.h"
+
+typedef struct tfs_ino_entry_t {
+  uint64_t ino;
+  uint64_t parent;
+  tfs_wg_level_t level;
+  int control;                     // the control directory or a file in it
+  char * name;                     // name inside the parent
+  uint64_t loid;                   // repo id, if file
+  struct stat st;
+  time_t expires;                  // st is valid until
+  uint64_t nlookup;                // references held by the kernel
+  unsigned int children;           // entries with this parent
+  struct tfs_ino_entry_t * inext;  // chain of the inode table
+  struct tfs_ino_entry_t * nnext;  // chain of the (parent, name) table
+} tfs_ino_entry_t;
+
+static tfs_ino_entry_t * by_ino[TFS_INO_BUCKETS];
+static tfs_ino_entry_t * by_name[TFS_INO_BUCKETS];
+
+// never forgotten, never in the hash tables
+static tfs_ino_entry_t root = { .ino = TFS_INO_ROOT, .level = TFS_WG_ROOT };
+
+static uint64_t next_ino = TFS_INO_ROOT + 1;
+static unsigned int idle;        // entries without kernel references
+static unsigned int ino_ttl = TFS_CACHE_DEFAULT_TTL;
+
+static pthread_mutex_t ino_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** FNV-1a hash of the name, seeded with the parent inode */
+static unsigned int hash_name(uint64_t parent, const char * name)
+{
+  uint32_t h = 2166136261u ^ (uint32_t)parent;
+
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+
+  return h % TFS_INO_BUCKETS;
+}
+
+/** Must be called with ino_mutex held, as all the helpers below */
+static tfs_ino_entry_t * find_ino(uint64_t ino)
+{
+  tfs_ino_entry_t * e;
+
+  if (ino == TFS_INO_ROOT)
+    return &root;
+
+  for (e = by_ino[ino % TFS_INO_BUCKETS]; e != NULL; e = e->inext)
+    if (e->ino == ino)
+      break;
+
+  return e;
+}
+
+static tfs_ino_entry_t * find_name(uint64_t parent, const char * name)
+{
+  tfs_ino_entry_t * e;
+
+  for (e = by_name[hash_name(parent, name)]; e != NULL; e = e->nnext)
+    if (e->parent == parent && strcmp(e->name, name) == 0)
+      break;
+
+  return e;
+}
+
+static tfs_ino_entry_t * create_entry(tfs_ino_entry_t * p, const char * name,
+    tfs_wg_level_t level, int control)
+{
+  tfs_ino_entry_t * e = calloc(1, sizeof(tfs_ino_entry_t));
+  unsigned int h;
+
+  if (e == NULL || (e->name = strdup(name)) == NULL) {
+    free(e);
+    return NULL;
+  }
+
+  e->ino = next_ino++ | (control ? TFS_INO_CONTROL : 0);
+  e->parent = p->ino;
+  e->level = level;
+  e->control = control;
+  p->children++;
+  idle++;
+
+  e->inext = by_ino[e->ino % TFS_INO_BUCKETS];
+  by_ino[e->ino % TFS_INO_BUCKETS] = e;
+  h = hash_name(e->parent, e->name);
+  e->nnext = by_name[h];
+  by_name[h] = e;
+
+  return e;
+}
+
+/** Unlink and free e, which must have no children */
+static void remove_entry(tfs_ino_entry_t * e)
+{
+  tfs_ino_entry_t ** ep, * p;
+
+  for (ep = &by_ino[e->ino % TFS_INO_BUCKETS]; *ep != e; ep = &(*ep)->inext)
+    ;
+  *ep = e->inext;
+
+  for (ep = &by_name[hash_name(e->parent, e->name)]; *ep != e;
+      ep = &(*ep)->nnext)
+    ;
+  *ep = e->nnext;
+
+  if ((p = find_ino(e->parent)) != NULL)
+    p->children--;
+  if (e->nlookup == 0)
+    idle--;
+
+  free(e->name);
+  free(e);
+}
+
+/** Remove e and its ancestors as long as nothing refers to them */
+static void release_unused(tfs_ino_entry_t * e)
+{
+  tfs_ino_entry_t * p;
+
+  while (e != NULL && e != &root && e->nlookup == 0 && e->children == 0) {
+    p = find_ino(e->parent);
+    remove_entry(e);
+    e = p;
+  }
+}
+
+/** Drop all unreferenced leaves, their parents go on the next sweep */
+static void sweep()
+{
+  tfs_ino_entry_t ** ep, * e;
+  unsigned int i;
+
+  for (i = 0; i < TFS_INO_BUCKETS; i++) {
+    ep = &by_ino[i];
+    while ((e = *ep) != NULL) {
+      if (e->nlookup == 0 && e->children == 0)
+        remove_entry(e);  // moves *ep to the next entry
+      else
+        ep = &e->inext;
+    }
+  }
+}
+
+/** Fill node with the identity and the last known stat of e */
+static void fill_node(const tfs_ino_entry_t * e, tfs_wg_node_t * node)
+{
+  node->level = e->level;
+  node->loid = e->loid;
+  node->site[0] = node->project[0] = node->file[0] = '\0';
+  memcpy(&node->st, &e->st, sizeof(struct stat));
+
+  for (; e != NULL && e != &root; e = find_ino(e->parent)) {
+    switch (e->level) {
+      case TFS_WG_SITE: strcpy(node->site, e->name); break;
+      case TFS_WG_PROJECT: strcpy(node->project, e->name); break;
+      default: strcpy(node->file, e->name); break;
+    }
+  }
+}
+
+/** Control path of the child name of p */
+static void control_path(const tfs_ino_entry_t * p, const char * name,
+    char * path, size_t len)
+{
+  if (p == &root)
+    snprintf(path, len, "%s", TFS_CTL_DIR);
+  else
+    snprintf(path, len, "%s/%s", TFS_CTL_DIR, name);
+}
+
+/** Store a fresh stat of e */
+static void update(tfs_ino_entry_t * e, const tfs_wg_node_t * node)
+{
+  e->loid = node->loid;
+  memcpy(&e->st, &node->st, sizeof(struct stat));
+  e->st.st_ino = (ino_t)e->ino;
+  // control files change with every read of them
+  e->expires = e->control ? 0 : time(NULL) + (time_t)ino_ttl;
+}
+
+/** Copy the stat of e and count a kernel reference */
+static void take_ref(tfs_ino_entry_t * e, struct stat * st)
+{
+  if (e->nlookup++ == 0)
+    idle--;
+  memcpy(st, &e->st, sizeof(struct stat));
+}
+
+void TFS_INO_init(unsigned int ttl)
+{
+  ino_ttl = ttl;
+}
+
+int TFS_INO_lookup(uint64_t parent, const char * name, struct stat * st)
+{
+  tfs_ino_entry_t * p, * e;
+  tfs_wg_node_t node;
+  char path[PATH_MAX];
+  int control = 0, ret = 0;
+
+  if (strlen(name) > NAME_MAX)
+    return -ENAMETOOLONG;
+
+  pthread_mutex_lock(&ino_mutex);
+
+  if ((p = find_ino(parent)) == NULL) {
+    ret = -ESTALE;
+  } else if (p->level == TFS_WG_FILE) {
+    ret = -ENOTDIR;
+  } else if ((e = find_name(parent, name)) != NULL && e->expires > time(NULL)) {
+    take_ref(e, st);
+    pthread_mutex_unlock(&ino_mutex);
+    return 0;
+  } else {
+    control = p->control ||
+      (p == &root && strcmp(name, TFS_CTL_DIR + 1) == 0);
+
+    fill_node(p, &node);
+    // control files are leaves right below the control directory
+    node.level = p->control ? TFS_WG_FILE : (tfs_wg_level_t)(p->level + 1);
+    node.loid = 0;
+    if (control)
+      control_path(p, name, path, sizeof(path));
+    else if (node.level == TFS_WG_SITE)
+      strcpy(node.site, name);
+    else if (node.level == TFS_WG_PROJECT)
+      strcpy(node.project, name);
+    else
+      strcpy(node.file, name);
+  }
+
+  pthread_mutex_unlock(&ino_mutex);
+
+  if (ret != 0)
+    return ret;
+
+  // the query runs without the lock, so lookups do not queue up
+  // behind each other
+  ret = control ? TFS_CTL_getattr(path, &node.st) : TFS_WG_resolve(&node);
+  if (ret != 0)
+    return ret;
+
+  pthread_mutex_lock(&ino_mutex);
+
+  if ((p = find_ino(parent)) == NULL) {
+    ret = -ESTALE;
+  } else if ((e = find_name(parent, name)) == NULL &&
+      (e = create_entry(p, name, node.level, control)) == NULL) {
+    ret = -ENOMEM;
+  } else {
+    update(e, &node);
+    take_ref(e, st);
+  }
+
+  pthread_mutex_unlock(&ino_mutex);
+  return ret;
+}
+
+void TFS_INO_forget(uint64_t ino, uint64_t nlookup)
+{
+  tfs_ino_entry_t * e;
+
+  pthread_mutex_lock(&ino_mutex);
+
+  if ((e = find_ino(ino)) != NULL && e != &root && e->nlookup > 0) {
+    e->nlookup = nlookup < e->nlookup ? e->nlookup - nlookup : 0;
+    if (e->nlookup == 0) {
+      idle++;
+      release_unused(e);
+    }
+  }
+
+  pthread_mutex_unlock(&ino_mutex);
+}
+
+/** Fill node from ino, restating it if its stat expired */
+static int refresh(uint64_t ino, tfs_wg_node_t * node)
+{
+  tfs_ino_entry_t * e;
+  char path[PATH_MAX];
+  int control, ret;
+
+  pthread_mutex_lock(&ino_mutex);
+
+  if ((e = find_ino(ino)) == NULL) {
+    pthread_mutex_unlock(&ino_mutex);
+    return -ESTALE;
+  }
+
+  fill_node(e, node);
+  if (e->expires > time(NULL)) {
+    pthread_mutex_unlock(&ino_mutex);
+    return 0;
+  }
+
+  if ((control = e->control))
+    control_path(find_ino(e->parent), e->name, path, sizeof(path));
+
+  pthread_mutex_unlock(&ino_mutex);
+
+  ret = control ? TFS_CTL_getattr(path, &node->st) : TFS_WG_resolve(node);
+  if (ret != 0)
+    return ret;
+
+  pthread_mutex_lock(&ino_mutex);
+  if ((e = find_ino(ino)) != NULL)
+    update(e, node);
+  pthread_mutex_unlock(&ino_mutex);
+
+  node->st.st_ino = (ino_t)ino;
+  return 0;
+}
+
+int TFS_INO_getattr(uint64_t ino, struct stat * st)
+{
+  tfs_wg_node_t node;
+  int ret = refresh(ino, &node);
+
+  if (ret == 0)
+    memcpy(st, &node.st, sizeof(struct stat));
+
+  return ret;
+}
+
+int TFS_INO_node(uint64_t ino, tfs_wg_node_t * node)
+{
+  return refresh(ino, node);
+}
+
+int TFS_INO_control(uint64_t ino, char * path, size_t len)
+{
+  tfs_ino_entry_t * e;
+  int ret;
+
+  if (!TFS_INO_IS_CONTROL(ino))
+    return 0;
+
+  pthread_mutex_lock(&ino_mutex);
+
+  e = find_ino(ino);
+  ret = e != NULL;
+  if (ret)
+    control_path(find_ino(e->parent), e->name, path, len);
+
+  pthread_mutex_unlock(&ino_mutex);
+  return ret;
+}
+
+void TFS_INO_store(uint64_t parent, const char * name, struct stat * st)
+{
+  tfs_ino_entry_t * p, * e;
+
+  if (strlen(name) > NAME_MAX)
+    return;
+
+  pthread_mutex_lock(&ino_mutex);
+
+  if ((p = find_ino(parent)) == NULL || p->control) {
+    pthread_mutex_unlock(&ino_mutex);
+    return;
+  }
+
+  if ((e = find_name(parent, name)) == NULL) {
+    if (idle >= TFS_INO_MAX_IDLE)
+      sweep();
+    if (idle < TFS_INO_MAX_IDLE)
+      e = create_entry(p, name, (tfs_wg_level_t)(p->level + 1), 0);
+  }
+
+  if (e != NULL) {
+    e->loid = e->level == TFS_WG_FILE ? (uint64_t)st->st_ino : 0;
+    memcpy(&e->st, st, sizeof(struct stat));
+    e->st.st_ino = (ino_t)e->ino;
+    e->expires = time(NULL) + (time_t)ino_ttl;
+    st->st_ino = (ino_t)e->ino;
+  }
+
+  pthread_mutex_unlock(&ino_mutex);
+}
+
+void TFS_INO_invalidate(uint64_t ino)
+{
+  tfs_ino_entry_t * e;
+
+  pthread_mutex_lock(&ino_mutex);
+  if ((e = find_ino(ino)) != NULL)
+    e->expires = 0;
+  pthread_mutex_unlock(&ino_mutex);
+}
+
+void TFS_INO_invalidate_all()
+{
+  tfs_ino_entry_t * e;
+  unsigned int i;
+
+  pthread_mutex_lock(&ino_mutex);
+  root.expires = 0;
+  for (i = 0; i < TFS_INO_BUCKETS; i++)
+    for (e = by_ino[i]; e != NULL; e = e->inext)
+      e->expires = 0;
+  pthread_mutex_unlock(&ino_mutex);
+}
+
+uint64_t TFS_INO_child(uint64_t parent, const char * name)
+{
+  tfs_ino_entry_t * e;
+  uint64_t ino;
+
+  pthread_mutex_lock(&ino_mutex);
+  e = find_name(parent, name);
+  ino = e != NULL ? e->ino : 0;
+  pthread_mutex_unlock(&ino_mutex);
+
+  return ino;
+}
+
+int TFS_INO_children(uint64_t parent, tfs_ino_visit_t visit, void * ctx)
+{
+  tfs_ino_entry_t * e;
+  struct { uint64_t ino; char * name; } * list = NULL;
+  size_t i, n = 0;
+  unsigned int b;
+  int ret = 0;
+
+  pthread_mutex_lock(&ino_mutex);
+
+  if ((e = find_ino(parent)) != NULL && e->children > 0 &&
+      (list = calloc(e->children, sizeof(*list))) != NULL) {
+    for (b = 0; b < TFS_INO_BUCKETS; b++)
+      for (e = by_ino[b]; e != NULL; e = e->inext)
+        if (e->parent == parent && (list[n].name = strdup(e->name)) != NULL)
+          list[n++].ino = e->ino;
+  } else if (e != NULL && e->children > 0) {
+    ret = -ENOMEM;
+  }
+
+  pthread_mutex_unlock(&ino_mutex);
+
+  for (i = 0; i < n; i++) {
+    visit(ctx, parent, list[i].name, list[i].ino);
+    free(list[i].name);
+  }
+  free(list);
+
+  return ret;
+}
@@ -0,0 +1,105 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_inode_h
+#define tableaufs_inode_h
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "workgroup.h"
+
+/** Inode of the mount point, FUSE_ROOT_ID */
+#define TFS_INO_ROOT 1
+
+/** Set in the inode numbers of the control directory and files */
+#define TFS_INO_CONTROL (1ul << (sizeof(unsigned long) * 8 - 2))
+
+#define TFS_INO_IS_CONTROL( ino ) (((ino) & TFS_INO_CONTROL) != 0)
+
+/** Buckets of the two inode hash tables */
+#define TFS_INO_BUCKETS 16384
+
+/**
+ * Inodes known from directory listings only (not looked up by the
+ * kernel) are kept as an attribute cache. Above this many of them the
+ * table is swept.
+ */
+#define TFS_INO_MAX_IDLE 16384
+
+/** Set the lifetime (sec) of the attributes kept per inode */
+extern void TFS_INO_init(unsigned int ttl);
+
+/**
+ * Resolve name in the directory parent and take a kernel reference on
+ * the result. The inode number is returned in st->st_ino and stays the
+ * same until the kernel forgets it.
+ */
+extern int TFS_INO_lookup(uint64_t parent, const char * name, struct stat * st);
+
+/** Drop nlookup kernel references, unused inodes leave the table */
+extern void TFS_INO_forget(uint64_t ino, uint64_t nlookup);
+
+/** Attributes of ino, restated when they are older than the ttl */
+extern int TFS_INO_getattr(uint64_t ino, struct stat * st);
+
+/**
+ * Fill node with level, names, loid and stat of ino so it can be
+ * passed to the TFS_WG_* calls.
+ */
+extern int TFS_INO_node(uint64_t ino, tfs_wg_node_t * node);
+
+/**
+ * Put the control file path of ino into path. Returns non-zero if ino
+ * is a known control inode, 0 otherwise.
+ */
+extern int TFS_INO_control(uint64_t ino, char * path, size_t len);
+
+/**
+ * Remember a child listed by readdir without taking a reference, so a
+ * following lookup needs no query. Sets st->st_ino.
+ */
+extern void TFS_INO_store(uint64_t parent, const char * name,
+    struct stat * st);
+
+/** Make the next getattr of ino restat it (after writes) */
+extern void TFS_INO_invalidate(uint64_t ino);
+
+/** Make every inode restat on its next use */
+extern void TFS_INO_invalidate_all();
+
+/** Inode of the child name of parent, 0 if it is not in the table */
+extern uint64_t TFS_INO_child(uint64_t parent, const char * name);
+
+/** Called by TFS_INO_children for every child in the table */
+typedef void (* tfs_ino_visit_t)(void * ctx, uint64_t parent,
+    const char * name, uint64_t ino);
+
+/**
+ * Call visit for every child of parent in the table. The children are
+ * collected first and visited without the table lock, so visit may
+ * call into the kernel.
+ */
+extern int TFS_INO_children(uint64_t parent, tfs_ino_visit_t visit,
+    void * ctx);
+
+#endif /* tableaufs_inode_h */
@@ -0,0 +1,373 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "log.h"
+#include "stats.h"
+
+tfs_log_level_t tfs_log_level = TFS_LOG_WARN;
+
+static const char * level_names[] = { "error", "warn", "info", "debug" };
+
+#define TFS_LOG_LEVELS (sizeof(level_names) / sizeof(level_names[0]))
+
+/** What a ring record holds */
+typedef enum {
+  TFS_LOG_REC_MESSAGE = 0,
+  TFS_LOG_REC_SPAN
+} tfs_log_kind_t;
+
+typedef struct {
+  tfs_log_kind_t kind;
+  tfs_log_level_t level;
+  uint64_t request;
+  uint64_t start;        // wall clock ns for messages, monotonic for spans
+  uint64_t end;
+  const char * name;     // spans only
+  const char * category;
+  char msg[TFS_LOG_MSG]; // messages only
+} tfs_log_rec_t;
+
+/**
+ * Single producer, single consumer ring of one thread.
+ *
+ * The owning thread only moves head, the drain thread only moves tail.
+ * Rings are never freed: when a thread exits its ring is handed over to
+ * the next new thread.
+ */
+typedef struct tfs_log_ring_t {
+  tfs_log_rec_t recs[TFS_LOG_RING];
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;      // records lost to a full ring
+  uint64_t reported;     // dropped records already logged, drain thread only
+  int owned;             // a live thread writes into this ring
+  unsigned int tid;      // thread id in the trace
+  struct tfs_log_ring_t * next;
+} tfs_log_ring_t;
+
+static tfs_log_ring_t * rings;
+static unsigned int ring_count;
+
+static __thread tfs_log_ring_t * thread_ring;
+static __thread uint64_t thread_request;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t next_request;
+
+static int running;
+static pthread_t drain_thread;
+
+static FILE * trace_file;
+static int trace_first = 1;
+static uint64_t trace_started;
+
+#define TFS_LOG_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TFS_LOG_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/** Thread exit: let the next new thread take over the ring */
+static void release_ring(void * ring)
+{
+  TFS_LOG_STORE(&((tfs_log_ring_t *)ring)->owned, 0);
+}
+
+static void create_ring_key()
+{
+  pthread_key_create(&ring_key, release_ring);
+}
+
+/** The ring of the calling thread, NULL if none could be allocated */
+static tfs_log_ring_t * get_ring()
+{
+  tfs_log_ring_t * r;
+  int free_ring;
+
+  if (thread_ring != NULL)
+    return thread_ring;
+
+  pthread_once(&ring_key_once, create_ring_key);
+
+  for (r = TFS_LOG_LOAD(&rings); r != NULL; r = r->next) {
+    free_ring = 0;
+    if (__atomic_compare_exchange_n(&r->owned, &free_ring, 1, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (r == NULL) {
+    if ((r = calloc(1, sizeof(tfs_log_ring_t))) == NULL)
+      return NULL;
+
+    r->owned = 1;
+    r->tid = __atomic_add_fetch(&ring_count, 1, __ATOMIC_RELAXED);
+    r->next = TFS_LOG_LOAD(&rings);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  pthread_setspecific(ring_key, r);
+  thread_ring = r;
+  return r;
+}
+
+/** Reserve the next record of the calling thread, NULL if the ring is full */
+static tfs_log_rec_t * reserve(tfs_log_ring_t * r)
+{
+  if (r->head - TFS_LOG_LOAD(&r->tail) >= TFS_LOG_RING) {
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  return &r->recs[r->head % TFS_LOG_RING];
+}
+
+/** Publish the record returned by reserve */
+static void commit(tfs_log_ring_t * r)
+{
+  TFS_LOG_STORE(&r->head, r->head + 1);
+}
+
+static uint64_t wall_clock()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/** Write one message line to stderr */
+static void print_message(const tfs_log_rec_t * rec)
+{
+  char stamp[32];
+  time_t sec = (time_t)(rec->start / 1000000000u);
+  struct tm tm;
+
+  localtime_r(&sec, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+  if (rec->request)
+    fprintf(stderr, "%s.%03u %-5s [req %llu] %s\n", stamp,
+        (unsigned int)(rec->start / 1000000u % 1000u),
+        level_names[rec->level], (unsigned long long)rec->request, rec->msg);
+  else
+    fprintf(stderr, "%s.%03u %-5s %s\n", stamp,
+        (unsigned int)(rec->start / 1000000u % 1000u),
+        level_names[rec->level], rec->msg);
+}
+
+/** Append one complete event to the trace file */
+static void print_span(const tfs_log_rec_t * rec, unsigned int tid)
+{
+  uint64_t ts = rec->start > trace_started ? rec->start - trace_started : 0;
+  uint64_t dur = rec->end - rec->start;
+
+  fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+      "\"pid\":%d,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u,"
+      "\"args\":{\"req\":%llu}}",
+      trace_first ? "" : ",\n", rec->name, rec->category, (int)getpid(), tid,
+      (unsigned long long)(ts / 1000), (unsigned int)(ts % 1000),
+      (unsigned long long)(dur / 1000), (unsigned int)(dur % 1000),
+      (unsigned long long)rec->request);
+  trace_first = 0;
+}
+
+/** Empty every ring. Only called by the drain thread or after it stopped */
+static void drain()
+{
+  tfs_log_ring_t * r;
+  tfs_log_rec_t * rec;
+  uint64_t tail, head, dropped;
+
+  for (r = TFS_LOG_LOAD(&rings); r != NULL; r = r->next) {
+    tail = r->tail;
+    head = TFS_LOG_LOAD(&r->head);
+
+    for (; tail != head; tail++) {
+      rec = &r->recs[tail % TFS_LOG_RING];
+      if (rec->kind == TFS_LOG_REC_MESSAGE)
+        print_message(rec);
+      else if (trace_file != NULL)
+        print_span(rec, r->tid);
+    }
+    TFS_LOG_STORE(&r->tail, tail);
+
+    dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped != r->reported) {
+      fprintf(stderr, "%llu log records dropped on a full ring\n",
+          (unsigned long long)(dropped - r->reported));
+      r->reported = dropped;
+    }
+  }
+
+  fflush(stderr);
+  if (trace_file != NULL)
+    fflush(trace_file);
+}
+
+static void * drain_main(void * arg)
+{
+  (void)arg;
+
+  while (TFS_LOG_LOAD(&running)) {
+    drain();
+    usleep(TFS_LOG_DRAIN_INTERVAL * 1000);
+  }
+
+  return NULL;
+}
+
+void TFS_LOG_write(tfs_log_level_t level, const char * fmt, ...)
+{
+  tfs_log_ring_t * r = NULL;
+  tfs_log_rec_t direct, * rec = NULL;
+  va_list ap;
+  size_t len;
+
+  if (TFS_LOG_LOAD(&running) && (r = get_ring()) != NULL &&
+      (rec = reserve(r)) == NULL)
+    return;
+
+  // before the drain thread runs (or without memory for a ring) the
+  // message is printed right away
+  if (rec == NULL)
+    rec = &direct;
+
+  rec->kind = TFS_LOG_REC_MESSAGE;
+  rec->level = level;
+  rec->request = thread_request;
+  rec->start = wall_clock();
+
+  va_start(ap, fmt);
+  vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+  va_end(ap);
+
+  // libpq error messages come with their own newline
+  len = strlen(rec->msg);
+  while (len > 0 && rec->msg[len - 1] == '\n')
+    rec->msg[--len] = '\0';
+
+  if (rec == &direct)
+    print_message(rec);
+  else
+    commit(r);
+}
+
+int TFS_LOG_parse_level(const char * name)
+{
+  unsigned int i;
+
+  for (i = 0; i < TFS_LOG_LEVELS; i++)
+    if (strcmp(name, level_names[i]) == 0)
+      return (int)i;
+
+  return -1;
+}
+
+int TFS_LOG_trace(const char * path)
+{
+  if ((trace_file = fopen(path, "w")) == NULL) {
+    TFS_LOG(TFS_LOG_ERROR, "Cannot open trace file '%s'", path);
+    return -1;
+  }
+
+  // flushed so the forked daemon does not write it a second time
+  fputs("[\n", trace_file);
+  fflush(trace_file);
+  trace_started = TFS_STATS_now();
+  return 0;
+}
+
+int TFS_LOG_tracing()
+{
+  return trace_file != NULL;
+}
+
+int TFS_LOG_start()
+{
+  TFS_LOG_STORE(&running, 1);
+
+  if (pthread_create(&drain_thread, NULL, drain_main, NULL) != 0) {
+    TFS_LOG_STORE(&running, 0);
+    return -1;
+  }
+
+  return 0;
+}
+
+void TFS_LOG_stop()
+{
+  if (!TFS_LOG_LOAD(&running))
+    return;
+
+  TFS_LOG_STORE(&running, 0);
+  pthread_join(drain_thread, NULL);
+  drain();
+
+  // a trace cut short (crash, kill) is still readable without the
+  // closing bracket
+  if (trace_file != NULL) {
+    fputs("\n]\n", trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+}
+
+uint64_t TFS_LOG_begin_request()
+{
+  thread_request = __atomic_add_fetch(&next_request, 1, __ATOMIC_RELAXED);
+  return thread_request;
+}
+
+uint64_t TFS_LOG_request()
+{
+  return thread_request;
+}
+
+void TFS_LOG_span(const char * name, const char * category, uint64_t start,
+    uint64_t end)
+{
+  tfs_log_ring_t * r;
+  tfs_log_rec_t * rec;
+
+  if (trace_file == NULL || !TFS_LOG_LOAD(&running) ||
+      (r = get_ring()) == NULL || (rec = reserve(r)) == NULL)
+    return;
+
+  rec->kind = TFS_LOG_REC_SPAN;
+  rec->level = TFS_LOG_DEBUG;
+  rec->request = thread_request;
+  rec->start = start;
+  rec->end = end;
+  rec->name = name;
+  rec->category = category;
+  commit(r);
+}
@@ -0,0 +1,97 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_log_h
+#define tableaufs_log_h
+#include <stdint.h>
+
+/** Log levels, lower is more severe */
+typedef enum {
+  TFS_LOG_ERROR = 0,
+  TFS_LOG_WARN,
+  TFS_LOG_INFO,
+  TFS_LOG_DEBUG
+} tfs_log_level_t;
+
+/** Records buffered per thread before new ones are dropped */
+#define TFS_LOG_RING 1024
+
+/** Longest message kept, the rest is cut */
+#define TFS_LOG_MSG 240
+
+/** Milliseconds between two drains of the rings */
+#define TFS_LOG_DRAIN_INTERVAL 50
+
+extern tfs_log_level_t tfs_log_level;
+
+/**
+ * Log a printf style message if level is enabled.
+ *
+ * The message goes to the ring of the calling thread and is written to
+ * stderr by the drain thread, so callers never block on stdio.
+ */
+#define TFS_LOG( level, ... ) \
+  do { \
+    if ((level) <= tfs_log_level) \
+      TFS_LOG_write((level), __VA_ARGS__); \
+  } while (0)
+
+extern void TFS_LOG_write(tfs_log_level_t level, const char * fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/** Parse error, warn, info or debug. Returns -1 on unknown names */
+extern int TFS_LOG_parse_level(const char * name);
+
+/**
+ * Write a Chrome trace of every timed operation to path.
+ *
+ * Must be called before TFS_LOG_start. The file can be opened in
+ * chrome://tracing or Perfetto.
+ */
+extern int TFS_LOG_trace(const char * path);
+
+/** Returns non-zero if a trace is being written */
+extern int TFS_LOG_tracing();
+
+/**
+ * Start the drain thread. Until then messages are written directly.
+ */
+extern int TFS_LOG_start();
+
+/** Drain all rings one last time and finish the trace file */
+extern void TFS_LOG_stop();
+
+/** Give the calling thread a new request ID for the operation it runs */
+extern uint64_t TFS_LOG_begin_request();
+
+/** The request ID of the calling thread, 0 outside of file operations */
+extern uint64_t TFS_LOG_request();
+
+/**
+ * Add a complete event to the trace. start and end are TFS_STATS_now()
+ * timestamps, name and category must be static strings.
+ */
+extern void TFS_LOG_span(const char * name, const char * category,
+    uint64_t start, uint64_t end);
+
+#endif /* tableaufs_log_h */
@@ -0,0 +1,578 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "namespace.h"
+#include "log.h"
+#include "pgpool.h"
+#include "pipeline.h"
+#include "stats.h"
+
+// rounded down, a refresh from the newest mtime must not skip later rows
+#define TFS_NS_MTIME \
+  "floor(extract(epoch from coalesce(c.updated_at,'2000-01-01')))::int8"
+
+// compares epochs, to_timestamp() would depend on the session time zone
+#define TFS_NS_CHANGED \
+  " extract(epoch from coalesce(c.updated_at,'2000-01-01')) >= $1 "
+
+/* All namespace queries return id, parent id, name, mtime, loid, size */
+
+#define TFS_NS_LIST_SITES \
+  "select c.id::int8, 0::int8, c.name, " TFS_NS_MTIME ", 0::int8, 0::int8 " \
+  "from sites c where" TFS_NS_CHANGED
+
+#define TFS_NS_LIST_PROJECTS \
+  "select c.id::int8, c.site_id::int8, c.name, " TFS_NS_MTIME ", 0::int8, " \
+  "0::int8 from projects c where" TFS_NS_CHANGED
+
+#define TFS_NS_LIST_FILES( entity, ext ) \
+  "select c.id::int8, c.project_id::int8, c.name || '." #ext "' || case when " \
+  "substring(pg_largeobject.data from 1 for 2) = 'PK' then 'x' else '' end, " \
+  TFS_NS_MTIME ", repository_data.content::int8, (select sum(length(l.data)) " \
+  "from pg_largeobject l where l.loid = repository_data.content)::int8 " \
+  "from " #entity " c inner join repository_data on " \
+  "(repository_data.tracking_id = coalesce(data_id,reduced_data_id)) " \
+  "inner join pg_largeobject on (repository_data.content = pg_largeobject.loid) " \
+  "where pg_largeobject.pageno = 0 and" TFS_NS_CHANGED
+
+#define TFS_NS_CHECKSUM( entity ) \
+  "(select count(*) from " #entity ")::int8, " \
+  "(select coalesce(sum(id),0) from " #entity ")::int8"
+
+/** Row counts and id sums of the tables, to detect deletions */
+#define TFS_NS_CHECKSUMS \
+  "select " TFS_NS_CHECKSUM(sites) ", " TFS_NS_CHECKSUM(projects) ", " \
+  TFS_NS_CHECKSUM(workbooks) ", " TFS_NS_CHECKSUM(datasources)
+
+#define TFS_NS_TABLES 4
+#define TFS_NS_CHUNK_SIZE (256 * 1024)
+#define TFS_NS_STR_BUCKETS 16384
+#define TFS_NS_BUCKETS 65536
+
+typedef enum {
+  TFS_NS_KIND_SITE = 0,
+  TFS_NS_KIND_PROJECT = 1,
+  TFS_NS_KIND_WORKBOOK = 2,
+  TFS_NS_KIND_DATASOURCE = 3
+} tfs_ns_kind_t;
+
+static const char * list_queries[TFS_NS_TABLES] = {
+  TFS_NS_LIST_SITES,
+  TFS_NS_LIST_PROJECTS,
+  TFS_NS_LIST_FILES( workbooks, twb ),
+  TFS_NS_LIST_FILES( datasources, tds ),
+};
+
+typedef struct tfs_ns_entry_t {
+  tfs_ns_kind_t kind;
+  int64_t id;
+  const char * name;                   // interned in the arena
+  tfs_ns_attr_t attr;
+  struct tfs_ns_entry_t * parent;
+  struct tfs_ns_entry_t * children;    // first child
+  struct tfs_ns_entry_t * sibling;     // next child of parent
+  struct tfs_ns_entry_t * name_next;   // (parent, name) hash chain
+  struct tfs_ns_entry_t * id_next;     // (kind, id) hash chain
+} tfs_ns_entry_t;
+
+typedef struct tfs_ns_chunk_t {
+  struct tfs_ns_chunk_t * next;
+  size_t used;
+  char data[TFS_NS_CHUNK_SIZE];
+} tfs_ns_chunk_t;
+
+typedef struct tfs_ns_str_t {
+  struct tfs_ns_str_t * next;
+  char s[];
+} tfs_ns_str_t;
+
+/** A snapshot: everything lives in its arena and is freed at once */
+typedef struct tfs_ns_t {
+  tfs_ns_chunk_t * chunks;
+  tfs_ns_str_t * strings[TFS_NS_STR_BUCKETS];
+  tfs_ns_entry_t * by_name[TFS_NS_BUCKETS];
+  tfs_ns_entry_t * by_id[TFS_NS_BUCKETS];
+  tfs_ns_entry_t root;
+  time_t last_mtime;                   // newest updated_at seen
+  int64_t checksums[TFS_NS_TABLES * 2];
+} tfs_ns_t;
+
+/** The current snapshot, NULL if the namespace mode is off */
+static tfs_ns_t * snapshot;
+static pthread_rwlock_t snapshot_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Serializes refreshes (thread and explicit callers) */
+static pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int refresh_interval = TFS_NS_DEFAULT_REFRESH;
+
+static uint32_t hash_str(const char * s)
+{
+  uint32_t h = 2166136261u;
+
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+static unsigned int hash_name(const tfs_ns_entry_t * parent, const char * name)
+{
+  return (unsigned int)(((uintptr_t)parent >> 4) ^ (uintptr_t)name) %
+    TFS_NS_BUCKETS;
+}
+
+static unsigned int hash_id(tfs_ns_kind_t kind, int64_t id)
+{
+  return (unsigned int)(((uint64_t)id * 4u + kind) % TFS_NS_BUCKETS);
+}
+
+static void * arena_alloc(tfs_ns_t * ns, size_t len)
+{
+  tfs_ns_chunk_t * chunk = ns->chunks;
+  void * p;
+
+  len = (len + 7) & ~(size_t)7;
+  if (len > TFS_NS_CHUNK_SIZE)
+    return NULL;
+
+  if (chunk == NULL || chunk->used + len > TFS_NS_CHUNK_SIZE) {
+    if ((chunk = malloc(sizeof(tfs_ns_chunk_t))) == NULL)
+      return NULL;
+    chunk->next = ns->chunks;
+    chunk->used = 0;
+    ns->chunks = chunk;
+  }
+
+  p = chunk->data + chunk->used;
+  chunk->used += len;
+  return p;
+}
+
+/** Find the interned copy of s, adding it if add is set */
+static const char * intern(tfs_ns_t * ns, const char * s, int add)
+{
+  unsigned int h = hash_str(s) % TFS_NS_STR_BUCKETS;
+  tfs_ns_str_t * str;
+  size_t len;
+
+  for (str = ns->strings[h]; str != NULL; str = str->next)
+    if (strcmp(str->s, s) == 0)
+      return str->s;
+
+  if (!add)
+    return NULL;
+
+  len = strlen(s);
+  if ((str = arena_alloc(ns, sizeof(tfs_ns_str_t) + len + 1)) == NULL)
+    return NULL;
+  memcpy(str->s, s, len + 1);
+  str->next = ns->strings[h];
+  ns->strings[h] = str;
+
+  return str->s;
+}
+
+static tfs_ns_entry_t * find_id(tfs_ns_t * ns, tfs_ns_kind_t kind, int64_t id)
+{
+  tfs_ns_entry_t * e;
+
+  for (e = ns->by_id[hash_id(kind, id)]; e != NULL; e = e->id_next)
+    if (e->kind == kind && e->id == id)
+      return e;
+
+  return NULL;
+}
+
+static tfs_ns_entry_t * find_child(tfs_ns_t * ns, const tfs_ns_entry_t * parent,
+    const char * name)
+{
+  tfs_ns_entry_t * e;
+
+  // names are interned: an unknown string cannot be the name of any entry
+  if ((name = intern(ns, name, 0)) == NULL)
+    return NULL;
+
+  for (e = ns->by_name[hash_name(parent, name)]; e != NULL; e = e->name_next)
+    if (e->parent == parent && e->name == name)
+      return e;
+
+  return NULL;
+}
+
+static void link_entry(tfs_ns_t * ns, tfs_ns_entry_t * e)
+{
+  unsigned int h = hash_name(e->parent, e->name);
+
+  e->name_next = ns->by_name[h];
+  ns->by_name[h] = e;
+  e->sibling = e->parent->children;
+  e->parent->children = e;
+}
+
+static void unlink_entry(tfs_ns_t * ns, tfs_ns_entry_t * e)
+{
+  tfs_ns_entry_t ** ep;
+
+  for (ep = &ns->by_name[hash_name(e->parent, e->name)]; *ep != NULL;
+      ep = &(*ep)->name_next)
+    if (*ep == e) {
+      *ep = e->name_next;
+      break;
+    }
+
+  for (ep = &e->parent->children; *ep != NULL; ep = &(*ep)->sibling)
+    if (*ep == e) {
+      *ep = e->sibling;
+      break;
+    }
+}
+
+/**
+ * Insert or update an entry. Rows of unknown parents are skipped.
+ * Returns non-zero if a new entry was added.
+ */
+static int upsert(tfs_ns_t * ns, tfs_ns_kind_t kind, int64_t id,
+    int64_t parent_id, const char * raw_name, const tfs_ns_attr_t * attr)
+{
+  tfs_ns_entry_t * parent, * e;
+  char name[NAME_MAX + 1];
+  const char * iname;
+  size_t i;
+  int added = 0;
+
+  if (kind == TFS_NS_KIND_SITE)
+    parent = &ns->root;
+  else if (kind == TFS_NS_KIND_PROJECT)
+    parent = find_id(ns, TFS_NS_KIND_SITE, parent_id);
+  else
+    parent = find_id(ns, TFS_NS_KIND_PROJECT, parent_id);
+
+  if (parent == NULL || strlen(raw_name) > NAME_MAX)
+    return 0;
+
+  // same mapping as TFS_WG_readdir
+  for (i = 0; raw_name[i]; i++)
+    name[i] = raw_name[i] == '/' ? '_' : raw_name[i];
+  name[i] = '\0';
+
+  if ((iname = intern(ns, name, 1)) == NULL)
+    return 0;
+
+  if ((e = find_id(ns, kind, id)) != NULL) {
+    // renamed or moved to another project
+    if (e->parent != parent || e->name != iname) {
+      unlink_entry(ns, e);
+      e->parent = parent;
+      e->name = iname;
+      link_entry(ns, e);
+    }
+  } else {
+    if ((e = arena_alloc(ns, sizeof(tfs_ns_entry_t))) == NULL)
+      return 0;
+    memset(e, 0, sizeof(tfs_ns_entry_t));
+    e->kind = kind;
+    e->id = id;
+    e->parent = parent;
+    e->name = iname;
+    e->id_next = ns->by_id[hash_id(kind, id)];
+    ns->by_id[hash_id(kind, id)] = e;
+    link_entry(ns, e);
+    added = 1;
+  }
+
+  e->attr = *attr;
+  if (attr->mtime > ns->last_mtime)
+    ns->last_mtime = attr->mtime;
+
+  return added;
+}
+
+static void free_snapshot(tfs_ns_t * ns)
+{
+  tfs_ns_chunk_t * chunk, * next;
+
+  if (ns == NULL)
+    return;
+
+  for (chunk = ns->chunks; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  free(ns);
+}
+
+/**
+ * Fetch the table checksums and the rows changed since the given time,
+ * all queries sent in one pipeline. The checksums go first: rows
+ * changing while the lists run are picked up again by the next refresh.
+ */
+static int fetch_changes(tfs_pg_conn_t * pc, time_t since, int64_t * checksums,
+    PGresult * res[TFS_NS_TABLES])
+{
+  char since_str[24];
+  const char * paramValues[1] = { since_str };
+  PGresult * sums;
+  tfs_pl_t pl;
+  uint64_t start;
+  int i, ret;
+
+  snprintf(since_str, sizeof(since_str), "%lld", (long long)since);
+
+  start = TFS_STATS_now();
+  TFS_PL_begin(&pl, pc);
+  ret = TFS_PL_send(&pl, TFS_NS_CHECKSUMS, 0, NULL, 1);
+  for (i = 0; i < TFS_NS_TABLES && ret == 0; i++)
+    ret = TFS_PL_send(&pl, list_queries[i], 1, paramValues, 1);
+
+  sums = TFS_PL_next(&pl);
+  if (ret == 0 && PQresultStatus(sums) == PGRES_TUPLES_OK &&
+      PQntuples(sums) == 1) {
+    for (i = 0; i < TFS_NS_TABLES * 2; i++)
+      checksums[i] = TFS_PG_get_int8(sums, 0, i);
+  } else {
+    ret = -EIO;
+  }
+  PQclear(sums);
+
+  for (i = 0; i < TFS_NS_TABLES; i++) {
+    res[i] = TFS_PL_next(&pl);
+    if (ret == 0 && PQresultStatus(res[i]) != PGRES_TUPLES_OK) {
+      TFS_LOG(TFS_LOG_ERROR, "Loading the namespace failed: %s",
+          PQresultErrorMessage(res[i]));
+      ret = -EIO;
+    }
+  }
+  TFS_PL_end(&pl);
+  TFS_STATS_record(TFS_STATS_SQL_NAMESPACE, start, ret);
+
+  if (ret != 0)
+    for (i = 0; i < TFS_NS_TABLES; i++)
+      PQclear(res[i]);
+
+  return ret;
+}
+
+/**
+ * Apply fetched rows, parents first, and free the results. If added is
+ * not NULL, the count and id sum of the new entries of every table are
+ * added to it.
+ */
+static void apply_changes(tfs_ns_t * ns, PGresult * res[TFS_NS_TABLES],
+    int64_t * added)
+{
+  tfs_ns_attr_t attr;
+  int64_t id;
+  int i, row;
+
+  for (i = 0; i < TFS_NS_TABLES; i++) {
+    for (row = 0; row < PQntuples(res[i]); row++) {
+      attr.mtime = (time_t)TFS_PG_get_int8(res[i], row, 3);
+      attr.loid = (uint64_t)TFS_PG_get_int8(res[i], row, 4);
+      attr.size = (off_t)TFS_PG_get_int8(res[i], row, 5);
+
+      id = TFS_PG_get_int8(res[i], row, 0);
+      if (upsert(ns, (tfs_ns_kind_t)i, id, TFS_PG_get_int8(res[i], row, 1),
+            PQgetvalue(res[i], row, 2), &attr) && added != NULL) {
+        added[i * 2]++;
+        added[i * 2 + 1] += id;
+      }
+    }
+    PQclear(res[i]);
+  }
+}
+
+/** Build a complete snapshot and make it the current one */
+static int full_load(tfs_pg_conn_t * pc)
+{
+  PGresult * res[TFS_NS_TABLES];
+  tfs_ns_t * ns, * old;
+
+  if ((ns = calloc(1, sizeof(tfs_ns_t))) == NULL)
+    return -ENOMEM;
+
+  if (fetch_changes(pc, 0, ns->checksums, res) != 0) {
+    free_snapshot(ns);
+    return -EIO;
+  }
+
+  // the snapshot is private until published, no locking needed
+  apply_changes(ns, res, NULL);
+
+  pthread_rwlock_wrlock(&snapshot_lock);
+  old = snapshot;
+  snapshot = ns;
+  pthread_rwlock_unlock(&snapshot_lock);
+
+  free_snapshot(old);
+  return 0;
+}
+
+int TFS_NS_load()
+{
+  tfs_pg_conn_t * pc;
+  int ret;
+
+  if ((pc = TFS_PG_checkout_read()) == NULL)
+    return -EIO;
+
+  pthread_mutex_lock(&refresh_mutex);
+  ret = full_load(pc);
+  pthread_mutex_unlock(&refresh_mutex);
+
+  TFS_PG_checkin(pc);
+  return ret;
+}
+
+int TFS_NS_enabled()
+{
+  return snapshot != NULL;
+}
+
+int TFS_NS_refresh()
+{
+  PGresult * res[TFS_NS_TABLES];
+  int64_t checksums[TFS_NS_TABLES * 2], added[TFS_NS_TABLES * 2];
+  tfs_pg_conn_t * pc;
+  time_t since;
+  int i, ret = 0, reload = 0;
+
+  if (!TFS_NS_enabled())
+    return 0;
+
+  if ((pc = TFS_PG_checkout_read()) == NULL)
+    return -EIO;
+
+  pthread_mutex_lock(&refresh_mutex);
+
+  since = snapshot->last_mtime;
+  if ((ret = fetch_changes(pc, since, checksums, res)) != 0)
+    goto out;
+
+  memset(added, 0, sizeof(added));
+  pthread_rwlock_wrlock(&snapshot_lock);
+  apply_changes(snapshot, res, added);
+
+  // updated_at does not tell about deleted rows: unless every table
+  // holds exactly the rows known before plus the new ones, some rows
+  // went away (or came in between the queries), start over then
+  for (i = 0; i < TFS_NS_TABLES * 2; i++)
+    if (checksums[i] != snapshot->checksums[i] + added[i])
+      reload = 1;
+
+  if (!reload)
+    memcpy(snapshot->checksums, checksums, sizeof(checksums));
+  pthread_rwlock_unlock(&snapshot_lock);
+
+  if (reload)
+    ret = full_load(pc);
+
+out:
+  pthread_mutex_unlock(&refresh_mutex);
+  TFS_PG_checkin(pc);
+  return ret;
+}
+
+static void * refresh_thread(void * arg)
+{
+  for (;;) {
+    sleep(refresh_interval);
+    TFS_NS_refresh();
+  }
+
+  return NULL;
+}
+
+int TFS_NS_start(unsigned int refresh)
+{
+  pthread_t thread;
+
+  if (!TFS_NS_enabled())
+    return 0;
+
+  if (refresh > 0)
+    refresh_interval = refresh;
+
+  if (pthread_create(&thread, NULL, refresh_thread, NULL) != 0)
+    return -1;
+
+  pthread_detach(thread);
+  return 0;
+}
+
+/** Find the entry of node. Must be called with snapshot_lock held */
+static tfs_ns_entry_t * find_node(const tfs_wg_node_t * node)
+{
+  tfs_ns_entry_t * e = &snapshot->root;
+
+  if (node->level >= TFS_WG_SITE && e != NULL)
+    e = find_child(snapshot, e, node->site);
+  if (node->level >= TFS_WG_PROJECT && e != NULL)
+    e = find_child(snapshot, e, node->project);
+  if (node->level >= TFS_WG_FILE && e != NULL)
+    e = find_child(snapshot, e, node->file);
+
+  return e;
+}
+
+int TFS_NS_lookup(const tfs_wg_node_t * node, tfs_ns_attr_t * attr)
+{
+  tfs_ns_entry_t * e;
+  int ret = -ENOENT;
+
+  pthread_rwlock_rdlock(&snapshot_lock);
+  if ((e = find_node(node)) != NULL) {
+    *attr = e->attr;
+    ret = 0;
+  }
+  pthread_rwlock_unlock(&snapshot_lock);
+
+  return ret;
+}
+
+int TFS_NS_readdir(const tfs_wg_node_t * node, tfs_ns_visit_t visit,
+    void * ctx)
+{
+  tfs_ns_entry_t * e;
+  int ret = -ENOENT;
+
+  pthread_rwlock_rdlock(&snapshot_lock);
+  if ((e = find_node(node)) != NULL) {
+    ret = 0;
+    for (e = e->children; e != NULL; e = e->sibling)
+      if (visit(ctx, e->name, &e->attr) != 0)
+        break;
+  }
+  pthread_rwlock_unlock(&snapshot_lock);
+
+  return ret;
+}
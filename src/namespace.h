@@ -0,0 +1,73 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_namespace_h
+#define tableaufs_namespace_h
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "workgroup.h"
+
+/** Default seconds between two incremental refreshes of the snapshot */
+#define TFS_NS_DEFAULT_REFRESH 30
+
+/** Attributes of a namespace entry */
+typedef struct tfs_ns_attr_t {
+  time_t mtime;
+  uint64_t loid;   // files only
+  off_t size;      // files only
+} tfs_ns_attr_t;
+
+/** Called for every child of a directory by TFS_NS_readdir */
+typedef int (* tfs_ns_visit_t)(void * ctx, const char * name,
+    const tfs_ns_attr_t * attr);
+
+/**
+ * Load the whole site/project/file hierarchy into memory.
+ *
+ * Once loaded, TFS_NS_enabled() returns non-zero and path lookups and
+ * listings are answered from the snapshot.
+ */
+extern int TFS_NS_load();
+
+/** Returns non-zero if a snapshot is loaded */
+extern int TFS_NS_enabled();
+
+/** Start the thread refreshing the snapshot every refresh seconds */
+extern int TFS_NS_start(unsigned int refresh);
+
+/**
+ * Apply the rows changed in the repository since the last refresh.
+ *
+ * Falls back to a full reload when rows were deleted.
+ */
+extern int TFS_NS_refresh();
+
+/** Find the entry of node (site, project and file by level) */
+extern int TFS_NS_lookup(const tfs_wg_node_t * node, tfs_ns_attr_t * attr);
+
+/** Call visit for every child of the directory node */
+extern int TFS_NS_readdir(const tfs_wg_node_t * node, tfs_ns_visit_t visit,
+    void * ctx);
+
+#endif /* tableaufs_namespace_h */
@@ -0,0 +1,909 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "package.h"
+#include "log.h"
+
+/** Compressed bytes read from the package at a time */
+#define TFS_PKG_CHUNK (64 * 1024)
+
+/** Largest central directory loaded into memory */
+#define TFS_PKG_MAX_DIRECTORY (64 * 1024 * 1024)
+
+// zip record signatures and fixed sizes
+#define TFS_PKG_EOCD_SIG 0x06054b50
+#define TFS_PKG_EOCD_LEN 22
+#define TFS_PKG_EOCD64_SIG 0x06064b50
+#define TFS_PKG_EOCD64_LEN 56
+#define TFS_PKG_LOCATOR_SIG 0x07064b50
+#define TFS_PKG_LOCATOR_LEN 20
+#define TFS_PKG_CENTRAL_SIG 0x02014b50
+#define TFS_PKG_CENTRAL_LEN 46
+#define TFS_PKG_LOCAL_SIG 0x04034b50
+#define TFS_PKG_LOCAL_LEN 30
+
+#define TFS_PKG_STORED 0
+#define TFS_PKG_DEFLATED 8
+
+/** A file inside a package */
+typedef struct {
+  const char * name;   // path inside the archive, without leading /
+  uint64_t offset;     // of the local header in the package
+  uint64_t csize;      // compressed size
+  uint64_t usize;      // uncompressed size
+  unsigned int method;
+  time_t mtime;
+} tfs_pkg_entry_t;
+
+/** The central directory of a package, sorted by name */
+typedef struct {
+  tfs_wg_node_t node;  // the package file itself
+  unsigned int refs;   // one for the cache, one for each user
+  uint64_t used;       // last use, for the LRU eviction
+  size_t count;
+  tfs_pkg_entry_t * entries;
+  char * names;
+} tfs_pkg_index_t;
+
+/** State behind the file handle of an open member */
+typedef struct {
+  tfs_pkg_index_t * index;
+  const tfs_pkg_entry_t * entry;
+  uint64_t fh;            // read handle of the package
+  uint64_t data;          // offset of the member content in the package
+  pthread_mutex_t mutex;  // serializes the reads of the handle
+#ifdef HAVE_ZLIB
+  z_stream zs;
+  uint64_t in_pos;        // compressed bytes given to zs
+  uint64_t out_pos;       // uncompressed bytes taken from zs
+  unsigned char in[TFS_PKG_CHUNK];
+#endif
+} tfs_pkg_handle_t;
+
+static int enabled;
+
+static tfs_pkg_index_t * indexes[TFS_PKG_INDEXES];
+static uint64_t clock_hand;
+static uint64_t generation;  // bumped by every TFS_PKG_invalidate
+static pthread_mutex_t indexes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint16_t get16(const unsigned char * p)
+{
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char * p)
+{
+  return (uint32_t)get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint64_t get64(const unsigned char * p)
+{
+  return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+/** Zip entries carry their modification time in local MS-DOS format */
+static time_t dos_time(uint16_t t, uint16_t d)
+{
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = (d >> 9) + 80;
+  tm.tm_mon = ((d >> 5) & 0x0f) - 1;
+  tm.tm_mday = d & 0x1f;
+  tm.tm_hour = t >> 11;
+  tm.tm_min = (t >> 5) & 0x3f;
+  tm.tm_sec = (t & 0x1f) * 2;
+  tm.tm_isdst = -1;
+
+  return mktime(&tm);
+}
+
+/** Returns non-zero if name is a zip packaged workbook or datasource */
+static int is_packaged(const char * name)
+{
+  size_t len = strlen(name);
+
+  return len > 5 && (strcmp(name + len - 5, ".twbx") == 0 ||
+      strcmp(name + len - 5, ".tdsx") == 0);
+}
+
+/**
+ * Split path into the path of the package and the member path inside
+ * it ("" for the member directory itself). Returns non-zero if path is
+ * inside a member directory.
+ */
+static int split_path(const char * path, char * file, size_t len,
+    const char ** member)
+{
+  const char * p = path, * end;
+  size_t flen, slen = strlen(TFS_PKG_SUFFIX);
+  int i;
+
+  // /site/project/name.twbx.d/member
+  for (i = 0; i < 3; i++) {
+    if (*p != '/' || p[1] == '\0' || p[1] == '/')
+      return 0;
+    if ((end = strchr(p + 1, '/')) == NULL)
+      end = p + strlen(p);
+    if (i < 2)
+      p = end;
+  }
+
+  flen = (size_t)(end - path);
+  if (flen - slen >= len || (size_t)(end - p) <= slen ||
+      strncmp(end - slen, TFS_PKG_SUFFIX, slen) != 0)
+    return 0;
+
+  memcpy(file, path, flen - slen);
+  file[flen - slen] = '\0';
+  if (!is_packaged(file))
+    return 0;
+
+  *member = *end == '/' ? end + 1 : end;
+  return 1;
+}
+
+/** Read exactly size bytes at offset of the package open as fh */
+static int read_full(uint64_t fh, void * buf, size_t size, uint64_t offset)
+{
+  size_t done = 0;
+  int ret;
+
+  while (done < size) {
+    ret = TFS_WG_read(fh, (char *)buf + done, size - done,
+        (off_t)(offset + done));
+    if (ret < 0)
+      return ret;
+    else if (ret == 0)
+      return -EIO;
+    done += (size_t)ret;
+  }
+
+  return 0;
+}
+
+/** Member paths become mount paths: no empty, . or .. components */
+static int valid_name(const char * name)
+{
+  const char * p = name, * end;
+
+  do {
+    if ((end = strchr(p, '/')) == NULL)
+      end = p + strlen(p);
+    if (end == p || (size_t)(end - p) > NAME_MAX ||
+        (end - p == 1 && p[0] == '.') ||
+        (end - p == 2 && p[0] == '.' && p[1] == '.'))
+      return 0;
+    p = end + 1;
+  } while (*end != '\0');
+
+  return 1;
+}
+
+static int compare_entries(const void * a, const void * b)
+{
+  return strcmp(((const tfs_pkg_entry_t *)a)->name,
+      ((const tfs_pkg_entry_t *)b)->name);
+}
+
+static void free_index(tfs_pkg_index_t * idx)
+{
+  free(idx->entries);
+  free(idx->names);
+  free(idx);
+}
+
+/**
+ * Find the central directory from the end of central directory record
+ * in the last len bytes of the package, at tail
+ */
+static int find_directory(uint64_t fh, const unsigned char * tail, size_t len,
+    uint64_t size, uint64_t * count, uint64_t * dir_size, uint64_t * dir_off)
+{
+  const unsigned char * eocd = NULL, * loc;
+  unsigned char eocd64[TFS_PKG_EOCD64_LEN];
+  size_t i;
+  int ret;
+
+  // the record is followed by a comment of at most 64k
+  for (i = len - TFS_PKG_EOCD_LEN + 1; i-- > 0; )
+    if (get32(tail + i) == TFS_PKG_EOCD_SIG) {
+      eocd = tail + i;
+      break;
+    }
+
+  if (eocd == NULL)
+    return -EIO;
+
+  *count = get16(eocd + 10);
+  *dir_size = get32(eocd + 12);
+  *dir_off = get32(eocd + 16);
+
+  // archives above 4 GB or 64k members keep the real values in the
+  // zip64 record, pointed to by the locator before the record
+  if (*count == 0xffff || *dir_size == 0xffffffff || *dir_off == 0xffffffff) {
+    if (eocd - tail < TFS_PKG_LOCATOR_LEN)
+      return -EIO;
+    loc = eocd - TFS_PKG_LOCATOR_LEN;
+    if (get32(loc) != TFS_PKG_LOCATOR_SIG ||
+        get64(loc + 8) + TFS_PKG_EOCD64_LEN > size)
+      return -EIO;
+    if ((ret = read_full(fh, eocd64, sizeof(eocd64), get64(loc + 8))) != 0)
+      return ret;
+    if (get32(eocd64) != TFS_PKG_EOCD64_SIG)
+      return -EIO;
+    *count = get64(eocd64 + 32);
+    *dir_size = get64(eocd64 + 40);
+    *dir_off = get64(eocd64 + 48);
+  }
+
+  if (*dir_size > TFS_PKG_MAX_DIRECTORY || *dir_off + *dir_size > size ||
+      *count > *dir_size / TFS_PKG_CENTRAL_LEN)
+    return -EIO;
+
+  return 0;
+}
+
+/** Parse the central directory dir of count records into idx */
+static int parse_directory(tfs_pkg_index_t * idx, const unsigned char * dir,
+    uint64_t dir_size, uint64_t count)
+{
+  const unsigned char * p = dir, * end = dir + dir_size, * x;
+  tfs_pkg_entry_t * e;
+  size_t nlen, xlen, clen, n = 0;
+  char * name;
+
+  idx->entries = calloc((size_t)count, sizeof(tfs_pkg_entry_t));
+  // the names are shorter than their records
+  idx->names = malloc((size_t)dir_size);
+  if (idx->entries == NULL || idx->names == NULL)
+    return -ENOMEM;
+
+  name = idx->names;
+  for (; count > 0; count--, p += TFS_PKG_CENTRAL_LEN + nlen + xlen + clen) {
+    if (end - p < TFS_PKG_CENTRAL_LEN || get32(p) != TFS_PKG_CENTRAL_SIG)
+      return -EIO;
+    nlen = get16(p + 28);
+    xlen = get16(p + 30);
+    clen = get16(p + 32);
+    if ((size_t)(end - p) < TFS_PKG_CENTRAL_LEN + nlen + xlen + clen)
+      return -EIO;
+
+    // directories are implied by the member paths, encrypted members
+    // cannot be read
+    memcpy(name, p + TFS_PKG_CENTRAL_LEN, nlen);
+    name[nlen] = '\0';
+    if (nlen == 0 || name[nlen - 1] == '/' || (get16(p + 8) & 1) ||
+        !valid_name(name))
+      continue;
+
+    e = &idx->entries[n++];
+    e->name = name;
+    e->method = get16(p + 10);
+    e->mtime = dos_time(get16(p + 12), get16(p + 14));
+    e->csize = get32(p + 20);
+    e->usize = get32(p + 24);
+    e->offset = get32(p + 42);
+    name += nlen + 1;
+
+    // the zip64 extra field has the saturated sizes, in this order
+    for (x = p + TFS_PKG_CENTRAL_LEN + nlen;
+        x + 4 <= p + TFS_PKG_CENTRAL_LEN + nlen + xlen;
+        x += 4 + get16(x + 2)) {
+      const unsigned char * v = x + 4, * vend = v + get16(x + 2);
+
+      if (get16(x) != 0x0001)
+        continue;
+      if (e->usize == 0xffffffff && v + 8 <= vend) {
+        e->usize = get64(v);
+        v += 8;
+      }
+      if (e->csize == 0xffffffff && v + 8 <= vend) {
+        e->csize = get64(v);
+        v += 8;
+      }
+      if (e->offset == 0xffffffff && v + 8 <= vend)
+        e->offset = get64(v);
+      break;
+    }
+
+    if (e->offset + TFS_PKG_LOCAL_LEN + e->csize > (uint64_t)idx->node.st.st_size)
+      return -EIO;
+  }
+
+  idx->count = n;
+  qsort(idx->entries, n, sizeof(tfs_pkg_entry_t), compare_entries);
+
+  return 0;
+}
+
+/**
+ * Build the member index of a package from its central directory.
+ * Only the end of the archive and the directory are read.
+ */
+static int build_index(const tfs_wg_node_t * node, tfs_pkg_index_t ** out)
+{
+  tfs_pkg_index_t * idx;
+  unsigned char * tail = NULL, * dir = NULL;
+  uint64_t size = (uint64_t)node->st.st_size, fh;
+  uint64_t count, dir_size, dir_off;
+  size_t len;
+  int ret;
+
+  if (size < TFS_PKG_EOCD_LEN)
+    return -EIO;
+  if ((idx = calloc(1, sizeof(tfs_pkg_index_t))) == NULL)
+    return -ENOMEM;
+  memcpy(&idx->node, node, sizeof(tfs_wg_node_t));
+
+  if ((ret = TFS_WG_open(node, O_RDONLY, &fh)) != 0) {
+    free(idx);
+    return ret;
+  }
+
+  len = size < TFS_PKG_EOCD_LEN + 0xffff ?
+    (size_t)size : TFS_PKG_EOCD_LEN + 0xffff;
+
+  if ((tail = malloc(len)) == NULL)
+    ret = -ENOMEM;
+  else if ((ret = read_full(fh, tail, len, size - len)) != 0 ||
+      (ret = find_directory(fh, tail, len, size, &count, &dir_size,
+                            &dir_off)) != 0)
+    ;
+  else if (dir_off >= size - len)
+    // small archives: the directory came with the tail
+    ret = parse_directory(idx, tail + (dir_off - (size - len)), dir_size,
+        count);
+  else if ((dir = malloc((size_t)dir_size)) == NULL)
+    ret = -ENOMEM;
+  else if ((ret = read_full(fh, dir, (size_t)dir_size, dir_off)) == 0)
+    ret = parse_directory(idx, dir, dir_size, count);
+
+  TFS_WG_release(fh);
+  free(tail);
+  free(dir);
+
+  if (ret != 0) {
+    if (ret == -EIO)
+      TFS_LOG(TFS_LOG_WARN, "Cannot read the zip directory of %s/%s/%s",
+          node->site, node->project, node->file);
+    free_index(idx);
+    return ret;
+  }
+
+  TFS_LOG(TFS_LOG_DEBUG, "Indexed %zu members of %s/%s/%s", idx->count,
+      node->site, node->project, node->file);
+  *out = idx;
+  return 0;
+}
+
+/** Must be called with indexes_mutex held */
+static void put_index_locked(tfs_pkg_index_t * idx)
+{
+  if (--idx->refs == 0)
+    free_index(idx);
+}
+
+static void put_index(tfs_pkg_index_t * idx)
+{
+  pthread_mutex_lock(&indexes_mutex);
+  put_index_locked(idx);
+  pthread_mutex_unlock(&indexes_mutex);
+}
+
+/** Cached index of node, keyed by loid, mtime and size */
+static tfs_pkg_index_t * find_index(const tfs_wg_node_t * node)
+{
+  size_t i;
+
+  for (i = 0; i < TFS_PKG_INDEXES; i++)
+    if (indexes[i] != NULL && indexes[i]->node.loid == node->loid &&
+        indexes[i]->node.st.st_mtime == node->st.st_mtime &&
+        indexes[i]->node.st.st_size == node->st.st_size) {
+      indexes[i]->refs++;
+      indexes[i]->used = ++clock_hand;
+      return indexes[i];
+    }
+
+  return NULL;
+}
+
+/** Get a reference on the index of the package node */
+static int get_index(const tfs_wg_node_t * node, tfs_pkg_index_t ** out)
+{
+  tfs_pkg_index_t * idx;
+  uint64_t gen;
+  size_t i, slot = 0;
+  int ret;
+
+  pthread_mutex_lock(&indexes_mutex);
+  idx = find_index(node);
+  gen = generation;
+  pthread_mutex_unlock(&indexes_mutex);
+
+  if (idx != NULL) {
+    *out = idx;
+    return 0;
+  }
+
+  // built without the lock, packages are indexed in parallel
+  if ((ret = build_index(node, &idx)) != 0)
+    return ret;
+
+  pthread_mutex_lock(&indexes_mutex);
+
+  if ((*out = find_index(node)) != NULL) {
+    pthread_mutex_unlock(&indexes_mutex);
+    free_index(idx);
+    return 0;
+  }
+
+  // the content changed while it was read: use it once, never cache it
+  if (gen != generation) {
+    pthread_mutex_unlock(&indexes_mutex);
+    idx->refs = 1;
+    *out = idx;
+    return 0;
+  }
+
+  // replace an older version of the same package, or the LRU one
+  for (i = 0; i < TFS_PKG_INDEXES; i++) {
+    if (indexes[i] == NULL || indexes[i]->node.loid == node->loid) {
+      slot = i;
+      break;
+    }
+    if (indexes[i]->used < indexes[slot]->used)
+      slot = i;
+  }
+
+  if (indexes[slot] != NULL)
+    put_index_locked(indexes[slot]);
+  idx->refs = 2;
+  idx->used = ++clock_hand;
+  indexes[slot] = idx;
+
+  pthread_mutex_unlock(&indexes_mutex);
+
+  *out = idx;
+  return 0;
+}
+
+/** Resolve the package of path and get its index */
+static int open_index(const char * path, tfs_pkg_index_t ** idx,
+    const char ** member)
+{
+  char file[PATH_MAX];
+  tfs_wg_node_t node;
+  int ret;
+
+  if (!split_path(path, file, sizeof(file), member))
+    return -ENOENT;
+  if ((ret = TFS_WG_parse_path(file, &node)) != 0)
+    return ret;
+  if (node.level != TFS_WG_FILE)
+    return -ENOENT;
+
+  return get_index(&node, idx);
+}
+
+/** Position of the first entry not sorting before name */
+static size_t lower_bound(const tfs_pkg_index_t * idx, const char * name)
+{
+  size_t lo = 0, hi = idx->count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(idx->entries[mid].name, name) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static const tfs_pkg_entry_t * find_entry(const tfs_pkg_index_t * idx,
+    const char * name)
+{
+  size_t i = lower_bound(idx, name);
+
+  if (i < idx->count && strcmp(idx->entries[i].name, name) == 0)
+    return &idx->entries[i];
+
+  return NULL;
+}
+
+/**
+ * Put name + "/" into prefix, the start of the paths inside the directory
+ * name ("" for the top of the archive). Returns its position in the
+ * index, or -ENOENT if no member is inside name.
+ */
+static ssize_t find_dir(const tfs_pkg_index_t * idx, const char * name,
+    char * prefix, size_t len)
+{
+  size_t i, plen;
+
+  if (snprintf(prefix, len, *name ? "%s/" : "%s", name) >= (int)len)
+    return -ENAMETOOLONG;
+
+  plen = strlen(prefix);
+  i = lower_bound(idx, prefix);
+  if (*name && (i == idx->count ||
+        strncmp(idx->entries[i].name, prefix, plen) != 0))
+    return -ENOENT;
+
+  return (ssize_t)i;
+}
+
+static void dir_stat(const tfs_pkg_index_t * idx, struct stat * st)
+{
+  memset(st, 0, sizeof(struct stat));
+  st->st_mode = S_IFDIR | 0555;
+  st->st_nlink = 2;
+  st->st_mtime = idx->node.st.st_mtime;
+}
+
+static void member_stat(const tfs_pkg_entry_t * e, struct stat * st)
+{
+  memset(st, 0, sizeof(struct stat));
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_size = (off_t)e->usize;
+  st->st_blocks = (blkcnt_t)((e->usize + 511) / 512);
+  st->st_mtime = e->mtime;
+}
+
+void TFS_PKG_invalidate(uint64_t loid)
+{
+  size_t i;
+
+  pthread_mutex_lock(&indexes_mutex);
+  generation++;
+  for (i = 0; i < TFS_PKG_INDEXES; i++)
+    if (indexes[i] != NULL && indexes[i]->node.loid == loid) {
+      // open members keep their reference until released
+      put_index_locked(indexes[i]);
+      indexes[i] = NULL;
+    }
+  pthread_mutex_unlock(&indexes_mutex);
+}
+
+void TFS_PKG_enable()
+{
+  enabled = 1;
+}
+
+int TFS_PKG_enabled()
+{
+  return enabled;
+}
+
+int TFS_PKG_is_package(const char * path)
+{
+  char file[PATH_MAX];
+  const char * member;
+
+  return enabled && split_path(path, file, sizeof(file), &member);
+}
+
+typedef struct {
+  void * buffer;
+  tfs_wg_add_dir_t filler;
+} tfs_pkg_lister_t;
+
+static int add_with_members(void * buf, const char * name,
+    const struct stat * stbuf, off_t off)
+{
+  tfs_pkg_lister_t * l = buf;
+  char dir[NAME_MAX + 1];
+  struct stat st;
+
+  if (l->filler(l->buffer, name, stbuf, off) != 0)
+    return 1;
+
+  if (!is_packaged(name) ||
+      snprintf(dir, sizeof(dir), "%s" TFS_PKG_SUFFIX, name) >= (int)sizeof(dir))
+    return 0;
+
+  memset(&st, 0, sizeof(st));
+  st.st_mode = S_IFDIR | 0555;
+  st.st_nlink = 2;
+  st.st_mtime = stbuf->st_mtime;
+
+  return l->filler(l->buffer, dir, &st, 0);
+}
+
+int TFS_PKG_readdir_project(const tfs_wg_node_t * node, void * buffer,
+    tfs_wg_add_dir_t filler)
+{
+  tfs_pkg_lister_t l = { buffer, filler };
+
+  if (!enabled)
+    return TFS_WG_readdir(node, buffer, filler);
+
+  return TFS_WG_readdir(node, &l, add_with_members);
+}
+
+int TFS_PKG_getattr(const char * path, struct stat * st)
+{
+  tfs_pkg_index_t * idx;
+  const tfs_pkg_entry_t * e;
+  const char * member;
+  char prefix[PATH_MAX];
+  ssize_t ret;
+
+  if ((ret = open_index(path, &idx, &member)) != 0)
+    return (int)ret;
+
+  if ((e = find_entry(idx, member)) != NULL) {
+    member_stat(e, st);
+    ret = 0;
+  } else if ((ret = find_dir(idx, member, prefix, sizeof(prefix))) >= 0) {
+    dir_stat(idx, st);
+    ret = 0;
+  }
+
+  put_index(idx);
+  return (int)ret;
+}
+
+int TFS_PKG_readdir(const char * path, void * buffer, tfs_wg_add_dir_t filler)
+{
+  tfs_pkg_index_t * idx;
+  const tfs_pkg_entry_t * e;
+  const char * member, * rest, * slash;
+  char prefix[PATH_MAX], name[NAME_MAX + 1] = "";
+  struct stat st;
+  size_t i, plen, len;
+  ssize_t ret;
+
+  if ((ret = open_index(path, &idx, &member)) != 0)
+    return (int)ret;
+
+  if (find_entry(idx, member) != NULL) {
+    put_index(idx);
+    return -ENOTDIR;
+  }
+
+  if ((ret = find_dir(idx, member, prefix, sizeof(prefix))) < 0) {
+    put_index(idx);
+    return (int)ret;
+  }
+
+  // the paths inside a directory are next to each other in the sorted
+  // index and the ones in the same subdirectory follow each other
+  plen = strlen(prefix);
+  for (i = (size_t)ret; i < idx->count; i++) {
+    e = &idx->entries[i];
+    if (strncmp(e->name, prefix, plen) != 0)
+      break;
+
+    rest = e->name + plen;
+    slash = strchr(rest, '/');
+    len = slash ? (size_t)(slash - rest) : strlen(rest);
+    if (strlen(name) == len && strncmp(name, rest, len) == 0)
+      continue;
+
+    memcpy(name, rest, len);
+    name[len] = '\0';
+    if (slash)
+      dir_stat(idx, &st);
+    else
+      member_stat(e, &st);
+
+    if (filler(buffer, name, &st, 0) != 0)
+      break;
+  }
+
+  put_index(idx);
+  return 0;
+}
+
+int TFS_PKG_open(const char * path, int flags, uint64_t * fh)
+{
+  tfs_pkg_index_t * idx;
+  tfs_pkg_handle_t * h;
+  const tfs_pkg_entry_t * e;
+  const char * member;
+  char prefix[PATH_MAX];
+  unsigned char local[TFS_PKG_LOCAL_LEN];
+  int ret;
+
+  if ((ret = open_index(path, &idx, &member)) != 0)
+    return ret;
+
+  if ((e = find_entry(idx, member)) == NULL) {
+    ret = find_dir(idx, member, prefix, sizeof(prefix)) < 0 ?
+      -ENOENT : -EISDIR;
+  } else if ((flags & O_ACCMODE) != O_RDONLY) {
+    ret = -EACCES;
+#ifdef HAVE_ZLIB
+  } else if (e->method != TFS_PKG_STORED && e->method != TFS_PKG_DEFLATED) {
+#else
+  } else if (e->method != TFS_PKG_STORED) {
+#endif
+    TFS_LOG(TFS_LOG_WARN, "Compression method %u of %s is not supported",
+        e->method, path);
+    ret = -ENOTSUP;
+  }
+
+  if (ret != 0) {
+    put_index(idx);
+    return ret;
+  }
+
+  if ((h = calloc(1, sizeof(tfs_pkg_handle_t))) == NULL) {
+    put_index(idx);
+    return -ENOMEM;
+  }
+  h->index = idx;
+  h->entry = e;
+
+  if ((ret = TFS_WG_open(&idx->node, O_RDONLY, &h->fh)) != 0) {
+    put_index(idx);
+    free(h);
+    return ret;
+  }
+
+  // the local header repeats the name, its extra field may differ from
+  // the one in the central directory
+  if ((ret = read_full(h->fh, local, sizeof(local), e->offset)) == 0) {
+    if (get32(local) != TFS_PKG_LOCAL_SIG)
+      ret = -EIO;
+    h->data = e->offset + TFS_PKG_LOCAL_LEN + get16(local + 26) +
+      get16(local + 28);
+  }
+
+#ifdef HAVE_ZLIB
+  if (ret == 0 && e->method == TFS_PKG_DEFLATED &&
+      inflateInit2(&h->zs, -MAX_WBITS) != Z_OK)
+    ret = -ENOMEM;
+#endif
+
+  if (ret != 0) {
+    TFS_WG_release(h->fh);
+    put_index(idx);
+    free(h);
+    return ret;
+  }
+
+  pthread_mutex_init(&h->mutex, NULL);
+  *fh = (uint64_t)(uintptr_t)h;
+  return 0;
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * Inflate size bytes at offset. Reads going forward continue the stream,
+ * a read going back starts it over from the beginning of the member.
+ */
+static int inflate_read(tfs_pkg_handle_t * h, char * buf, size_t size,
+    uint64_t offset)
+{
+  unsigned char skip[16 * 1024];
+  size_t done = 0, n;
+  uInt avail;
+  int z, ret;
+
+  if (offset < h->out_pos) {
+    inflateReset(&h->zs);
+    h->zs.avail_in = 0;
+    h->in_pos = h->out_pos = 0;
+  }
+
+  while (done < size) {
+    if (h->zs.avail_in == 0 && h->in_pos < h->entry->csize) {
+      n = h->entry->csize - h->in_pos < TFS_PKG_CHUNK ?
+        (size_t)(h->entry->csize - h->in_pos) : TFS_PKG_CHUNK;
+      if ((ret = read_full(h->fh, h->in, n, h->data + h->in_pos)) != 0)
+        return done > 0 ? (int)done : ret;
+      h->zs.next_in = h->in;
+      h->zs.avail_in = (uInt)n;
+      h->in_pos += n;
+    }
+
+    // the part before offset is inflated and thrown away
+    if (h->out_pos < offset) {
+      h->zs.next_out = skip;
+      avail = offset - h->out_pos < sizeof(skip) ?
+        (uInt)(offset - h->out_pos) : (uInt)sizeof(skip);
+    } else {
+      h->zs.next_out = (unsigned char *)buf + done;
+      avail = size - done < UINT_MAX ? (uInt)(size - done) : UINT_MAX;
+    }
+    h->zs.avail_out = avail;
+
+    z = inflate(&h->zs, Z_NO_FLUSH);
+
+    n = avail - h->zs.avail_out;
+    if (h->out_pos >= offset)
+      done += n;
+    h->out_pos += n;
+
+    if (z == Z_STREAM_END)
+      break;
+    if (z != Z_OK) {
+      TFS_LOG(TFS_LOG_WARN, "Cannot inflate %s of %s/%s/%s: %d",
+          h->entry->name, h->index->node.site, h->index->node.project,
+          h->index->node.file, z);
+      return done > 0 ? (int)done : -EIO;
+    }
+  }
+
+  return (int)done;
+}
+#endif
+
+int TFS_PKG_read(uint64_t fh, char * buf, size_t size, off_t offset)
+{
+  tfs_pkg_handle_t * h = (tfs_pkg_handle_t *)(uintptr_t)fh;
+  const tfs_pkg_entry_t * e = h->entry;
+  int ret;
+
+  if (offset < 0)
+    return -EINVAL;
+  if ((uint64_t)offset >= e->usize)
+    return 0;
+  if (size > e->usize - (uint64_t)offset)
+    size = (size_t)(e->usize - (uint64_t)offset);
+
+  pthread_mutex_lock(&h->mutex);
+#ifdef HAVE_ZLIB
+  if (e->method == TFS_PKG_DEFLATED)
+    ret = inflate_read(h, buf, size, (uint64_t)offset);
+  else
+#endif
+  if ((ret = read_full(h->fh, buf, size, h->data + (uint64_t)offset)) == 0)
+    ret = (int)size;
+  pthread_mutex_unlock(&h->mutex);
+
+  return ret;
+}
+
+int TFS_PKG_release(uint64_t fh)
+{
+  tfs_pkg_handle_t * h = (tfs_pkg_handle_t *)(uintptr_t)fh;
+
+#ifdef HAVE_ZLIB
+  if (h->entry->method == TFS_PKG_DEFLATED)
+    inflateEnd(&h->zs);
+#endif
+  TFS_WG_release(h->fh);
+  put_index(h->index);
+  pthread_mutex_destroy(&h->mutex);
+  free(h);
+
+  return 0;
+}
@@ -0,0 +1,77 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_package_h
+#define tableaufs_package_h
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "workgroup.h"
+
+/**
+ * Appended to the name of a packaged workbook or datasource (.twbx,
+ * .tdsx) to get the directory showing the members of its zip archive
+ */
+#define TFS_PKG_SUFFIX ".d"
+
+/** Member indexes of this many packages are kept in memory */
+#define TFS_PKG_INDEXES 64
+
+/** Show the member directories of the packages */
+extern void TFS_PKG_enable();
+
+/** Returns non-zero if the member directories are shown */
+extern int TFS_PKG_enabled();
+
+/**
+ * Drop the cached index of a package whose content was replaced in
+ * place: writes through the mount and copies keep its updated_at.
+ */
+extern void TFS_PKG_invalidate(uint64_t loid);
+
+/** Returns non-zero if path is a member directory or inside one */
+extern int TFS_PKG_is_package(const char * path);
+
+/**
+ * TFS_WG_readdir of a project, listing the member directory of every
+ * package right after the package itself
+ */
+extern int TFS_PKG_readdir_project(const tfs_wg_node_t * node, void * buffer,
+    tfs_wg_add_dir_t filler);
+
+extern int TFS_PKG_getattr(const char * path, struct stat * st);
+
+extern int TFS_PKG_readdir(const char * path, void * buffer,
+    tfs_wg_add_dir_t filler);
+
+/**
+ * Open a member read-only. Only the compressed bytes of the member are
+ * read from the repository, deflated members are inflated as a stream.
+ */
+extern int TFS_PKG_open(const char * path, int flags, uint64_t * fh);
+
+extern int TFS_PKG_read(uint64_t fh, char * buf, size_t size, off_t offset);
+
+extern int TFS_PKG_release(uint64_t fh);
+
+#endif /* tableaufs_package_h */
@@ -0,0 +1,476 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "pgpool.h"
+#include "stats.h"
+#include "log.h"
+
+/** A database server with its own pool of connections */
+typedef struct tfs_pg_host_t {
+  char host[256];
+  char port[16];
+  int standby;
+  tfs_pg_conn_t pool[TFS_PG_MAX_POOL_SIZE];  // the first pool_size are used
+  unsigned int busy;   // checked out connections
+  double latency;      // moving average of the probes in microseconds
+  time_t probed;       // time of the last latency probe
+  time_t down_until;   // skipped for reads until then after a failure
+} tfs_pg_host_t;
+
+/** The primary, followed by the standbys */
+static tfs_pg_host_t hosts[1 + TFS_PG_MAX_STANDBYS];
+static unsigned int standbys;
+static unsigned int pool_size;
+
+/** Reads go to the primary until then, see TFS_PG_wrote */
+static time_t primary_until;
+
+/** Protects the in_use flags, the load and the health of the hosts */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled on every checkin */
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Connection data for postgres.
+ *
+ * This gets filled on the call to TFS_PG_pool_init.
+ */
+static struct tableau_cmdargs pg_connection_data;
+
+/** Helper function to wrap connecting to a database using the connection data */
+static PGconn* connect_to_pg( struct tableau_cmdargs conn_data,
+    const tfs_pg_host_t * host )
+{
+  PGconn* new_conn = PQsetdbLogin(
+      host->host,
+      host->port,
+      // sessions show up as tableaufs in pg_stat_activity and the logs
+      "-c application_name=tableaufs", NULL, "workgroup",
+      conn_data.pguser,
+      conn_data.pgpass );
+
+  /* check to see that the backend connection was successfully made */
+  if (PQstatus(new_conn) == CONNECTION_BAD)
+  {
+    TFS_LOG(TFS_LOG_ERROR, "Connection to database '%s' failed: %s",
+        host->host, PQerrorMessage(new_conn));
+    PQfinish(new_conn);
+    return NULL;
+  }
+
+  return new_conn;
+}
+
+/**
+ * Make sure the connection of a checked out slot is usable.
+ *
+ * Called without the pool mutex: the slot is owned by the caller, so
+ * reconnects on one connection never block the others.
+ */
+static int ensure_healthy(tfs_pg_conn_t * pc)
+{
+  PGresult * res;
+
+  if (pc->conn == NULL) {
+    pc->conn = connect_to_pg( pg_connection_data, pc->host );
+    pc->prepared = 0;
+    pc->request = 0;
+    return pc->conn != NULL;
+  }
+
+  // a connection sitting idle for long may have been dropped by a
+  // firewall or a backend restart without libpq noticing it yet
+  if (PQstatus(pc->conn) == CONNECTION_OK &&
+      time(NULL) - pc->last_used > TFS_PG_IDLE_CHECK) {
+    res = PQexec(pc->conn, "SELECT 1");
+    PQclear(res);
+  }
+
+  if (PQstatus(pc->conn) != CONNECTION_OK) {
+    TFS_LOG(TFS_LOG_WARN,
+        "CONNECTION_BAD encountered: '%s'. Trying to reconnect.",
+        PQerrorMessage(pc->conn));
+    PQreset(pc->conn);
+    // prepared statements do not survive the new backend session
+    pc->prepared = 0;
+    pc->request = 0;
+
+    if (PQstatus(pc->conn) != CONNECTION_OK) {
+      TFS_LOG(TFS_LOG_ERROR, "Reconnect failed: %s", PQerrorMessage(pc->conn));
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Pick a free slot of host and mark it used, leaving at least reserve
+ * slots free. Must be called with pool_mutex held, as all the helpers
+ * below
+ */
+static tfs_pg_conn_t * grab_free_slot(tfs_pg_host_t * host,
+    unsigned int reserve)
+{
+  tfs_pg_conn_t * pool = host->pool;
+  unsigned int i;
+
+  if (host->busy + reserve >= pool_size)
+    return NULL;
+
+  // prefer established connections, open new ones only if all of
+  // those are busy
+  for (i = 0; i < pool_size; i++)
+    if (!pool[i].in_use && pool[i].conn != NULL)
+      break;
+
+  if (i == pool_size)
+    for (i = 0; i < pool_size; i++)
+      if (!pool[i].in_use)
+        break;
+
+  if (i == pool_size)
+    return NULL;
+
+  pool[i].in_use = 1;
+  host->busy++;
+  return &pool[i];
+}
+
+/** Expected cost of one more query on a standby */
+static double read_cost(const tfs_pg_host_t * host)
+{
+  return (host->latency + 1.0) * (double)(host->busy + 1);
+}
+
+/**
+ * Pick a slot for a read: on the cheapest healthy standby with a free
+ * slot, or on the primary if there is no healthy standby. Returns NULL
+ * if the standbys to use are all busy (but for reserve slots).
+ */
+static tfs_pg_conn_t * grab_read_slot(unsigned int reserve)
+{
+  tfs_pg_host_t * best = NULL, * host;
+  time_t now = time(NULL);
+  int healthy = 0;
+  unsigned int i;
+
+  if (standbys == 0 || now < primary_until)
+    return grab_free_slot(&hosts[0], reserve);
+
+  for (i = 1; i <= standbys; i++) {
+    host = &hosts[i];
+    if (host->down_until > now)
+      continue;
+
+    healthy = 1;
+    if (host->busy + reserve < pool_size &&
+        (best == NULL || read_cost(host) < read_cost(best)))
+      best = host;
+  }
+
+  if (!healthy)
+    return grab_free_slot(&hosts[0], reserve);
+
+  return best != NULL ? grab_free_slot(best, reserve) : NULL;
+}
+
+/** Skip a failed standby for reads for a while */
+static void mark_down(tfs_pg_host_t * host)
+{
+  if (!host->standby)
+    return;
+
+  pthread_mutex_lock(&pool_mutex);
+  if (host->down_until <= time(NULL))
+    TFS_LOG(TFS_LOG_WARN, "Standby %s:%s is down, reading elsewhere for %d sec",
+        host->host, host->port, TFS_PG_DOWN_TIME);
+  host->down_until = time(NULL) + TFS_PG_DOWN_TIME;
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+/** Measure the round trip time of a standby now and then */
+static void probe(tfs_pg_conn_t * pc)
+{
+  tfs_pg_host_t * host = pc->host;
+  PGresult * res;
+  uint64_t start;
+  double sample;
+  time_t now = time(NULL);
+  int due;
+
+  pthread_mutex_lock(&pool_mutex);
+  due = host->standby && now - host->probed >= TFS_PG_PROBE_INTERVAL;
+  if (due)
+    host->probed = now;
+  pthread_mutex_unlock(&pool_mutex);
+
+  if (!due)
+    return;
+
+  start = TFS_STATS_now();
+  res = PQexec(pc->conn, "SELECT 1");
+  sample = (double)(TFS_STATS_now() - start) / 1000.0;
+  PQclear(res);
+
+  pthread_mutex_lock(&pool_mutex);
+  host->latency = host->latency == 0.0 ? sample :
+    0.8 * host->latency + 0.2 * sample;
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+/** Health check a freshly grabbed slot, give it back if it is unusable */
+static tfs_pg_conn_t * checkout_slot(tfs_pg_conn_t * pc)
+{
+  if (pc != NULL && !ensure_healthy(pc)) {
+    mark_down(pc->host);
+    TFS_PG_checkin(pc);
+    return NULL;
+  }
+
+  if (pc != NULL)
+    TFS_PG_stamp(pc);
+
+  return pc;
+}
+
+void TFS_PG_stamp(tfs_pg_conn_t * pc)
+{
+  PGresult * res;
+  char sql[64];
+  uint64_t request = TFS_LOG_request();
+
+  // costs a round trip, so only done for traced mounts
+  if (!TFS_LOG_tracing() || request == 0 || request == pc->request)
+    return;
+
+  snprintf(sql, sizeof(sql), "SET application_name = 'tableaufs req=%llu'",
+      (unsigned long long)request);
+  res = PQexec(pc->conn, sql);
+  if (PQresultStatus(res) == PGRES_COMMAND_OK)
+    pc->request = request;
+  PQclear(res);
+}
+
+tfs_pg_conn_t * TFS_PG_checkout()
+{
+  tfs_pg_conn_t * pc;
+  uint64_t start = TFS_STATS_now();
+
+  pthread_mutex_lock(&pool_mutex);
+  while ((pc = grab_free_slot(&hosts[0], 0)) == NULL)
+    pthread_cond_wait(&pool_cond, &pool_mutex);
+  pthread_mutex_unlock(&pool_mutex);
+
+  TFS_STATS_record(TFS_STATS_POOL_WAIT, start, 0);
+
+  return checkout_slot(pc);
+}
+
+/** Check out a read slot, failing over to the next host on errors */
+static tfs_pg_conn_t * checkout_read(int wait)
+{
+  tfs_pg_conn_t * pc = NULL;
+  unsigned int tries;
+  uint64_t start;
+
+  // every failed standby is marked down, so each try picks another host
+  for (tries = 0; tries <= standbys && pc == NULL; tries++) {
+    start = TFS_STATS_now();
+
+    pthread_mutex_lock(&pool_mutex);
+    // a checkout that may be held for long leaves the last slots to
+    // everyone else
+    while ((pc = grab_read_slot(wait ? 0 : TFS_PG_RESERVED_SLOTS)) == NULL &&
+        wait)
+      pthread_cond_wait(&pool_cond, &pool_mutex);
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (pc == NULL)
+      return NULL;
+    if (wait)
+      TFS_STATS_record(TFS_STATS_POOL_WAIT, start, 0);
+
+    pc = checkout_slot(pc);
+  }
+
+  if (pc != NULL)
+    probe(pc);
+
+  return pc;
+}
+
+tfs_pg_conn_t * TFS_PG_checkout_read()
+{
+  return checkout_read(1);
+}
+
+tfs_pg_conn_t * TFS_PG_try_checkout_read()
+{
+  return checkout_read(0);
+}
+
+void TFS_PG_wrote()
+{
+  pthread_mutex_lock(&pool_mutex);
+  primary_until = time(NULL) + TFS_PG_STANDBY_LAG;
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+void TFS_PG_checkin(tfs_pg_conn_t * pc)
+{
+  PGresult * res;
+
+  if (pc == NULL)
+    return;
+
+  // never hand over a connection with a pending transaction
+  if (pc->conn != NULL && PQstatus(pc->conn) == CONNECTION_OK &&
+      PQtransactionStatus(pc->conn) != PQTRANS_IDLE) {
+    res = PQexec(pc->conn, "ROLLBACK");
+    PQclear(res);
+  }
+
+  // a standby lost while in use: read elsewhere from now on
+  if (pc->conn != NULL && PQstatus(pc->conn) != CONNECTION_OK)
+    mark_down(pc->host);
+
+  pthread_mutex_lock(&pool_mutex);
+  pc->last_used = time(NULL);
+  pc->in_use = 0;
+  pc->host->busy--;
+  // waiters of the primary and of the standbys share the condition
+  pthread_cond_broadcast(&pool_cond);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+int TFS_PG_lost(const tfs_pg_conn_t * pc)
+{
+  return pc->conn == NULL || PQstatus(pc->conn) != CONNECTION_OK;
+}
+
+/** Set up host with its empty pool */
+static void init_host(tfs_pg_host_t * host, const char * name,
+    const char * port, int standby)
+{
+  unsigned int i;
+
+  snprintf(host->host, sizeof(host->host), "%s", name);
+  snprintf(host->port, sizeof(host->port), "%s", port);
+  host->standby = standby;
+
+  for (i = 0; i < TFS_PG_MAX_POOL_SIZE; i++)
+    host->pool[i].host = host;
+}
+
+/** Parse the host[:port];host[:port] list of pgstandby= */
+static void init_standbys(const char * list, const char * default_port)
+{
+  char * copy, * item, * save, * port;
+
+  if (list == NULL || (copy = strdup(list)) == NULL)
+    return;
+
+  for (item = strtok_r(copy, ";", &save); item != NULL;
+      item = strtok_r(NULL, ";", &save)) {
+    if (standbys == TFS_PG_MAX_STANDBYS) {
+      TFS_LOG(TFS_LOG_WARN, "Only %d standbys are used", TFS_PG_MAX_STANDBYS);
+      break;
+    }
+
+    if ((port = strrchr(item, ':')) != NULL)
+      *port++ = '\0';
+    standbys++;
+    init_host(&hosts[standbys], item, port ? port : default_port, 1);
+  }
+
+  free(copy);
+}
+
+int TFS_PG_pool_init(const struct tableau_cmdargs * args)
+{
+  tfs_pg_conn_t * pc;
+  unsigned int i;
+
+  pg_connection_data = *args;
+
+  pool_size = args->poolsize;
+  if (pool_size == 0)
+    pool_size = TFS_PG_DEFAULT_POOL_SIZE;
+  else if (pool_size > TFS_PG_MAX_POOL_SIZE)
+    pool_size = TFS_PG_MAX_POOL_SIZE;
+
+  init_host(&hosts[0], args->pghost, args->pgport, 0);
+  init_standbys(args->pgstandby, args->pgport);
+
+  // Set up the first connection so bad credentials show up at mount time
+  pc = TFS_PG_checkout();
+  if (pc == NULL)
+    return -1;
+
+  TFS_PG_checkin(pc);
+
+  // a standby that is down at mount time only means more primary reads
+  for (i = 1; i <= standbys; i++) {
+    pc = &hosts[i].pool[0];
+    pthread_mutex_lock(&pool_mutex);
+    pc->in_use = 1;
+    hosts[i].busy++;
+    pthread_mutex_unlock(&pool_mutex);
+
+    if ((pc = checkout_slot(pc)) != NULL) {
+      probe(pc);
+      TFS_PG_checkin(pc);
+    }
+  }
+
+  return 0;
+}
+
+PGconn * TFS_PG_connect()
+{
+  return connect_to_pg( pg_connection_data, &hosts[0] );
+}
+
+int64_t TFS_PG_get_int8(const PGresult * res, int row, int col)
+{
+  const unsigned char * p = (const unsigned char *)PQgetvalue(res, row, col);
+  uint64_t v = 0;
+  int i;
+
+  if (PQgetisnull(res, row, col))
+    return 0;
+  else if (PQfformat(res, col) == 0)
+    return atoll((const char *)p);
+
+  for (i = 0; i < 8; i++)
+    v = v << 8 | p[i];
+
+  return (int64_t)v;
+}
@@ -0,0 +1,132 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_pgpool_h
+#define tableaufs_pgpool_h
+#include <stdint.h>
+#include <time.h>
+#include "tableaufs.h"
+#include "libpq-fe.h"
+
+/** Pool size used when no poolsize= mount option is given */
+#define TFS_PG_DEFAULT_POOL_SIZE 8
+
+/** Hard upper limit for the poolsize= mount option */
+#define TFS_PG_MAX_POOL_SIZE 64
+
+/** Slots of every host TFS_PG_try_checkout_read leaves to the others */
+#define TFS_PG_RESERVED_SLOTS 1
+
+/** Connections idle for longer than this (sec) are pinged on checkout */
+#define TFS_PG_IDLE_CHECK 30
+
+/** Hard upper limit of the hosts given with the pgstandby= mount option */
+#define TFS_PG_MAX_STANDBYS 8
+
+/** Seconds between two latency probes of a standby */
+#define TFS_PG_PROBE_INTERVAL 5
+
+/** Seconds a standby is skipped after it failed */
+#define TFS_PG_DOWN_TIME 30
+
+/**
+ * Seconds reads stay on the primary after a write, so they do not miss
+ * it on a standby that has not replayed it yet
+ */
+#define TFS_PG_STANDBY_LAG 10
+
+struct tfs_pg_host_t;
+
+/** One pooled backend session */
+typedef struct tfs_pg_conn_t {
+  struct tfs_pg_host_t * host;  // server of the session
+  PGconn * conn;     // libpq connection, NULL if not yet connected
+  int in_use;        // checked out by a thread
+  time_t last_used;  // time of the last checkin
+  unsigned int prepared; // bitmask of the statements prepared on conn
+  uint64_t request;  // request ID in the application_name of the session
+} tfs_pg_conn_t;
+
+/**
+ * Set up the pool of the primary and of every standby of pgstandby=.
+ * Opens the first connection to the primary to validate the credentials.
+ */
+extern int TFS_PG_pool_init(const struct tableau_cmdargs * args);
+
+/**
+ * Get a healthy connection to the primary, waiting until one is free.
+ *
+ * Returns NULL if the backend cannot be reached.
+ */
+extern tfs_pg_conn_t * TFS_PG_checkout();
+
+/**
+ * Get a healthy connection for queries that do not write, waiting
+ * until one is free.
+ *
+ * With standbys configured, this is a connection to the healthy standby
+ * with the lowest latency, weighted by the sessions already busy on it.
+ * Standbys failing to connect are skipped for TFS_PG_DOWN_TIME seconds.
+ * Without standbys, or with all of them down, or right after a write,
+ * the primary is used.
+ */
+extern tfs_pg_conn_t * TFS_PG_checkout_read();
+
+/**
+ * Like TFS_PG_checkout_read, but returns NULL instead of waiting. Meant
+ * for sessions held across calls: it never takes the last
+ * TFS_PG_RESERVED_SLOTS slots of a host, so those cannot all be pinned.
+ */
+extern tfs_pg_conn_t * TFS_PG_try_checkout_read();
+
+/** Keep reads on the primary for TFS_PG_STANDBY_LAG seconds after a write */
+extern void TFS_PG_wrote();
+
+/**
+ * Put the request ID of the calling thread into the application_name of
+ * the session, so backend logs and pg_stat_activity can be matched with
+ * the trace. Only done while tracing. Called on checkout, connections
+ * kept across operations have to call it again.
+ */
+extern void TFS_PG_stamp(tfs_pg_conn_t * pc);
+
+/** Return a connection to the pool, rolling back any open transaction */
+extern void TFS_PG_checkin(tfs_pg_conn_t * pc);
+
+/**
+ * Returns non-zero if the connection of pc was lost. Checking pc in
+ * then marks a standby down, so a failed read is worth trying again
+ * with a fresh TFS_PG_checkout_read: it goes to the next host.
+ */
+extern int TFS_PG_lost(const tfs_pg_conn_t * pc);
+
+/**
+ * Open a connection outside of the pool, for sessions that have to
+ * stay open (LISTEN). Returns NULL on failure.
+ */
+extern PGconn * TFS_PG_connect();
+
+/** Decode an int8 result column, text or binary */
+extern int64_t TFS_PG_get_int8(const PGresult * res, int row, int col);
+
+#endif /* tableaufs_pgpool_h */
@@ -0,0 +1,134 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "pipeline.h"
+#include "log.h"
+
+void TFS_PL_begin(tfs_pl_t * pl, tfs_pg_conn_t * pc)
+{
+  memset(pl, 0, sizeof(tfs_pl_t));
+  pl->pc = pc;
+
+#ifdef LIBPQ_HAS_PIPELINING
+  // pipelining needs the v3 protocol; servers from before it get the
+  // synchronous fallback
+  if (PQprotocolVersion(pc->conn) >= 3 &&
+      PQenterPipelineMode(pc->conn) == 1)
+    pl->pipelined = 1;
+#endif // LIBPQ_HAS_PIPELINING
+}
+
+int TFS_PL_send(tfs_pl_t * pl, const char * sql, int nparams,
+    const char * const * params, int binary)
+{
+  if (pl->sent == TFS_PL_MAX || pl->synced)
+    return -EAGAIN;
+
+#ifdef LIBPQ_HAS_PIPELINING
+  if (pl->pipelined) {
+    if (PQsendQueryParams(pl->pc->conn, sql, nparams, NULL, params, NULL, NULL,
+          binary) != 1) {
+      TFS_LOG(TFS_LOG_ERROR, "Queueing request failed: %s",
+          PQerrorMessage(pl->pc->conn));
+      return -EIO;
+    }
+    pl->sent++;
+    return 0;
+  }
+#endif // LIBPQ_HAS_PIPELINING
+
+  pl->results[pl->sent++] = PQexecParams(pl->pc->conn, sql, nparams, NULL, params,
+      NULL, NULL, binary);
+  return 0;
+}
+
+PGresult * TFS_PL_next(tfs_pl_t * pl)
+{
+  PGresult * res, * extra;
+
+  if (pl->received == pl->sent)
+    return NULL;
+
+  if (!pl->pipelined) {
+    res = pl->results[pl->received];
+    pl->results[pl->received++] = NULL;
+    return res;
+  }
+
+#ifdef LIBPQ_HAS_PIPELINING
+  // everything is queued once the first result is asked for
+  if (!pl->synced) {
+    if (PQpipelineSync(pl->pc->conn) != 1)
+      TFS_LOG(TFS_LOG_ERROR, "Pipeline sync failed: %s",
+          PQerrorMessage(pl->pc->conn));
+    pl->synced = 1;
+  }
+
+  res = PQgetResult(pl->pc->conn);
+
+  // every request ends with a NULL result
+  while ((extra = PQgetResult(pl->pc->conn)) != NULL)
+    PQclear(extra);
+#else
+  res = extra = NULL;
+#endif // LIBPQ_HAS_PIPELINING
+
+  pl->received++;
+  return res;
+}
+
+void TFS_PL_end(tfs_pl_t * pl)
+{
+  PGresult * res;
+
+  while (pl->received < pl->sent)
+    PQclear(TFS_PL_next(pl));
+
+#ifdef LIBPQ_HAS_PIPELINING
+  if (!pl->pipelined)
+    return;
+
+  if (!pl->synced)
+    PQpipelineSync(pl->pc->conn);
+
+  while ((res = PQgetResult(pl->pc->conn)) != NULL) {
+    ExecStatusType status = PQresultStatus(res);
+    PQclear(res);
+    if (status == PGRES_PIPELINE_SYNC)
+      break;
+  }
+
+  // a connection stuck in pipeline mode is useless for everyone else
+  if (PQexitPipelineMode(pl->pc->conn) != 1) {
+    TFS_LOG(TFS_LOG_ERROR, "Leaving pipeline mode failed: %s",
+        PQerrorMessage(pl->pc->conn));
+    PQreset(pl->pc->conn);
+    pl->pc->prepared = 0;
+  }
+#else
+  (void)res;
+#endif // LIBPQ_HAS_PIPELINING
+}
@@ -0,0 +1,69 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_pipeline_h
+#define tableaufs_pipeline_h
+#include "libpq-fe.h"
+#include "pgpool.h"
+
+/**
+ * Requests queued in one batch. Results are only read after the last
+ * request is sent, so the batch has to stay small enough for the
+ * requests to fit into the socket buffers.
+ */
+#define TFS_PL_MAX 64
+
+/**
+ * A batch of requests on one connection.
+ *
+ * With pipelining (libpq 14 or newer) all requests go out before the
+ * first result is read, saving a round trip per request. Otherwise every
+ * request is run synchronously when queued and its result is kept until
+ * it is asked for, so callers do not have to care about the mode.
+ */
+typedef struct tfs_pl_t {
+  tfs_pg_conn_t * pc;
+  int pipelined;               // in pipeline mode
+  int synced;                  // pipeline sync already sent
+  int sent;                    // requests queued
+  int received;                // results handed out
+  PGresult * results[TFS_PL_MAX];  // synchronous results not yet handed out
+} tfs_pl_t;
+
+/** Start a batch on the connection pc, in pipeline mode if possible */
+extern void TFS_PL_begin(tfs_pl_t * pl, tfs_pg_conn_t * pc);
+
+/**
+ * Queue a request. params are text, binary selects the result format.
+ * Returns 0, or -EAGAIN when the batch is full, or -EIO.
+ */
+extern int TFS_PL_send(tfs_pl_t * pl, const char * sql, int nparams,
+    const char * const * params, int binary);
+
+/** Result of the next request in queue order, NULL after the last one */
+extern PGresult * TFS_PL_next(tfs_pl_t * pl);
+
+/** Drop the unread results and leave pipeline mode */
+extern void TFS_PL_end(tfs_pl_t * pl);
+
+#endif /* tableaufs_pipeline_h */
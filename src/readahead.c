@@ -0,0 +1,257 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdlib.h>
+#include <string.h>
+#include "readahead.h"
+#include "workgroup.h"
+#include "blockcache.h"
+#include "worker.h"
+#include "stripe.h"
+
+static size_t max_window = (size_t)TFS_RA_DEFAULT_MAX_KB * 1024;
+
+void TFS_RA_configure(unsigned int max_kb)
+{
+  max_window = (size_t)max_kb * 1024;
+}
+
+void TFS_RA_init(tfs_ra_state_t * ra, uint64_t loid, time_t mtime, off_t size)
+{
+  memset(ra, 0, sizeof(tfs_ra_state_t));
+  ra->loid = loid;
+  ra->mtime = mtime;
+  ra->size = size;
+  ra->window = TFS_RA_INITIAL_WINDOW;
+  pthread_mutex_init(&ra->mutex, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+}
+
+/**
+ * Store the blocks of len bytes at the block aligned off. A partial
+ * last block is only complete at the end of the file.
+ */
+static void store_blocks(tfs_ra_state_t * ra, const char * buf, size_t len,
+    off_t off, int eof)
+{
+  size_t i, n;
+
+  for (i = 0; i < len; i += TFS_BC_BLOCKSIZE) {
+    n = len - i < TFS_BC_BLOCKSIZE ? len - i : TFS_BC_BLOCKSIZE;
+    if (n < TFS_BC_BLOCKSIZE && !eof)
+      break;
+    TFS_BC_store_block(ra->loid, ra->mtime,
+        (uint64_t)(off + (off_t)i) / TFS_BC_BLOCKSIZE, buf + i, n);
+  }
+}
+
+/** Read len bytes at off into buf, through the block cache if enabled */
+static size_t fetch_range(tfs_ra_state_t * ra, char * buf, size_t len,
+    off_t off)
+{
+  size_t done = 0, chunk;
+  ssize_t got;
+  int ret;
+
+  while (done < len) {
+    chunk = len - done;
+
+    // windows are block aligned with the block cache, so every block
+    // fetched here can be stored for later reads
+    if (TFS_BC_enabled() && chunk >= TFS_BC_BLOCKSIZE) {
+      got = TFS_BC_read_block(ra->loid, ra->mtime,
+          (uint64_t)(off + (off_t)done) / TFS_BC_BLOCKSIZE, buf + done);
+      if (got >= 0) {
+        done += (size_t)got;
+        if ((size_t)got < TFS_BC_BLOCKSIZE)
+          break;
+        continue;
+      }
+
+      // the rest of the window in one go if striping pays off
+      if (!TFS_STRIPE_worth(chunk))
+        chunk = TFS_BC_BLOCKSIZE;
+    }
+
+    ret = TFS_STRIPE_read(ra->loid, buf + done, chunk, off + (off_t)done);
+    if (ret <= 0)
+      break;
+
+    if (TFS_BC_enabled())
+      store_blocks(ra, buf + done, (size_t)ret, off + (off_t)done,
+          (size_t)ret < chunk);
+
+    done += (size_t)ret;
+    if ((size_t)ret < chunk)
+      break;
+  }
+
+  return done;
+}
+
+/** Worker job: fill the pending window and publish it in a free slot */
+static void prefetch_job(void * arg)
+{
+  tfs_ra_state_t * ra = arg;
+  char * buf;
+  size_t len = 0;
+  int i;
+
+  buf = malloc(ra->pending_len);
+  if (buf != NULL)
+    len = fetch_range(ra, buf, ra->pending_len, ra->pending_off);
+
+  pthread_mutex_lock(&ra->mutex);
+  for (i = 0; i < 2 && len > 0; i++) {
+    if (ra->slot[i].buf == NULL) {
+      ra->slot[i].buf = buf;
+      ra->slot[i].off = ra->pending_off;
+      ra->slot[i].len = len;
+      buf = NULL;
+      break;
+    }
+  }
+  ra->pending = 0;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+
+  free(buf);
+}
+
+size_t TFS_RA_read(tfs_ra_state_t * ra, char * buf, size_t size, off_t offset)
+{
+  size_t copied = 0, n;
+  off_t pos;
+  int i, found;
+
+  if (max_window == 0)
+    return 0;
+
+  pthread_mutex_lock(&ra->mutex);
+  while (copied < size) {
+    pos = offset + (off_t)copied;
+    found = 0;
+
+    for (i = 0; i < 2; i++) {
+      tfs_ra_slot_t * s = &ra->slot[i];
+      if (s->buf != NULL && pos >= s->off && pos < s->off + (off_t)s->len) {
+        n = (size_t)(s->off + (off_t)s->len - pos);
+        if (n > size - copied)
+          n = size - copied;
+        memcpy(buf + copied, s->buf + (pos - s->off), n);
+        copied += n;
+        found = 1;
+        break;
+      }
+    }
+
+    if (found)
+      continue;
+
+    // the data is on its way, waiting is cheaper than a new round trip
+    if (ra->pending && pos >= ra->pending_off &&
+        pos < ra->pending_off + (off_t)ra->pending_len)
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    else
+      break;
+  }
+  pthread_mutex_unlock(&ra->mutex);
+
+  return copied;
+}
+
+void TFS_RA_update(tfs_ra_state_t * ra, off_t offset, size_t len)
+{
+  off_t ahead;
+  int i, free_slot = -1;
+
+  if (max_window == 0)
+    return;
+
+  pthread_mutex_lock(&ra->mutex);
+
+  if (offset == ra->next) {
+    ra->streak++;
+  } else {
+    ra->streak = 0;
+    ra->window = TFS_RA_INITIAL_WINDOW;
+  }
+  ra->next = offset + (off_t)len;
+
+  // drop consumed windows, find how far the prefetched data reaches
+  ahead = ra->next;
+  for (i = 0; i < 2; i++) {
+    tfs_ra_slot_t * s = &ra->slot[i];
+    if (s->buf != NULL && (s->off + (off_t)s->len <= ra->next ||
+          s->off > ra->next + (off_t)max_window)) {
+      free(s->buf);
+      memset(s, 0, sizeof(tfs_ra_slot_t));
+    }
+  }
+  // two passes, the slots are not ordered by offset
+  for (i = 0; i < 4; i++) {
+    tfs_ra_slot_t * s = &ra->slot[i % 2];
+    if (s->buf == NULL)
+      free_slot = i % 2;
+    else if (ahead >= s->off && ahead < s->off + (off_t)s->len)
+      ahead = s->off + (off_t)s->len;
+  }
+
+  if (ra->streak > 0 && !ra->pending && free_slot >= 0 &&
+      ahead < ra->size && ahead - ra->next < (off_t)(ra->window / 2)) {
+    if (TFS_BC_enabled())
+      ahead -= ahead % TFS_BC_BLOCKSIZE;
+
+    ra->pending = 1;
+    ra->pending_off = ahead;
+    ra->pending_len = ra->window;
+    if (ra->pending_off + (off_t)ra->pending_len > ra->size)
+      ra->pending_len = (size_t)(ra->size - ra->pending_off);
+
+    if (TFS_WORKER_submit(prefetch_job, ra) != 0)
+      ra->pending = 0;
+
+    // the longer the streak, the larger the next window
+    if (ra->window * 2 <= max_window)
+      ra->window *= 2;
+    else
+      ra->window = max_window;
+  }
+
+  pthread_mutex_unlock(&ra->mutex);
+}
+
+void TFS_RA_destroy(tfs_ra_state_t * ra)
+{
+  int i;
+
+  pthread_mutex_lock(&ra->mutex);
+  while (ra->pending)
+    pthread_cond_wait(&ra->cond, &ra->mutex);
+  for (i = 0; i < 2; i++)
+    free(ra->slot[i].buf);
+  pthread_mutex_unlock(&ra->mutex);
+
+  pthread_mutex_destroy(&ra->mutex);
+  pthread_cond_destroy(&ra->cond);
+}
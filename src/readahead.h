@@ -0,0 +1,82 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_readahead_h
+#define tableaufs_readahead_h
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/** First prefetch window of a sequential stream */
+#define TFS_RA_INITIAL_WINDOW (128 * 1024)
+
+/** Default upper limit of the prefetch window in kilobytes */
+#define TFS_RA_DEFAULT_MAX_KB 4096
+
+/** A window of prefetched file content */
+typedef struct tfs_ra_slot_t {
+  char * buf;
+  off_t off;
+  size_t len;
+} tfs_ra_slot_t;
+
+/** Per-handle sequential access detection and prefetch buffers */
+typedef struct tfs_ra_state_t {
+  uint64_t loid;            // file to prefetch from
+  time_t mtime;             // mtime at open, for the block cache
+  off_t size;               // size at open, nothing is fetched beyond
+  off_t next;               // offset following the previous read
+  unsigned int streak;      // number of sequential reads in a row
+  size_t window;            // size of the next prefetch
+  tfs_ra_slot_t slot[2];    // prefetched data, the next window is filled
+                            // while the current one is consumed
+  int pending;              // a prefetch is in flight
+  off_t pending_off;
+  size_t pending_len;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;      // signalled when a prefetch completes
+} tfs_ra_state_t;
+
+/** Set the maximum prefetch window, 0 disables readahead */
+extern void TFS_RA_configure(unsigned int max_kb);
+
+extern void TFS_RA_init(tfs_ra_state_t * ra, uint64_t loid, time_t mtime,
+    off_t size);
+
+/**
+ * Copy the prefetched part of [offset, offset+size) into buf.
+ *
+ * Waits for an in-flight prefetch covering offset. Returns the number of
+ * bytes served, the rest has to be read by the caller.
+ */
+extern size_t TFS_RA_read(tfs_ra_state_t * ra, char * buf, size_t size,
+    off_t offset);
+
+/** Account a completed read of len bytes and schedule the next prefetch */
+extern void TFS_RA_update(tfs_ra_state_t * ra, off_t offset, size_t len);
+
+/** Wait for in-flight prefetches and free the buffers */
+extern void TFS_RA_destroy(tfs_ra_state_t * ra);
+
+#endif /* tableaufs_readahead_h */
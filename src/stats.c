@@ -0,0 +1,203 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "stats.h"
+#include "log.h"
+
+typedef struct {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t buckets[TFS_STATS_BUCKETS];
+} tfs_stats_entry_t;
+
+static const char * metric_names[TFS_STATS_METRICS] = {
+  "getattr", "readdir", "open", "read", "write", "truncate", "flush",
+  "release", "lookup", "xattr",
+  "sql_list_sites", "sql_list_projects", "sql_list_files", "sql_stat_site",
+  "sql_stat_project", "sql_stat_file", "sql_read_pages", "sql_lo_io",
+  "sql_lo_read", "sql_lo_get", "sql_commit", "sql_namespace",
+  "sql_watch", "sql_digest", "sql_copy", "pool_wait",
+};
+
+static const char * counter_names[TFS_STATS_COUNTERS] = {
+  "bytes_read", "bytes_written", "bytes_fetched", "cache_hits",
+  "cache_misses", "coalesced",
+};
+
+// updated with relaxed atomics: the numbers only have to add up
+// eventually, readers never need a consistent cut
+static tfs_stats_entry_t metrics[TFS_STATS_METRICS];
+static uint64_t counters[TFS_STATS_COUNTERS];
+static uint64_t started;
+
+#define TFS_STATS_INC(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define TFS_STATS_GET(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+uint64_t TFS_STATS_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void TFS_STATS_init()
+{
+  started = TFS_STATS_now();
+}
+
+void TFS_STATS_record(tfs_stats_metric_t metric, uint64_t start, int ret)
+{
+  tfs_stats_entry_t * e = &metrics[metric];
+  uint64_t end = TFS_STATS_now(), us = (end - start) / 1000, max;
+  unsigned int bucket = 0;
+
+  while (bucket < TFS_STATS_BUCKETS - 1 && us >= (1ull << bucket))
+    bucket++;
+
+  TFS_STATS_INC(&e->count, 1);
+  TFS_STATS_INC(&e->total_us, us);
+  TFS_STATS_INC(&e->buckets[bucket], 1);
+  if (ret < 0)
+    TFS_STATS_INC(&e->errors, 1);
+
+  max = TFS_STATS_GET(&e->max_us);
+  while (us > max && !__atomic_compare_exchange_n(&e->max_us, &max, us, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  if (TFS_LOG_tracing())
+    TFS_LOG_span(metric_names[metric], metric < TFS_STATS_SQL_LIST_SITES ?
+        "fs" : metric < TFS_STATS_POOL_WAIT ? "sql" : "pool", start, end);
+}
+
+void TFS_STATS_add(tfs_stats_counter_t counter, uint64_t n)
+{
+  TFS_STATS_INC(&counters[counter], n);
+}
+
+/** Upper bound in microseconds of the q-th quantile of a histogram */
+static uint64_t quantile(const uint64_t * buckets, uint64_t count, double q)
+{
+  uint64_t seen = 0;
+  unsigned int i;
+
+  for (i = 0; i < TFS_STATS_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen > 0 && (double)seen >= q * (double)count)
+      return 1ull << i;
+  }
+
+  return 0;
+}
+
+/** snprintf that keeps counting past the end of buf */
+static void append(char * buf, size_t len, size_t * pos, const char * fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(*pos < len ? buf + *pos : NULL, *pos < len ? len - *pos : 0,
+      fmt, ap);
+  va_end(ap);
+
+  if (n > 0)
+    *pos += (size_t)n;
+}
+
+size_t TFS_STATS_format(char * buf, size_t len, int json)
+{
+  tfs_stats_entry_t e;
+  size_t pos = 0;
+  unsigned int i, j;
+  int first;
+
+  if (json)
+    append(buf, len, &pos, "{\"uptime_s\":%llu,\"counters\":{",
+        (unsigned long long)((TFS_STATS_now() - started) / 1000000000u));
+
+  for (i = 0; i < TFS_STATS_COUNTERS; i++) {
+    if (json)
+      append(buf, len, &pos, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+          (unsigned long long)TFS_STATS_GET(&counters[i]));
+    else
+      append(buf, len, &pos, "%-20s %llu\n", counter_names[i],
+          (unsigned long long)TFS_STATS_GET(&counters[i]));
+  }
+
+  if (json)
+    append(buf, len, &pos, "},\"metrics\":{");
+  else
+    append(buf, len, &pos, "\n%-20s %10s %8s %12s %10s %10s %10s %10s\n",
+        "metric", "count", "errors", "total_us", "avg_us", "p50_us", "p99_us",
+        "max_us");
+
+  for (i = 0; i < TFS_STATS_METRICS; i++) {
+    e.count = TFS_STATS_GET(&metrics[i].count);
+    e.errors = TFS_STATS_GET(&metrics[i].errors);
+    e.total_us = TFS_STATS_GET(&metrics[i].total_us);
+    e.max_us = TFS_STATS_GET(&metrics[i].max_us);
+    for (j = 0; j < TFS_STATS_BUCKETS; j++)
+      e.buckets[j] = TFS_STATS_GET(&metrics[i].buckets[j]);
+
+    if (!json) {
+      append(buf, len, &pos, "%-20s %10llu %8llu %12llu %10llu %10llu %10llu "
+          "%10llu\n", metric_names[i], (unsigned long long)e.count,
+          (unsigned long long)e.errors, (unsigned long long)e.total_us,
+          (unsigned long long)(e.count ? e.total_us / e.count : 0),
+          (unsigned long long)quantile(e.buckets, e.count, 0.5),
+          (unsigned long long)quantile(e.buckets, e.count, 0.99),
+          (unsigned long long)e.max_us);
+      continue;
+    }
+
+    append(buf, len, &pos, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,"
+        "\"total_us\":%llu,\"max_us\":%llu,\"histogram_us\":{", i ? "," : "",
+        metric_names[i], (unsigned long long)e.count,
+        (unsigned long long)e.errors, (unsigned long long)e.total_us,
+        (unsigned long long)e.max_us);
+
+    // only the buckets in use, keyed by their upper bound
+    for (j = 0, first = 1; j < TFS_STATS_BUCKETS; j++) {
+      if (e.buckets[j] == 0)
+        continue;
+      append(buf, len, &pos, "%s\"%llu\":%llu", first ? "" : ",", 1ull << j,
+          (unsigned long long)e.buckets[j]);
+      first = 0;
+    }
+
+    append(buf, len, &pos, "}}");
+  }
+
+  if (json)
+    append(buf, len, &pos, "}}\n");
+
+  return pos;
+}
@@ -0,0 +1,98 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_stats_h
+#define tableaufs_stats_h
+#include <stdint.h>
+#include <stddef.h>
+
+/** Latency histogram buckets: bucket i counts calls below 2^i microseconds */
+#define TFS_STATS_BUCKETS 32
+
+/** Timed operations */
+typedef enum {
+  // file system operations
+  TFS_STATS_GETATTR = 0,
+  TFS_STATS_READDIR,
+  TFS_STATS_OPEN,
+  TFS_STATS_READ,
+  TFS_STATS_WRITE,
+  TFS_STATS_TRUNCATE,
+  TFS_STATS_FLUSH,
+  TFS_STATS_RELEASE,
+  TFS_STATS_LOOKUP,            // low-level frontend only
+  TFS_STATS_XATTR,             // getxattr and listxattr
+  // repository requests
+  TFS_STATS_SQL_LIST_SITES,
+  TFS_STATS_SQL_LIST_PROJECTS,
+  TFS_STATS_SQL_LIST_FILES,
+  TFS_STATS_SQL_STAT_SITE,
+  TFS_STATS_SQL_STAT_PROJECT,
+  TFS_STATS_SQL_STAT_FILE,
+  TFS_STATS_SQL_READ_PAGES,
+  TFS_STATS_SQL_LO_IO,         // one-shot BEGIN/lo_open/lo_read/END
+  TFS_STATS_SQL_LO_READ,       // lo_read on a bound descriptor
+  TFS_STATS_SQL_LO_GET,        // pipelined lo_get batch
+  TFS_STATS_SQL_COMMIT,        // write-back commit
+  TFS_STATS_SQL_NAMESPACE,     // namespace snapshot queries
+  TFS_STATS_SQL_WATCH,         // change detection
+  TFS_STATS_SQL_DIGEST,        // content digests
+  TFS_STATS_SQL_COPY,          // server-side copies
+  // waiting for a pooled connection
+  TFS_STATS_POOL_WAIT,
+  TFS_STATS_METRICS
+} tfs_stats_metric_t;
+
+/** Plain counters */
+typedef enum {
+  TFS_STATS_BYTES_READ = 0,    // returned to readers
+  TFS_STATS_BYTES_WRITTEN,     // accepted from writers
+  TFS_STATS_BYTES_FETCHED,     // received from the repository
+  TFS_STATS_CACHE_HITS,        // block cache
+  TFS_STATS_CACHE_MISSES,
+  TFS_STATS_COALESCED,         // requests served by an identical one in flight
+  TFS_STATS_COUNTERS
+} tfs_stats_counter_t;
+
+/** Start the uptime clock */
+extern void TFS_STATS_init();
+
+/** Monotonic clock in nanoseconds, the start argument of TFS_STATS_record */
+extern uint64_t TFS_STATS_now();
+
+/**
+ * Account one call of metric started at start. ret < 0 counts as error.
+ * The call also goes to the trace when one is written.
+ */
+extern void TFS_STATS_record(tfs_stats_metric_t metric, uint64_t start,
+    int ret);
+
+extern void TFS_STATS_add(tfs_stats_counter_t counter, uint64_t n);
+
+/**
+ * Render all metrics and counters into buf, as text or as JSON.
+ * Returns the length of the output, which may exceed len like snprintf.
+ */
+extern size_t TFS_STATS_format(char * buf, size_t len, int json);
+
+#endif /* tableaufs_stats_h */
@@ -0,0 +1,227 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "stripe.h"
+#include "workgroup.h"
+#include "worker.h"
+
+static size_t stripe_size = (size_t)TFS_STRIPE_DEFAULT_SIZE_KB * 1024;
+static unsigned int stripe_width = TFS_STRIPE_DEFAULT_WIDTH;
+
+/**
+ * A striped read, shared by the caller and its helpers. Whoever comes
+ * first takes the next stripe, so the read completes even if no helper
+ * gets a worker in time.
+ */
+typedef struct tfs_stripe_read_t {
+  uint64_t loid;
+  char * dst;
+  off_t offset;          // of dst[0]
+  size_t size;
+  off_t base;            // offset rounded down to a stripe boundary
+  unsigned int count;    // number of stripes
+  unsigned int next;     // first stripe nobody took yet
+  unsigned int done;     // finished stripes
+  unsigned int refs;     // the caller and its queued helpers
+  int * results;         // bytes read or error, by stripe
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;   // signalled when the last stripe is done
+} tfs_stripe_read_t;
+
+void TFS_STRIPE_configure(unsigned int size_kb, unsigned int width)
+{
+  if (size_kb > 0)
+    stripe_size = (size_t)size_kb * 1024;
+
+  if (width > TFS_STRIPE_MAX_WIDTH)
+    width = TFS_STRIPE_MAX_WIDTH;
+  stripe_width = width > 1 ? width : 1;
+}
+
+unsigned int TFS_STRIPE_width()
+{
+  return stripe_width;
+}
+
+int TFS_STRIPE_worth(size_t size)
+{
+  return stripe_width > 1 && size > stripe_size;
+}
+
+/** Range of stripe i, clipped to the read */
+static void stripe_range(const tfs_stripe_read_t * r, unsigned int i,
+    off_t * off, size_t * len)
+{
+  off_t start = r->base + (off_t)i * (off_t)stripe_size;
+  off_t end = start + (off_t)stripe_size;
+
+  if (start < r->offset)
+    start = r->offset;
+  if (end > r->offset + (off_t)r->size)
+    end = r->offset + (off_t)r->size;
+
+  *off = start;
+  *len = (size_t)(end - start);
+}
+
+/** Fill a stripe, one connection for the whole stripe */
+static int fetch_stripe(const tfs_stripe_read_t * r, unsigned int i)
+{
+  off_t off;
+  size_t len, done = 0;
+  char * dst;
+  int ret;
+
+  stripe_range(r, i, &off, &len);
+  dst = r->dst + (off - r->offset);
+
+  while (done < len) {
+    ret = TFS_WG_IO_operation(TFS_WG_READ, r->loid, NULL, dst + done,
+        len - done, off + (off_t)done);
+    if (ret < 0)
+      return ret;
+    else if (ret == 0)
+      break;
+    done += (size_t)ret;
+  }
+
+  return (int)done;
+}
+
+/** Take and fetch stripes until none are left */
+static void run(tfs_stripe_read_t * r)
+{
+  unsigned int i;
+  int ret;
+
+  pthread_mutex_lock(&r->mutex);
+  while (r->next < r->count) {
+    i = r->next++;
+    pthread_mutex_unlock(&r->mutex);
+
+    ret = fetch_stripe(r, i);
+
+    pthread_mutex_lock(&r->mutex);
+    r->results[i] = ret;
+    if (++r->done == r->count)
+      pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->mutex);
+}
+
+/** Drop a reference, the last one frees the read */
+static void release(tfs_stripe_read_t * r)
+{
+  unsigned int refs;
+
+  pthread_mutex_lock(&r->mutex);
+  refs = --r->refs;
+  pthread_mutex_unlock(&r->mutex);
+
+  if (refs > 0)
+    return;
+
+  pthread_mutex_destroy(&r->mutex);
+  pthread_cond_destroy(&r->cond);
+  free(r->results);
+  free(r);
+}
+
+/** Worker job of a helper */
+static void helper_job(void * arg)
+{
+  run(arg);
+  release(arg);
+}
+
+/** Bytes read in stripe order, up to the first short stripe */
+static int collect(const tfs_stripe_read_t * r)
+{
+  off_t off;
+  size_t len, total = 0;
+  unsigned int i;
+
+  for (i = 0; i < r->count; i++) {
+    if (r->results[i] < 0)
+      return r->results[i];
+
+    total += (size_t)r->results[i];
+    stripe_range(r, i, &off, &len);
+    if ((size_t)r->results[i] < len)
+      break;
+  }
+
+  return (int)total;
+}
+
+int TFS_STRIPE_read(uint64_t loid, char * dst, size_t size, off_t offset)
+{
+  tfs_stripe_read_t * r;
+  unsigned int i;
+  int ret;
+
+  if (!TFS_STRIPE_worth(size) ||
+      (r = calloc(1, sizeof(tfs_stripe_read_t))) == NULL)
+    return TFS_WG_IO_operation(TFS_WG_READ, loid, NULL, dst, size, offset);
+
+  r->loid = loid;
+  r->dst = dst;
+  r->offset = offset;
+  r->size = size;
+  r->base = offset - offset % (off_t)stripe_size;
+  r->count = (unsigned int)((offset + (off_t)size - 1 - r->base) /
+      (off_t)stripe_size) + 1;
+  r->refs = 1;
+  pthread_mutex_init(&r->mutex, NULL);
+  pthread_cond_init(&r->cond, NULL);
+
+  if ((r->results = calloc(r->count, sizeof(int))) == NULL) {
+    release(r);
+    return TFS_WG_IO_operation(TFS_WG_READ, loid, NULL, dst, size, offset);
+  }
+
+  // the caller is one of the width readers
+  for (i = 1; i < stripe_width && i < r->count; i++) {
+    pthread_mutex_lock(&r->mutex);
+    r->refs++;
+    pthread_mutex_unlock(&r->mutex);
+
+    if (TFS_WORKER_submit(helper_job, r) != 0) {
+      release(r);
+      break;
+    }
+  }
+
+  run(r);
+
+  pthread_mutex_lock(&r->mutex);
+  while (r->done < r->count)
+    pthread_cond_wait(&r->cond, &r->mutex);
+  pthread_mutex_unlock(&r->mutex);
+
+  ret = collect(r);
+  release(r);
+  return ret;
+}
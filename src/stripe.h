@@ -0,0 +1,57 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_stripe_h
+#define tableaufs_stripe_h
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Default stripe size in kilobytes */
+#define TFS_STRIPE_DEFAULT_SIZE_KB 1024
+
+/** Default number of stripes fetched at once */
+#define TFS_STRIPE_DEFAULT_WIDTH 4
+
+/** Hard upper limit of the stripe_width= mount option */
+#define TFS_STRIPE_MAX_WIDTH 16
+
+/** Set the stripe size and width. A width of 0 or 1 disables striping */
+extern void TFS_STRIPE_configure(unsigned int size_kb, unsigned int width);
+
+/** Number of stripes fetched at once, 1 if striping is disabled */
+extern unsigned int TFS_STRIPE_width();
+
+/** Returns non-zero if a read of size bytes spans several stripes */
+extern int TFS_STRIPE_worth(size_t size);
+
+/**
+ * Read size bytes at offset of loid. Reads spanning several stripes
+ * are split at the stripe boundaries, and the stripes are fetched over
+ * up to width connections at once: by the caller and by the background
+ * workers. Returns the bytes read up to the end of the file or the
+ * first error.
+ */
+extern int TFS_STRIPE_read(uint64_t loid, char * dst, size_t size,
+    off_t offset);
+
+#endif /* tableaufs_stripe_h */
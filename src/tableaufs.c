@@ -29,11 +29,25 @@
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "workgroup.h"
+#include "cache.h"
+#include "blockcache.h"
+#include "namespace.h"
+#include "stats.h"
+#include "control.h"
+#include "log.h"
+#include "tableaufs_ll.h"
+#include "watch.h"
+#include "package.h"
+#include "xattr.h"
+#include "stripe.h"
 
 
 #define TFS_WG_PARSE_PATH( path, node ) \
@@ -44,11 +58,18 @@
   }; \
 } while (0)
 
+static struct tableau_cmdargs tableau_cmdargs;
+
 static int tableau_getattr(const char *path, struct stat *stbuf)
 {
   int res = 0;
   tfs_wg_node_t node;
 
+  if ( TFS_CTL_is_control(path) )
+    return TFS_CTL_getattr(path, stbuf);
+  else if ( TFS_PKG_is_package(path) )
+    return TFS_PKG_getattr(path, stbuf);
+
   TFS_WG_PARSE_PATH(path, &node);
 
   memcpy(stbuf, &(node.st), sizeof(struct stat));
@@ -56,11 +77,48 @@ static int tableau_getattr(const char *path, struct stat *stbuf)
   return res;
 }
 
+// repository directories are streamed from a cursor with real offsets,
+// the others are listed in a single pass
+static int tableau_opendir(const char *path, struct fuse_file_info *fi)
+{
+  tfs_wg_node_t node;
+
+  fi->fh = 0;
+  if ( TFS_CTL_is_control(path) || TFS_PKG_is_package(path) )
+    return 0;
+
+  TFS_WG_PARSE_PATH(path, &node);
+
+  // the member directories of the packages are mixed into the rows
+  if ( node.level == TFS_WG_PROJECT && TFS_PKG_enabled() )
+    return 0;
+
+  return TFS_WG_opendir(&node, &(fi->fh));
+}
+
+static int tableau_releasedir(const char *path, struct fuse_file_info *fi)
+{
+  return fi->fh != 0 ? TFS_WG_releasedir(fi->fh) : 0;
+}
+
 static int tableau_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     off_t offset, struct fuse_file_info *fi)
 {
   tfs_wg_node_t node;
 
+  if ( fi->fh != 0 )
+    return TFS_WG_readdir_at(fi->fh, offset, buf, filler);
+
+  if ( TFS_CTL_is_control(path) ) {
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    return TFS_CTL_readdir(path, buf, filler);
+  } else if ( TFS_PKG_is_package(path) ) {
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    return TFS_PKG_readdir(path, buf, filler);
+  }
+
   TFS_WG_PARSE_PATH(path, &node);
 
   if ( node.level == TFS_WG_FILE )
@@ -69,7 +127,10 @@ static int tableau_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   filler(buf, ".", NULL, 0);
   filler(buf, "..", NULL, 0);
 
-  TFS_WG_readdir(&node, buf, filler);
+  if ( node.level == TFS_WG_PROJECT )
+    TFS_PKG_readdir_project(&node, buf, filler);
+  else
+    TFS_WG_readdir(&node, buf, filler);
 
   return 0;
 }
@@ -79,11 +140,26 @@ static int tableau_open(const char *path, struct fuse_file_info *fi)
   tfs_wg_node_t node;
   int ret;
 
+  // rendered at open, so never cached by the kernel
+  if ( TFS_CTL_is_control(path) ) {
+    fi->direct_io = 1;
+    return TFS_CTL_open(path, fi->flags, &(fi->fh));
+  } else if ( TFS_PKG_is_package(path) ) {
+    return TFS_PKG_open(path, fi->flags, &(fi->fh));
+  }
+
   TFS_WG_PARSE_PATH(path, &node);
 
   ret = TFS_WG_open(&node, fi->flags, &(fi->fh) );
-  fi->direct_io = 1; // during read we can return smaller buffer than
-                     // requested
+
+  if ( !tableau_cmdargs.cached ) {
+    fi->direct_io = 1; // during read we can return smaller buffer than
+                       // requested
+  } else if ( ret == 0 && (fi->flags & O_ACCMODE) == O_RDONLY ) {
+    // pages of an unchanged file are still good
+    if ( TFS_WG_keep_cache(&node) )
+      fi->keep_cache = 1;
+  }
 
   return ret;
 }
@@ -91,13 +167,246 @@ static int tableau_open(const char *path, struct fuse_file_info *fi)
 static int tableau_read(const char *path, char *buf, size_t size, off_t offset,
     struct fuse_file_info *fi)
 {
-  return TFS_WG_IO_operation(TFS_WG_READ, fi->fh, NULL, buf, size, offset);
+  size_t done = 0;
+  int ret;
+
+  if ( TFS_CTL_is_control(path) )
+    return TFS_CTL_read(fi->fh, buf, size, offset);
+  else if ( TFS_PKG_is_package(path) )
+    return TFS_PKG_read(fi->fh, buf, size, offset);
+
+  // without direct_io the kernel takes a short read for the end of file
+  do {
+    ret = TFS_WG_read(fi->fh, buf + done, size - done, offset + (off_t)done);
+    if (ret <= 0)
+      break;
+    done += (size_t)ret;
+  } while ( tableau_cmdargs.cached && done < size );
+
+  if ( done == 0 )
+    return ret;
+
+  TFS_STATS_add(TFS_STATS_BYTES_READ, done);
+  return (int)done;
+}
+
+struct fuse_bufvec * tableaufs_extents_bufvec(const tfs_wg_extent_t * ext,
+    int n)
+{
+  struct fuse_bufvec * bv;
+  int i;
+
+  bv = calloc(1, sizeof(struct fuse_bufvec) +
+      (size_t)(n > 1 ? n - 1 : 0) * sizeof(struct fuse_buf));
+  if (bv == NULL)
+    return NULL;
+
+  *bv = FUSE_BUFVEC_INIT(0);
+  bv->count = n > 0 ? (size_t)n : 1;
+  for (i = 0; i < n; i++) {
+    bv->buf[i].size = ext[i].len;
+    bv->buf[i].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    bv->buf[i].mem = NULL;
+    bv->buf[i].fd = ext[i].fd;
+    bv->buf[i].pos = ext[i].pos;
+  }
+
+  return bv;
+}
+
+/**
+ * Block cache files the last read_buf of a thread replied with. libfuse
+ * splices a reply before its thread takes the next request, so they are
+ * closed by the next read_buf of the thread, or when the thread exits.
+ */
+typedef struct {
+  int count;
+  int fds[];
+} tfs_spliced_t;
+
+static __thread tfs_spliced_t * spliced;
+static pthread_key_t spliced_key;
+static pthread_once_t spliced_once = PTHREAD_ONCE_INIT;
+
+static void close_spliced(void * arg)
+{
+  tfs_spliced_t * s = arg;
+  int i;
+
+  for (i = 0; i < s->count; i++)
+    close(s->fds[i]);
+  free(s);
+}
+
+static void create_spliced_key()
+{
+  pthread_key_create(&spliced_key, close_spliced);
+}
+
+/** Remember the descriptors of a reply, closing those of the previous one */
+static void keep_spliced(tfs_spliced_t * s)
+{
+  pthread_once(&spliced_once, create_spliced_key);
+
+  if (spliced != NULL)
+    close_spliced(spliced);
+
+  spliced = s;
+  pthread_setspecific(spliced_key, s);
+}
+
+/**
+ * Reply with pieces of the block cache files, so cached content goes to
+ * the reader without being copied through the file system. Everything
+ * else goes through tableau_read.
+ */
+static int tableau_read_buf(const char *path, struct fuse_bufvec **bufp,
+    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  struct fuse_bufvec * bv;
+  tfs_wg_extent_t * ext = NULL;
+  tfs_spliced_t * s;
+  int i, n = -ENOTSUP, max = (int)(size / TFS_BC_BLOCKSIZE) + 2;
+  size_t done = 0;
+
+  if ( TFS_BC_enabled() && !TFS_CTL_is_control(path) &&
+      !TFS_PKG_is_package(path) ) {
+    if ( (ext = malloc((size_t)max * sizeof(tfs_wg_extent_t))) == NULL )
+      return -ENOMEM;
+    n = TFS_WG_read_extents(fi->fh, size, offset, ext, max);
+  }
+
+  if ( n == -ENOTSUP ) {
+    free(ext);
+    if ( (bv = malloc(sizeof(struct fuse_bufvec))) == NULL )
+      return -ENOMEM;
+    *bv = FUSE_BUFVEC_INIT(size);
+    if ( (bv->buf[0].mem = malloc(size)) == NULL ) {
+      free(bv);
+      return -ENOMEM;
+    }
+
+    n = tableau_read(path, bv->buf[0].mem, size, offset, fi);
+    if ( n < 0 ) {
+      free(bv->buf[0].mem);
+      free(bv);
+      return n;
+    }
+
+    bv->buf[0].size = (size_t)n;
+    *bufp = bv;
+    return 0;
+  } else if ( n < 0 ) {
+    free(ext);
+    return n;
+  }
+
+  bv = tableaufs_extents_bufvec(ext, n);
+  s = malloc(sizeof(tfs_spliced_t) + (size_t)n * sizeof(int));
+  if ( bv == NULL || s == NULL ) {
+    for (i = 0; i < n; i++)
+      close(ext[i].fd);
+    free(bv);
+    free(s);
+    free(ext);
+    return -ENOMEM;
+  }
+
+  s->count = n;
+  for (i = 0; i < n; i++) {
+    s->fds[i] = ext[i].fd;
+    done += ext[i].len;
+  }
+  keep_spliced(s);
+  free(ext);
+
+  TFS_STATS_add(TFS_STATS_BYTES_READ, done);
+  *bufp = bv;
+  return 0;
 }
 
 static int tableau_write(const char *path, const char *buf, size_t size, off_t offset,
     struct fuse_file_info *fi)
 {
-  return TFS_WG_IO_operation(TFS_WG_WRITE, fi->fh, buf, NULL, size, offset);
+  int ret;
+
+  if ( TFS_CTL_is_control(path) )
+    return TFS_CTL_write(fi->fh, buf, size, offset);
+
+  TFS_CACHE_invalidate(path);
+  ret = TFS_WG_write(fi->fh, buf, size, offset);
+  if ( ret > 0 )
+    TFS_STATS_add(TFS_STATS_BYTES_WRITTEN, (uint64_t)ret);
+
+  return ret;
+}
+
+static int tableau_ftruncate(const char *path, off_t offset,
+    struct fuse_file_info *fi)
+{
+  if ( TFS_CTL_is_control(path) )
+    return TFS_CTL_truncate(path);
+  else if ( TFS_PKG_is_package(path) )
+    return -EACCES;
+
+  TFS_CACHE_invalidate(path);
+  return TFS_WG_ftruncate(fi->fh, offset);
+}
+
+// writes are buffered until the next flush: report the size they make
+static int tableau_fgetattr(const char *path, struct stat *stbuf,
+    struct fuse_file_info *fi)
+{
+  int ret = tableau_getattr(path, stbuf);
+
+  if (ret == 0 && !TFS_CTL_is_control(path) && !TFS_PKG_is_package(path))
+    stbuf->st_size = TFS_WG_size(fi->fh, stbuf->st_size);
+
+  return ret;
+}
+
+// committed writes change the size and the mtime of the file
+static void invalidate_written(const char *path, struct fuse_file_info *fi)
+{
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    TFS_CACHE_invalidate(path);
+}
+
+static int tableau_flush(const char *path, struct fuse_file_info *fi)
+{
+  int ret;
+
+  // the commands written to a control file run when it is closed
+  if ( TFS_CTL_is_control(path) )
+    return TFS_CTL_flush(fi->fh);
+  else if ( TFS_PKG_is_package(path) )
+    return 0;
+
+  ret = TFS_WG_flush(fi->fh);
+
+  invalidate_written(path, fi);
+  return ret;
+}
+
+static int tableau_fsync(const char *path, int datasync,
+    struct fuse_file_info *fi)
+{
+  return tableau_flush(path, fi);
+}
+
+static int tableau_release(const char *path, struct fuse_file_info *fi)
+{
+  int ret;
+
+  if ( TFS_CTL_is_control(path) )
+    return TFS_CTL_release(fi->fh);
+  else if ( TFS_PKG_is_package(path) )
+    return TFS_PKG_release(fi->fh);
+
+  ret = TFS_WG_release(fi->fh);
+
+  invalidate_written(path, fi);
+  return ret;
 }
 
 static int tableau_truncate(const char *path, off_t offset)
@@ -105,23 +414,218 @@ static int tableau_truncate(const char *path, off_t offset)
   tfs_wg_node_t node;
   int ret;
 
+  if ( TFS_CTL_is_control(path) )
+    return TFS_CTL_truncate(path);
+  else if ( TFS_PKG_is_package(path) )
+    return -EACCES;
+
   TFS_WG_PARSE_PATH(path, &node);
   if (node.level != TFS_WG_FILE )
     ret = -EISDIR;
   else
     ret = TFS_WG_IO_operation(TFS_WG_TRUNCATE, node.loid, NULL, NULL, 0, offset);
 
+  TFS_CACHE_invalidate(path);
+  TFS_BC_invalidate(node.loid);
+  TFS_XATTR_invalidate(node.loid);
+  TFS_PKG_invalidate(node.loid);
+
   return ret;
 }
 
+#ifdef __APPLE__
+static int tableau_getxattr(const char *path, const char *name, char *value,
+    size_t size, uint32_t position)
+#else
+static int tableau_getxattr(const char *path, const char *name, char *value,
+    size_t size)
+#endif
+{
+  tfs_wg_node_t node;
+
+  if ( TFS_CTL_is_control(path) || TFS_PKG_is_package(path) )
+    return -ENOATTR;
+
+  TFS_WG_PARSE_PATH(path, &node);
+
+  return TFS_XATTR_get(&node, name, value, size);
+}
+
+static int tableau_listxattr(const char *path, char *list, size_t size)
+{
+  tfs_wg_node_t node;
+
+  if ( TFS_CTL_is_control(path) || TFS_PKG_is_package(path) )
+    return 0;
+
+  TFS_WG_PARSE_PATH(path, &node);
+
+  return TFS_XATTR_list(&node, list, size);
+}
+
+// Run an operation and account its latency under metric
+#define TFS_TIMED( metric, call ) \
+  uint64_t __start = TFS_STATS_now(); \
+  TFS_LOG_begin_request(); \
+  int __ret = call; \
+  TFS_STATS_record(metric, __start, __ret); \
+  return __ret
+
+static int timed_getattr(const char *path, struct stat *stbuf)
+{
+  TFS_TIMED(TFS_STATS_GETATTR, tableau_getattr(path, stbuf));
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_READDIR,
+      tableau_readdir(path, buf, filler, offset, fi));
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_OPEN, tableau_open(path, fi));
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_READ, tableau_read(path, buf, size, offset, fi));
+}
+
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp,
+    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_READ, tableau_read_buf(path, bufp, size, offset, fi));
+}
+
+static int timed_write(const char *path, const char *buf, size_t size,
+    off_t offset, struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_WRITE, tableau_write(path, buf, size, offset, fi));
+}
+
+static int timed_truncate(const char *path, off_t offset)
+{
+  TFS_TIMED(TFS_STATS_TRUNCATE, tableau_truncate(path, offset));
+}
+
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_FLUSH, tableau_flush(path, fi));
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_RELEASE, tableau_release(path, fi));
+}
+
+// the operations below are timed for their request ID in the log, the
+// trace and application_name; most share the metric of a close relative
+
+static int timed_opendir(const char *path, struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_READDIR, tableau_opendir(path, fi));
+}
+
+static int timed_releasedir(const char *path, struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_RELEASE, tableau_releasedir(path, fi));
+}
+
+static int timed_ftruncate(const char *path, off_t offset,
+    struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_TRUNCATE, tableau_ftruncate(path, offset, fi));
+}
+
+static int timed_fgetattr(const char *path, struct stat *stbuf,
+    struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_GETATTR, tableau_fgetattr(path, stbuf, fi));
+}
+
+static int timed_fsync(const char *path, int datasync,
+    struct fuse_file_info *fi)
+{
+  TFS_TIMED(TFS_STATS_FLUSH, tableau_fsync(path, datasync, fi));
+}
+
+#ifdef __APPLE__
+static int timed_getxattr(const char *path, const char *name, char *value,
+    size_t size, uint32_t position)
+{
+  TFS_TIMED(TFS_STATS_XATTR,
+      tableau_getxattr(path, name, value, size, position));
+}
+#else
+static int timed_getxattr(const char *path, const char *name, char *value,
+    size_t size)
+{
+  TFS_TIMED(TFS_STATS_XATTR, tableau_getxattr(path, name, value, size));
+}
+#endif
+
+static int timed_listxattr(const char *path, char *list, size_t size)
+{
+  TFS_TIMED(TFS_STATS_XATTR, tableau_listxattr(path, list, size));
+}
+
+// Background threads have to be started here: fuse_main forks into the
+// background after main() is done with the setup
+void * tableaufs_init(struct fuse_conn_info *conn)
+{
+  TFS_LOG_start();
+
+  // O_TRUNC becomes part of the buffered changes instead of a separate
+  // truncate committed before the writes
+  if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC)
+    conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+
+  if ( tableau_cmdargs.read_size > 0 )
+    conn->max_readahead = tableau_cmdargs.read_size * 1024;
+
+#ifdef FUSE_CAP_SPLICE_WRITE
+  // cached blocks are spliced from their files into the replies
+  if (TFS_BC_enabled() && (conn->capable & FUSE_CAP_SPLICE_WRITE))
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+#endif
+
+  TFS_WG_start_handles( tableau_cmdargs.idle_timeout );
+  TFS_WG_start_workers();
+  TFS_NS_start( tableau_cmdargs.snapshot_refresh );
+  TFS_WATCH_start( tableau_cmdargs.watch );
+  return NULL;
+}
+
+void tableaufs_destroy(void *private_data)
+{
+  (void)private_data;
+
+  TFS_LOG_stop();
+}
+
 // A descriptor for all the possible FUSE operations on a tableau endpoint
 static struct fuse_operations tableau_oper = {
-  .getattr        = tableau_getattr,
-  .readdir        = tableau_readdir,
-  .open           = tableau_open,
-  .read           = tableau_read,
-  .write          = tableau_write,
-  .truncate       = tableau_truncate,
+  .init           = tableaufs_init,
+  .destroy        = tableaufs_destroy,
+  .getattr        = timed_getattr,
+  .opendir        = timed_opendir,
+  .readdir        = timed_readdir,
+  .releasedir     = timed_releasedir,
+  .open           = timed_open,
+  .read           = timed_read,
+  .read_buf       = timed_read_buf,
+  .write          = timed_write,
+  .flush          = timed_flush,
+  .release        = timed_release,
+  .truncate       = timed_truncate,
+  .ftruncate      = timed_ftruncate,
+  .fgetattr       = timed_fgetattr,
+  .fsync          = timed_fsync,
+  .getxattr       = timed_getxattr,
+  .listxattr      = timed_listxattr,
 };
 
 
@@ -129,13 +633,33 @@ static struct fuse_operations tableau_oper = {
 #define TABLEAUFS_OPT(t, p) { t, offsetof(struct tableau_cmdargs, p), 1 }
 
 
-static struct tableau_cmdargs tableau_cmdargs;
 static struct fuse_opt tableaufs_opts[] =
 {
   TABLEAUFS_OPT("pghost=%s", pghost),
   TABLEAUFS_OPT("pgport=%s", pgport),
+  TABLEAUFS_OPT("pgstandby=%s", pgstandby),
   TABLEAUFS_OPT("pguser=%s", pguser),
   TABLEAUFS_OPT("pgpass=%s", pgpass),
+  TABLEAUFS_OPT("poolsize=%u", poolsize),
+  TABLEAUFS_OPT("attr_ttl=%u", attr_ttl),
+  TABLEAUFS_OPT("negative_ttl=%u", negative_ttl),
+  TABLEAUFS_OPT("idle_timeout=%u", idle_timeout),
+  TABLEAUFS_OPT("cache_dir=%s", cache_dir),
+  TABLEAUFS_OPT("cache_size=%u", cache_size),
+  TABLEAUFS_OPT("readahead=%u", readahead),
+  TABLEAUFS_OPT("stripe_size=%u", stripe_size),
+  TABLEAUFS_OPT("stripe_width=%u", stripe_width),
+  TABLEAUFS_OPT("readmode=%s", readmode),
+  TABLEAUFS_OPT("snapshot", snapshot),
+  TABLEAUFS_OPT("snapshot_refresh=%u", snapshot_refresh),
+  TABLEAUFS_OPT("cached", cached),
+  TABLEAUFS_OPT("cache_timeout=%u", cache_timeout),
+  TABLEAUFS_OPT("read_size=%u", read_size),
+  TABLEAUFS_OPT("loglevel=%s", loglevel),
+  TABLEAUFS_OPT("trace=%s", trace),
+  TABLEAUFS_OPT("lowlevel", lowlevel),
+  TABLEAUFS_OPT("watch=%u", watch),
+  TABLEAUFS_OPT("packages", packages),
 
   // No more options for you Sir
   FUSE_OPT_END
@@ -154,8 +678,16 @@ int main(int argc, char *argv[])
   // print some information
   print_verbose_information(argc, argv);
 
+  TFS_STATS_init();
+
   // Parse the command line
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char fuse_arg[64];
+  tableau_cmdargs.attr_ttl = TFS_CACHE_DEFAULT_TTL;
+  tableau_cmdargs.negative_ttl = TFS_CACHE_DEFAULT_NEGATIVE_TTL;
+  tableau_cmdargs.readahead = TFS_RA_DEFAULT_MAX_KB;
+  tableau_cmdargs.stripe_size = TFS_STRIPE_DEFAULT_SIZE_KB;
+  tableau_cmdargs.stripe_width = TFS_STRIPE_DEFAULT_WIDTH;
   if (fuse_opt_parse(&args, &tableau_cmdargs, tableaufs_opts, NULL) == -1)
     return -1;
 
@@ -169,12 +701,71 @@ int main(int argc, char *argv[])
     return -1;
   }
 
+  if (tableau_cmdargs.readmode == NULL ||
+      strcmp(tableau_cmdargs.readmode, "lo") == 0) {
+    TFS_WG_set_readmode(TFS_WG_READMODE_LO);
+  } else if (strcmp(tableau_cmdargs.readmode, "pages") == 0) {
+    TFS_WG_set_readmode(TFS_WG_READMODE_PAGES);
+  } else {
+    fprintf(stderr, "Error: readmode should be either lo or pages\n");
+    return -1;
+  }
+
+  if ( tableau_cmdargs.loglevel != NULL ) {
+    int level = TFS_LOG_parse_level( tableau_cmdargs.loglevel );
+
+    if (level < 0) {
+      fprintf(stderr, "Error: loglevel should be error, warn, info or debug\n");
+      return -1;
+    }
+    tfs_log_level = (tfs_log_level_t)level;
+  }
+
+  if ( tableau_cmdargs.trace != NULL && TFS_LOG_trace( tableau_cmdargs.trace ) != 0 )
+    return -1;
+
+  // the kernel side options of the cached mode. The low-level frontend
+  // passes the timeouts with its replies instead
+  if ( tableau_cmdargs.cache_timeout > 0 && !tableau_cmdargs.lowlevel ) {
+    snprintf(fuse_arg, sizeof(fuse_arg), "-oattr_timeout=%u,entry_timeout=%u",
+        tableau_cmdargs.cache_timeout, tableau_cmdargs.cache_timeout);
+    fuse_opt_add_arg(&args, fuse_arg);
+  }
+
+  if ( tableau_cmdargs.read_size > 0 ) {
+    snprintf(fuse_arg, sizeof(fuse_arg), "-omax_read=%u",
+        tableau_cmdargs.read_size * 1024);
+    fuse_opt_add_arg(&args, fuse_arg);
+  }
+
   // Connect to PG
   printf("Connecting to %s@%s:%s\n", tableau_cmdargs.pguser,
       tableau_cmdargs.pghost, tableau_cmdargs.pgport );
 
-  TFS_WG_connect_db( tableau_cmdargs.pghost, tableau_cmdargs.pgport,
-      tableau_cmdargs.pguser, tableau_cmdargs.pgpass);
+  TFS_WG_connect_db( &tableau_cmdargs );
+  TFS_CACHE_init( tableau_cmdargs.attr_ttl, tableau_cmdargs.negative_ttl );
+  TFS_RA_configure( tableau_cmdargs.readahead );
+  TFS_STRIPE_configure( tableau_cmdargs.stripe_size,
+      tableau_cmdargs.stripe_width );
+
+  if ( TFS_BC_init( tableau_cmdargs.cache_dir, tableau_cmdargs.cache_size ) != 0 )
+    return -1;
+
+  if ( tableau_cmdargs.snapshot && TFS_NS_load() != 0 ) {
+    fprintf(stderr, "Error: cannot load the namespace snapshot\n");
+    return -1;
+  }
+
+  if ( tableau_cmdargs.packages ) {
+    if ( tableau_cmdargs.lowlevel ) {
+      fprintf(stderr, "Error: packages is not supported with lowlevel\n");
+      return -1;
+    }
+    TFS_PKG_enable();
+  }
+
+  if ( tableau_cmdargs.lowlevel )
+    return TFS_LL_main(&args, &tableau_cmdargs);
 
   // Do the FUSE dance
   return fuse_main(args.argc, args.argv, &tableau_oper, NULL);
@@ -30,9 +30,49 @@ struct tableau_cmdargs {
   const char *pgport;
   const char *pguser;
   const char *pgpass;
+  const char *pgstandby; // host[:port];... of read-only standbys
+  unsigned int poolsize;  // number of pooled backend connections
+  unsigned int attr_ttl;  // seconds to cache stat results
+  unsigned int negative_ttl; // seconds to cache ENOENT results
+  unsigned int idle_timeout; // seconds before an idle file gives back its connection
+  const char *cache_dir;  // local block cache directory, NULL if disabled
+  unsigned int cache_size; // block cache size cap in megabytes
+  unsigned int readahead; // maximum prefetch window in kilobytes
+  const char *readmode;   // lo or pages
+  int snapshot;           // keep the whole namespace in memory
+  unsigned int snapshot_refresh; // seconds between snapshot refreshes
+  int cached;             // let the kernel page cache keep file contents
+  unsigned int cache_timeout; // attr_timeout and entry_timeout of the kernel
+  unsigned int read_size; // max_read and max_readahead in kilobytes
+  const char *loglevel;   // error, warn, info or debug
+  const char *trace;      // Chrome trace output file, NULL if disabled
+  int lowlevel;           // serve through the inode based low-level API
+  unsigned int watch;     // seconds between polls for changes, 0 disables
+  int packages;           // show the members of .twbx/.tdsx as directories
+  unsigned int stripe_size;  // kilobytes fetched per connection by large reads
+  unsigned int stripe_width; // connections a large read is spread over
 };
 
 
+struct fuse_conn_info;
+
+/** Negotiate the connection and start the background threads */
+void * tableaufs_init(struct fuse_conn_info *conn);
+
+/** Stop the background threads at unmount */
+void tableaufs_destroy(void *private_data);
+
+struct fuse_bufvec;
+struct tfs_wg_extent_t;
+
+/**
+ * Describe n pieces of block cache files as a buffer vector libfuse can
+ * splice to the kernel. The descriptors stay owned by the caller.
+ * Returns NULL if out of memory.
+ */
+struct fuse_bufvec * tableaufs_extents_bufvec(
+    const struct tfs_wg_extent_t * ext, int n);
+
 /** Get the connection parameters for the current session */
 struct tableau_cmdargs tableaufs_get_cmdargs();
 
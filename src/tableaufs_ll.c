@@ -0,0 +1,656 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+// fuse.h recommends setting the API version to 26 for new applications
+#define FUSE_USE_VERSION 26
+
+#include "tableaufs_ll.h"
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "workgroup.h"
+#include "inode.h"
+#include "blockcache.h"
+#include "stats.h"
+#include "control.h"
+#include "log.h"
+#include "watch.h"
+#include "xattr.h"
+#include "package.h"
+
+static const struct tableau_cmdargs * ll_cmdargs;
+static struct fuse_chan * ll_chan;
+
+/**
+ * An open directory. Repository directories are streamed from dh by
+ * every readdir, control directories are built at opendir and served in
+ * slices.
+ */
+typedef struct {
+  fuse_req_t req;
+  fuse_ino_t ino;
+  char * data;
+  size_t len;
+  size_t cap;
+  uint64_t dh;   // TFS_WG_opendir handle, 0 for control directories
+} tfs_ll_dir_t;
+
+// Account the latency of an operation, as TFS_TIMED does
+#define TFS_LL_BEGIN() \
+  uint64_t __start = TFS_STATS_now(); \
+  TFS_LOG_begin_request()
+
+#define TFS_LL_END( metric, ret ) \
+  TFS_STATS_record(metric, __start, ret)
+
+/** Seconds the kernel may keep entries and attributes, as fuse_main does */
+static double ll_timeout()
+{
+  return ll_cmdargs->cache_timeout > 0 ?
+    (double)ll_cmdargs->cache_timeout : 1.0;
+}
+
+static void ll_reply_err(fuse_req_t req, int ret)
+{
+  fuse_reply_err(req, ret < 0 ? -ret : ret);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+  (void)userdata;
+  tableaufs_init(conn);
+}
+
+static void ll_destroy(void *userdata)
+{
+  tableaufs_destroy(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct fuse_entry_param e;
+  int ret;
+  TFS_LL_BEGIN();
+
+  memset(&e, 0, sizeof(e));
+  ret = TFS_INO_lookup(parent, name, &e.attr);
+  TFS_LL_END(TFS_STATS_LOOKUP, ret);
+
+  if (ret == -ENOENT) {
+    // an entry without inode lets the kernel remember the miss
+    e.entry_timeout = (double)ll_cmdargs->cache_timeout;
+    fuse_reply_entry(req, &e);
+  } else if (ret < 0) {
+    ll_reply_err(req, ret);
+  } else {
+    e.ino = (fuse_ino_t)e.attr.st_ino;
+    // control files are rendered on every access
+    if (!TFS_INO_IS_CONTROL(e.ino))
+      e.attr_timeout = e.entry_timeout = ll_timeout();
+    fuse_reply_entry(req, &e);
+  }
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  TFS_INO_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+  struct stat st;
+  int ret;
+  TFS_LL_BEGIN();
+
+  ret = TFS_INO_getattr(ino, &st);
+
+  // writes are buffered until the next flush: report the size they make
+  if (ret == 0 && fi != NULL && !TFS_INO_IS_CONTROL(ino))
+    st.st_size = TFS_WG_size(fi->fh, st.st_size);
+
+  TFS_LL_END(TFS_STATS_GETATTR, ret);
+
+  if (ret < 0)
+    ll_reply_err(req, ret);
+  else
+    fuse_reply_attr(req, &st, TFS_INO_IS_CONTROL(ino) ? 0.0 : ll_timeout());
+}
+
+// only truncation is supported, like the truncate of the path frontend
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+    int to_set, struct fuse_file_info *fi)
+{
+  tfs_wg_node_t node;
+  char path[PATH_MAX];
+  int ret;
+  TFS_LL_BEGIN();
+
+  if (TFS_INO_control(ino, path, sizeof(path))) {
+    ret = (to_set & FUSE_SET_ATTR_SIZE) ? TFS_CTL_truncate(path) : -EACCES;
+  } else if (!(to_set & FUSE_SET_ATTR_SIZE)) {
+    ret = -ENOSYS;
+  } else if (fi != NULL) {
+    ret = TFS_WG_ftruncate(fi->fh, attr->st_size);
+  } else if ((ret = TFS_INO_node(ino, &node)) == 0) {
+    if (node.level != TFS_WG_FILE) {
+      ret = -EISDIR;
+    } else {
+      ret = TFS_WG_IO_operation(TFS_WG_TRUNCATE, node.loid, NULL, NULL, 0,
+          attr->st_size);
+      TFS_BC_invalidate(node.loid);
+      TFS_XATTR_invalidate(node.loid);
+      TFS_PKG_invalidate(node.loid);
+    }
+  }
+
+  if (ret == 0) {
+    TFS_INO_invalidate(ino);
+    ret = TFS_INO_getattr(ino, &node.st);
+    if (ret == 0 && fi != NULL && !TFS_INO_IS_CONTROL(ino))
+      node.st.st_size = TFS_WG_size(fi->fh, node.st.st_size);
+  }
+
+  TFS_LL_END(TFS_STATS_TRUNCATE, ret);
+
+  if (ret < 0)
+    ll_reply_err(req, ret);
+  else
+    fuse_reply_attr(req, &node.st, ll_timeout());
+}
+
+/** tfs_wg_add_dir_t appending to a tfs_ll_dir_t */
+static int ll_dir_add(void *buf, const char *name, const struct stat *stbuf,
+    off_t off)
+{
+  tfs_ll_dir_t * d = buf;
+  struct stat st;
+  size_t size, cap;
+  char * tmp;
+
+  (void)off;
+  memset(&st, 0, sizeof(st));
+
+  // listed children are remembered, so the lookups of an ls -l that
+  // follow need no queries
+  if (stbuf != NULL) {
+    memcpy(&st, stbuf, sizeof(st));
+    TFS_INO_store(d->ino, name, &st);
+  }
+
+  size = fuse_add_direntry(d->req, NULL, 0, name, NULL, 0);
+  if (d->len + size > d->cap) {
+    // a streamed listing fills the buffer of a single readdir
+    if (d->dh != 0)
+      return 1;
+    cap = d->cap ? d->cap * 2 : 4096;
+    while (cap < d->len + size)
+      cap *= 2;
+    if ((tmp = realloc(d->data, cap)) == NULL)
+      return 1;
+    d->data = tmp;
+    d->cap = cap;
+  }
+
+  fuse_add_direntry(d->req, d->data + d->len, d->cap - d->len, name, &st,
+      d->dh != 0 ? off : (off_t)(d->len + size));
+  d->len += size;
+
+  return 0;
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+  tfs_ll_dir_t * d;
+  tfs_wg_node_t node;
+  char path[PATH_MAX];
+  int ret = 0;
+  TFS_LL_BEGIN();
+
+  if ((d = calloc(1, sizeof(tfs_ll_dir_t))) == NULL) {
+    ret = -ENOMEM;
+  } else if (TFS_INO_control(ino, path, sizeof(path))) {
+    d->req = req;
+    d->ino = ino;
+    ll_dir_add(d, ".", NULL, 0);
+    ll_dir_add(d, "..", NULL, 0);
+    ret = TFS_CTL_readdir(path, d, ll_dir_add);
+  } else if ((ret = TFS_INO_node(ino, &node)) == 0) {
+    d->ino = ino;
+    ret = TFS_WG_opendir(&node, &d->dh);
+  }
+  TFS_LL_END(TFS_STATS_READDIR, ret);
+
+  if (ret < 0) {
+    if (d != NULL)
+      free(d->data);
+    free(d);
+    ll_reply_err(req, ret);
+  } else {
+    fi->fh = (uint64_t)(uintptr_t)d;
+    fuse_reply_open(req, fi);
+  }
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+    struct fuse_file_info *fi)
+{
+  tfs_ll_dir_t * d = (tfs_ll_dir_t *)(uintptr_t)fi->fh;
+  int ret;
+
+  (void)ino;
+
+  if (d->dh != 0) {
+    TFS_LL_BEGIN();
+
+    d->req = req;
+    d->len = 0;
+    d->cap = size;
+    if ((d->data = malloc(size)) == NULL)
+      ret = -ENOMEM;
+    else
+      ret = TFS_WG_readdir_at(d->dh, off, d, ll_dir_add);
+
+    TFS_LL_END(TFS_STATS_READDIR, ret);
+
+    if (ret < 0 && d->len == 0)
+      ll_reply_err(req, ret);
+    else
+      fuse_reply_buf(req, d->data, d->len);
+    free(d->data);
+    d->data = NULL;
+  } else if (off >= 0 && (size_t)off < d->len)
+    fuse_reply_buf(req, d->data + off,
+        d->len - (size_t)off < size ? d->len - (size_t)off : size);
+  else
+    fuse_reply_buf(req, NULL, 0);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+  tfs_ll_dir_t * d = (tfs_ll_dir_t *)(uintptr_t)fi->fh;
+  int ret = 0;
+  TFS_LL_BEGIN();
+
+  (void)ino;
+  if (d->dh != 0)
+    ret = TFS_WG_releasedir(d->dh);
+  free(d->data);
+  free(d);
+
+  TFS_LL_END(TFS_STATS_RELEASE, ret);
+  fuse_reply_err(req, 0);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  tfs_wg_node_t node;
+  char path[PATH_MAX];
+  int ret;
+  TFS_LL_BEGIN();
+
+  // rendered at open, so never cached by the kernel
+  if (TFS_INO_control(ino, path, sizeof(path))) {
+    fi->direct_io = 1;
+    ret = TFS_CTL_open(path, fi->flags, &(fi->fh));
+  } else if ((ret = TFS_INO_node(ino, &node)) == 0) {
+    if (node.level != TFS_WG_FILE)
+      ret = -EISDIR;
+    else
+      ret = TFS_WG_open(&node, fi->flags, &(fi->fh));
+
+    if ( !ll_cmdargs->cached ) {
+      fi->direct_io = 1;
+    } else if ( ret == 0 && (fi->flags & O_ACCMODE) == O_RDONLY ) {
+      if ( TFS_WG_keep_cache(&node) )
+        fi->keep_cache = 1;
+    }
+  }
+
+  TFS_LL_END(TFS_STATS_OPEN, ret);
+
+  if (ret < 0)
+    ll_reply_err(req, ret);
+  else
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * Reply with pieces of the block cache files, so cached content goes to
+ * the reader without being copied. Returns non-zero if the read was
+ * answered, zero if it has to go through ll_read.
+ */
+static int ll_read_extents(fuse_req_t req, size_t size, off_t off,
+    struct fuse_file_info *fi)
+{
+  struct fuse_bufvec * bv = NULL;
+  tfs_wg_extent_t * ext;
+  int i, n, max = (int)(size / TFS_BC_BLOCKSIZE) + 2;
+  size_t done = 0;
+  TFS_LL_BEGIN();
+
+  if ((ext = malloc((size_t)max * sizeof(tfs_wg_extent_t))) == NULL)
+    return 0;
+
+  n = TFS_WG_read_extents(fi->fh, size, off, ext, max);
+  if (n == -ENOTSUP) {
+    free(ext);
+    return 0;
+  }
+
+  if (n >= 0 && (bv = tableaufs_extents_bufvec(ext, n)) == NULL)
+    n = -ENOMEM;
+  for (i = 0; i < n; i++)
+    done += ext[i].len;
+
+  TFS_LL_END(TFS_STATS_READ, n < 0 ? n : (int)done);
+
+  // the reply is spliced before fuse_reply_data returns
+  if (n < 0) {
+    ll_reply_err(req, n);
+  } else {
+    TFS_STATS_add(TFS_STATS_BYTES_READ, done);
+    fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+  }
+
+  for (i = 0; i < n; i++)
+    close(ext[i].fd);
+  free(bv);
+  free(ext);
+  return 1;
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+    struct fuse_file_info *fi)
+{
+  char * buf;
+  size_t done = 0;
+  int ret;
+
+  if (TFS_BC_enabled() && !TFS_INO_IS_CONTROL(ino) &&
+      ll_read_extents(req, size, off, fi))
+    return;
+
+  TFS_LL_BEGIN();
+  if ((buf = malloc(size)) == NULL) {
+    ret = -ENOMEM;
+  } else if (TFS_INO_IS_CONTROL(ino)) {
+    ret = TFS_CTL_read(fi->fh, buf, size, off);
+  } else {
+    // without direct_io the kernel takes a short read for the end of file
+    do {
+      ret = TFS_WG_read(fi->fh, buf + done, size - done, off + (off_t)done);
+      if (ret <= 0)
+        break;
+      done += (size_t)ret;
+    } while ( ll_cmdargs->cached && done < size );
+
+    if (done > 0) {
+      ret = (int)done;
+      TFS_STATS_add(TFS_STATS_BYTES_READ, done);
+    }
+  }
+
+  TFS_LL_END(TFS_STATS_READ, ret);
+
+  if (ret < 0)
+    ll_reply_err(req, ret);
+  else
+    fuse_reply_buf(req, buf, (size_t)ret);
+
+  free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+    size_t size, off_t off, struct fuse_file_info *fi)
+{
+  int ret;
+  TFS_LL_BEGIN();
+
+  if (TFS_INO_IS_CONTROL(ino)) {
+    ret = TFS_CTL_write(fi->fh, buf, size, off);
+  } else {
+    TFS_INO_invalidate(ino);
+    ret = TFS_WG_write(fi->fh, buf, size, off);
+    if (ret > 0)
+      TFS_STATS_add(TFS_STATS_BYTES_WRITTEN, (uint64_t)ret);
+  }
+
+  TFS_LL_END(TFS_STATS_WRITE, ret);
+
+  if (ret < 0)
+    ll_reply_err(req, ret);
+  else
+    fuse_reply_write(req, (size_t)ret);
+}
+
+// committed writes change the size and the mtime of the file
+static void invalidate_written(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    TFS_INO_invalidate(ino);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  int ret = 0;
+  TFS_LL_BEGIN();
+
+  // the commands written to a control file run when it is closed
+  if (TFS_INO_IS_CONTROL(ino)) {
+    ret = TFS_CTL_flush(fi->fh);
+  } else {
+    ret = TFS_WG_flush(fi->fh);
+    invalidate_written(ino, fi);
+  }
+
+  TFS_LL_END(TFS_STATS_FLUSH, ret);
+  ll_reply_err(req, ret);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info *fi)
+{
+  (void)datasync;
+  ll_flush(req, ino, fi);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+  int ret;
+  TFS_LL_BEGIN();
+
+  if (TFS_INO_IS_CONTROL(ino)) {
+    ret = TFS_CTL_release(fi->fh);
+  } else {
+    ret = TFS_WG_release(fi->fh);
+    invalidate_written(ino, fi);
+  }
+
+  TFS_LL_END(TFS_STATS_RELEASE, ret);
+  ll_reply_err(req, ret);
+}
+
+/** Reply the length of an attribute value or list for size 0, else the data */
+static void ll_reply_xattr(fuse_req_t req, const char * buf, size_t size,
+    int ret)
+{
+  if (ret < 0)
+    ll_reply_err(req, ret);
+  else if (size == 0)
+    fuse_reply_xattr(req, (size_t)ret);
+  else
+    fuse_reply_buf(req, buf, (size_t)ret);
+}
+
+#ifdef __APPLE__
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+    size_t size, uint32_t position)
+#else
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+    size_t size)
+#endif
+{
+  tfs_wg_node_t node;
+  char value[256];
+  int ret;
+  TFS_LL_BEGIN();
+
+  if (TFS_INO_IS_CONTROL(ino))
+    ret = -ENOATTR;
+  else if ((ret = TFS_INO_node(ino, &node)) == 0)
+    ret = TFS_XATTR_get(&node, name, value,
+        size < sizeof(value) ? size : sizeof(value));
+
+  TFS_LL_END(TFS_STATS_XATTR, ret);
+
+  ll_reply_xattr(req, value, size, ret);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+  tfs_wg_node_t node;
+  char list[256];
+  int ret;
+  TFS_LL_BEGIN();
+
+  if (TFS_INO_IS_CONTROL(ino))
+    ret = 0;
+  else if ((ret = TFS_INO_node(ino, &node)) == 0)
+    ret = TFS_XATTR_list(&node, list,
+        size < sizeof(list) ? size : sizeof(list));
+
+  TFS_LL_END(TFS_STATS_XATTR, ret);
+
+  ll_reply_xattr(req, list, size, ret);
+}
+
+/** Make the kernel look up name again and drop the cached data of ino */
+static void ll_inval(void * ctx, uint64_t parent, const char * name,
+    uint64_t ino)
+{
+  (void)ctx;
+
+  if (ino != 0) {
+    TFS_INO_invalidate(ino);
+    fuse_lowlevel_notify_inval_inode(ll_chan, (fuse_ino_t)ino, 0, 0);
+  }
+  fuse_lowlevel_notify_inval_entry(ll_chan, (fuse_ino_t)parent, name,
+      strlen(name));
+}
+
+// called by the watcher thread and by control file copies, never from a
+// request on the changed inode, so the kernel notifications cannot
+// deadlock on the inode being served
+static void ll_changed(const char * site, const char * project,
+    const char * file)
+{
+  uint64_t s, p;
+
+  if (site == NULL) {
+    TFS_INO_invalidate_all();
+    TFS_INO_children(TFS_INO_ROOT, ll_inval, NULL);
+  } else if ((s = TFS_INO_child(TFS_INO_ROOT, site)) == 0) {
+    // nothing of the site was looked up yet
+  } else if (file == NULL) {
+    TFS_INO_invalidate_all();
+    TFS_INO_children(s, ll_inval, NULL);
+  } else if ((p = TFS_INO_child(s, project)) != 0) {
+    // also drops a cached miss of a new file
+    ll_inval(NULL, p, file, TFS_INO_child(p, file));
+  }
+}
+
+static struct fuse_lowlevel_ops tableau_ll_oper = {
+  .init           = ll_init,
+  .destroy        = ll_destroy,
+  .lookup         = ll_lookup,
+  .forget         = ll_forget,
+  .getattr        = ll_getattr,
+  .setattr        = ll_setattr,
+  .opendir        = ll_opendir,
+  .readdir        = ll_readdir,
+  .releasedir     = ll_releasedir,
+  .open           = ll_open,
+  .read           = ll_read,
+  .write          = ll_write,
+  .flush          = ll_flush,
+  .release        = ll_release,
+  .fsync          = ll_fsync,
+  .getxattr       = ll_getxattr,
+  .listxattr      = ll_listxattr,
+};
+
+int TFS_LL_main(struct fuse_args * args,
+    const struct tableau_cmdargs * cmdargs)
+{
+  struct fuse_chan * ch;
+  struct fuse_session * se;
+  char * mountpoint;
+  int multithreaded, foreground, err = -1;
+
+  ll_cmdargs = cmdargs;
+  TFS_INO_init( cmdargs->attr_ttl );
+
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+    return -1;
+
+  if ((ch = fuse_mount(mountpoint, args)) != NULL) {
+    ll_chan = ch;
+    TFS_WATCH_set_notify(ll_changed);
+
+    se = fuse_lowlevel_new(args, &tableau_ll_oper, sizeof(tableau_ll_oper),
+        NULL);
+
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+
+        // forks like fuse_main: the threads are started in ll_init
+        if (fuse_daemonize(foreground) != -1)
+          err = multithreaded ? fuse_session_loop_mt(se) :
+            fuse_session_loop(se);
+
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+
+  free(mountpoint);
+  fuse_opt_free_args(args);
+
+  return err ? 1 : 0;
+}
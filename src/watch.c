@@ -0,0 +1,612 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include "watch.h"
+#include "pgpool.h"
+#include "cache.h"
+#include "namespace.h"
+#include "stats.h"
+#include "log.h"
+
+#define TFS_WATCH_MTIME( t ) \
+  "(extract(epoch from " #t ".updated_at) * 1000000)::int8"
+
+// compares epochs, to_timestamp() would depend on the session time zone
+#define TFS_WATCH_SINCE( t ) \
+  " where extract(epoch from " #t ".updated_at) * 1000000 > $1 "
+
+/* Changes return kind, id, site, project, file, mtime in microseconds */
+
+#define TFS_WATCH_FILES( kind, entity, ext ) \
+  "select " #kind "::int8, c.id::int8, replace(s.name,'/','_'), " \
+  "replace(p.name,'/','_'), replace(c.name,'/','_') || '." #ext "', " \
+  TFS_WATCH_MTIME(c) " from " #entity " c " \
+  "inner join projects p on (p.id = c.project_id) " \
+  "inner join sites s on (s.id = p.site_id)" TFS_WATCH_SINCE(c)
+
+#define TFS_WATCH_CHANGES \
+  "select 0::int8, s.id::int8, replace(s.name,'/','_'), null, null, " \
+  TFS_WATCH_MTIME(s) " from sites s" TFS_WATCH_SINCE(s) "union all " \
+  "select 1::int8, p.id::int8, replace(s.name,'/','_'), " \
+  "replace(p.name,'/','_'), null, " TFS_WATCH_MTIME(p) " from projects p " \
+  "inner join sites s on (s.id = p.site_id)" TFS_WATCH_SINCE(p) "union all " \
+  TFS_WATCH_FILES(2, workbooks, twb) "union all " \
+  TFS_WATCH_FILES(3, datasources, tds)
+
+#define TFS_WATCH_NEWEST( entity ) \
+  "(select max(updated_at) from " #entity ")"
+
+#define TFS_WATCH_CHECKSUM( entity ) \
+  "(select count(*) from " #entity ")::int8, " \
+  "(select coalesce(sum(id),0) from " #entity ")::int8"
+
+/**
+ * Newest updated_at, then row counts and id sums to detect deletions.
+ * The server clock would skip rows stamped before it but committed
+ * after.
+ */
+#define TFS_WATCH_CHECKSUMS \
+  "select coalesce(extract(epoch from greatest(" TFS_WATCH_NEWEST(sites) \
+  ", " TFS_WATCH_NEWEST(projects) ", " TFS_WATCH_NEWEST(workbooks) ", " \
+  TFS_WATCH_NEWEST(datasources) ")) * 1000000, 0)::int8, " \
+  TFS_WATCH_CHECKSUM(sites) ", " TFS_WATCH_CHECKSUM(projects) ", " \
+  TFS_WATCH_CHECKSUM(workbooks) ", " TFS_WATCH_CHECKSUM(datasources)
+
+/** Checksums and changes must see the same rows */
+#define TFS_WATCH_BEGIN "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY"
+
+#define TFS_WATCH_TABLES 4
+
+typedef enum {
+  TFS_WATCH_SITE = 0,
+  TFS_WATCH_PROJECT = 1,
+  TFS_WATCH_WORKBOOK = 2,
+  TFS_WATCH_DATASOURCE = 3
+} tfs_watch_kind_t;
+
+/**
+ * Ids of the rows of a table, sorted, to tell new rows from updated ones.
+ * Files also keep their "site/project/file" path, to find the old name
+ * of a renamed or moved file.
+ */
+typedef struct {
+  int64_t * ids;
+  char ** paths;
+  size_t count, cap;
+  int64_t sum;
+} tfs_watch_ids_t;
+
+/** A change already reported. Kept for TFS_WATCH_OVERLAP seconds */
+typedef struct {
+  int kind;
+  int64_t id;
+  int64_t mtime;
+} tfs_watch_seen_t;
+
+// outer joins: every row has to be counted, with or without a path
+#define TFS_WATCH_KNOWN_FILES( entity, ext ) \
+  "select c.id::int8, replace(s.name,'/','_') || '/' || " \
+  "replace(p.name,'/','_') || '/' || replace(c.name,'/','_') || '." #ext \
+  "' from " #entity " c left join projects p on (p.id = c.project_id) " \
+  "left join sites s on (s.id = p.site_id) order by 1"
+
+static const char * known_queries[TFS_WATCH_TABLES] = {
+  "select id::int8, null from sites order by 1",
+  "select id::int8, null from projects order by 1",
+  TFS_WATCH_KNOWN_FILES(workbooks, twb),
+  TFS_WATCH_KNOWN_FILES(datasources, tds)
+};
+
+static unsigned int watch_interval;
+static tfs_watch_notify_t watch_notify;
+
+// state of the watcher thread only
+static int64_t since;                          // newest updated_at seen (us)
+static tfs_watch_ids_t known[TFS_WATCH_TABLES];
+static int initialized;
+static tfs_watch_seen_t * seen;
+static size_t seen_count, seen_cap;
+
+void TFS_WATCH_set_notify(tfs_watch_notify_t notify)
+{
+  watch_notify = notify;
+}
+
+void TFS_WATCH_notify(const char * site, const char * project,
+    const char * file)
+{
+  if (watch_notify != NULL)
+    watch_notify(site, project, file);
+}
+
+/** Returns non-zero if the change was not reported yet */
+static int remember(int kind, int64_t id, int64_t mtime)
+{
+  tfs_watch_seen_t * tmp;
+  size_t i;
+
+  for (i = 0; i < seen_count; i++)
+    if (seen[i].kind == kind && seen[i].id == id && seen[i].mtime == mtime)
+      return 0;
+
+  if (seen_count == seen_cap) {
+    tmp = realloc(seen, (seen_cap ? seen_cap * 2 : 64) *
+        sizeof(tfs_watch_seen_t));
+    // reporting twice is better than not at all
+    if (tmp == NULL)
+      return 1;
+    seen = tmp;
+    seen_cap = seen_cap ? seen_cap * 2 : 64;
+  }
+
+  seen[seen_count].kind = kind;
+  seen[seen_count].id = id;
+  seen[seen_count].mtime = mtime;
+  seen_count++;
+
+  return 1;
+}
+
+/** Make room for one more known row */
+static int grow_known(tfs_watch_ids_t * k, size_t cap)
+{
+  int64_t * ids;
+  char ** paths;
+
+  if (cap <= k->cap)
+    return 0;
+
+  if ((ids = realloc(k->ids, cap * sizeof(int64_t))) == NULL)
+    return -ENOMEM;
+  k->ids = ids;
+  if ((paths = realloc(k->paths, cap * sizeof(char *))) == NULL)
+    return -ENOMEM;
+  k->paths = paths;
+  k->cap = cap;
+
+  return 0;
+}
+
+/**
+ * Add id with its path (NULL if it has none) to the known rows of a
+ * table. Returns 1 if it is new, 0 if it was known. If it was known
+ * under another path, *moved gets that path, to be freed by the caller.
+ */
+static int add_known(int kind, int64_t id, const char * path, char ** moved)
+{
+  tfs_watch_ids_t * k;
+  char * copy = NULL;
+  size_t lo = 0, hi, mid;
+
+  *moved = NULL;
+  if (kind < 0 || kind >= TFS_WATCH_TABLES)
+    return 0;
+
+  if (path != NULL && (copy = strdup(path)) == NULL)
+    return -ENOMEM;
+
+  k = &known[kind];
+  hi = k->count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (k->ids[mid] == id) {
+      if (k->paths[mid] != NULL && copy != NULL &&
+          strcmp(k->paths[mid], copy) == 0) {
+        free(copy);
+        return 0;
+      }
+      *moved = k->paths[mid];
+      k->paths[mid] = copy;
+      return 0;
+    } else if (k->ids[mid] < id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (k->count == k->cap &&
+      grow_known(k, k->cap ? k->cap * 2 : 64) != 0) {
+    free(copy);
+    return -ENOMEM;
+  }
+
+  memmove(k->ids + lo + 1, k->ids + lo, (k->count - lo) * sizeof(int64_t));
+  memmove(k->paths + lo + 1, k->paths + lo,
+      (k->count - lo) * sizeof(char *));
+  k->ids[lo] = id;
+  k->paths[lo] = copy;
+  k->count++;
+  k->sum += id;
+
+  return 1;
+}
+
+/** Forget the changes older than the overlap window */
+static void prune()
+{
+  size_t i, j = 0;
+
+  for (i = 0; i < seen_count; i++)
+    if (seen[i].mtime >= since - TFS_WATCH_OVERLAP * 1000000ll)
+      seen[j++] = seen[i];
+
+  seen_count = j;
+}
+
+/**
+ * Drop the stat cache entries of a changed object and pass it on. A
+ * project is passed on as its site: a renamed project leaves an old
+ * name behind that only the site knows of.
+ */
+static void changed(const char * site, const char * project,
+    const char * file)
+{
+  char path[PATH_MAX];
+
+  if (file == NULL) {
+    // a renamed directory leaves its old name and everything below it
+    // behind, without telling which names those were
+    TFS_CACHE_clear();
+  } else {
+    snprintf(path, sizeof(path), "/%s/%s/%s", site, project, file);
+    TFS_CACHE_invalidate(path);
+    snprintf(path, sizeof(path), "/%s/%s/%sx", site, project, file);
+    TFS_CACHE_invalidate(path);
+  }
+
+  if (watch_notify == NULL)
+    return;
+
+  if (file != NULL) {
+    watch_notify(site, project, file);
+    snprintf(path, sizeof(path), "%sx", file);
+    watch_notify(site, project, path);
+  } else {
+    watch_notify(project != NULL ? site : NULL, NULL, NULL);
+  }
+}
+
+static PGresult * watch_query(PGconn * conn, const char * sql, int nparams,
+    const char * const * paramValues)
+{
+  PGresult * res = PQexecParams(conn, sql, nparams, NULL, paramValues, NULL,
+      NULL, 1);
+
+  if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+    TFS_LOG(TFS_LOG_ERROR, "Watching for changes failed: %s",
+        PQresultErrorMessage(res));
+    PQclear(res);
+    return NULL;
+  }
+
+  return res;
+}
+
+static int watch_command(PGconn * conn, const char * sql)
+{
+  PGresult * res = PQexec(conn, sql);
+  int ret = PQresultStatus(res) == PGRES_COMMAND_OK ? 0 : -EIO;
+
+  if (ret != 0)
+    TFS_LOG(TFS_LOG_ERROR, "Watching for changes failed: %s",
+        PQresultErrorMessage(res));
+  PQclear(res);
+
+  return ret;
+}
+
+/** Load the ids and paths of all rows, replacing the known ones */
+static int load_known(PGconn * conn)
+{
+  tfs_watch_ids_t * k;
+  PGresult * res;
+  size_t j;
+  int i, row;
+
+  for (i = 0; i < TFS_WATCH_TABLES; i++) {
+    k = &known[i];
+    for (j = 0; j < k->count; j++)
+      free(k->paths[j]);
+    k->count = 0;
+    k->sum = 0;
+
+    if ((res = watch_query(conn, known_queries[i], 0, NULL)) == NULL)
+      return -EIO;
+
+    if (grow_known(k, (size_t)PQntuples(res)) != 0) {
+      PQclear(res);
+      return -ENOMEM;
+    }
+
+    for (row = 0; row < PQntuples(res); row++) {
+      k->ids[row] = TFS_PG_get_int8(res, row, 0);
+      k->paths[row] = PQgetisnull(res, row, 1) ? NULL :
+        strdup(PQgetvalue(res, row, 1));
+      k->sum += k->ids[row];
+      k->count++;
+    }
+    PQclear(res);
+  }
+
+  return 0;
+}
+
+/** Report the old location of a moved file, given as site/project/file */
+static void changed_path(char * path)
+{
+  char * project, * file;
+
+  if ((project = strchr(path, '/')) == NULL ||
+      (file = strchr(project + 1, '/')) == NULL)
+    return;
+
+  *project++ = '\0';
+  *file++ = '\0';
+  changed(path, project, file);
+}
+
+static void free_moved(char ** moved, PGresult * res)
+{
+  int row;
+
+  for (row = 0; moved != NULL && row < PQntuples(res); row++)
+    free(moved[row]);
+  free(moved);
+}
+
+/** Look for changes since the last poll and report them */
+static int poll_changes(PGconn * conn)
+{
+  int64_t sums[TFS_WATCH_TABLES * 2], mtime;
+  char since_str[24];
+  const char * paramValues[1] = { since_str };
+  PGresult * res = NULL;
+  char * fresh = NULL, ** moved = NULL;
+  char path[PATH_MAX];
+  int i, row, kind, ret, deleted = 0, changes = 0;
+
+  if ((ret = watch_command(conn, TFS_WATCH_BEGIN)) != 0)
+    return ret;
+
+  if ((res = watch_query(conn, TFS_WATCH_CHECKSUMS, 0, NULL)) == NULL) {
+    ret = -EIO;
+    goto out;
+  }
+
+  for (i = 0; i < TFS_WATCH_TABLES * 2; i++)
+    sums[i] = TFS_PG_get_int8(res, 0, i + 1);
+
+  if (!initialized) {
+    // changes older than the first poll are already in the caches. A
+    // later start over comes from a failure, drop them then
+    if (since == 0)
+      since = TFS_PG_get_int8(res, 0, 0);
+    else
+      deleted = 1;
+    PQclear(res);
+    res = NULL;
+    if ((ret = load_known(conn)) == 0)
+      initialized = 1;
+    goto out;
+  }
+  PQclear(res);
+
+  // updated_at is set when a transaction starts writing, it may become
+  // visible long after newer rows did
+  snprintf(since_str, sizeof(since_str), "%lld",
+      (long long)(since - TFS_WATCH_OVERLAP * 1000000ll));
+  if ((res = watch_query(conn, TFS_WATCH_CHANGES, 1, paramValues)) == NULL) {
+    ret = -EIO;
+    goto out;
+  }
+
+  if ((fresh = calloc((size_t)PQntuples(res) + 1, 1)) == NULL ||
+      (moved = calloc((size_t)PQntuples(res) + 1, sizeof(char *))) == NULL) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  for (row = 0; row < PQntuples(res); row++) {
+    kind = (int)TFS_PG_get_int8(res, row, 0);
+    mtime = TFS_PG_get_int8(res, row, 5);
+    if (remember(kind, TFS_PG_get_int8(res, row, 1), mtime)) {
+      fresh[row] = 1;
+      changes++;
+    }
+    if (mtime > since)
+      since = mtime;
+
+    // a known file under another path was renamed or moved
+    if (kind == TFS_WATCH_WORKBOOK || kind == TFS_WATCH_DATASOURCE)
+      snprintf(path, sizeof(path), "%s/%s/%s", PQgetvalue(res, row, 2),
+          PQgetvalue(res, row, 3), PQgetvalue(res, row, 4));
+    if (add_known(kind, TFS_PG_get_int8(res, row, 1),
+          kind == TFS_WATCH_WORKBOOK || kind == TFS_WATCH_DATASOURCE ?
+          path : NULL, &moved[row]) < 0)
+      deleted = 1;
+  }
+
+  // updated_at does not tell about deleted rows: unless every table
+  // holds exactly the rows known before plus the new ones, some went
+  // away (or changed unseen), start over then
+  for (i = 0; i < TFS_WATCH_TABLES; i++)
+    if (sums[i * 2] != (int64_t)known[i].count ||
+        sums[i * 2 + 1] != known[i].sum)
+      deleted = 1;
+
+  if (deleted && load_known(conn) != 0)
+    initialized = 0;
+
+out:
+  watch_command(conn, ret == 0 ? "COMMIT" : "ROLLBACK");
+  if (ret != 0) {
+    free_moved(moved, res);
+    free(fresh);
+    PQclear(res);
+    return ret;
+  }
+
+  // the snapshot goes first, so lookups caused by the invalidations
+  // below already see the new rows
+  if (deleted || changes > 0)
+    TFS_NS_refresh();
+
+  if (deleted) {
+    TFS_LOG(TFS_LOG_INFO, "Rows deleted in the repository, dropping caches");
+    changed(NULL, NULL, NULL);
+  } else {
+    for (row = 0; res != NULL && row < PQntuples(res); row++) {
+      if (!fresh[row])
+        continue;
+
+      switch ((tfs_watch_kind_t)TFS_PG_get_int8(res, row, 0)) {
+        case TFS_WATCH_SITE:
+          changed(NULL, NULL, NULL);
+          break;
+        case TFS_WATCH_PROJECT:
+          changed(PQgetvalue(res, row, 2), PQgetvalue(res, row, 3), NULL);
+          break;
+        default:
+          changed(PQgetvalue(res, row, 2), PQgetvalue(res, row, 3),
+              PQgetvalue(res, row, 4));
+          break;
+      }
+    }
+
+    // the old name of a renamed or moved file is cached as well
+    for (row = 0; moved != NULL && row < PQntuples(res); row++)
+      if (moved[row] != NULL)
+        changed_path(moved[row]);
+  }
+
+  if (deleted || changes > 0)
+    TFS_LOG(TFS_LOG_INFO, "%d changes found in the repository", changes);
+
+  free_moved(moved, res);
+  free(fresh);
+  PQclear(res);
+  prune();
+  return ret;
+}
+
+/** Sleep until the interval is over or the channel is notified */
+static void wait_for_change(PGconn * conn)
+{
+  struct timeval tv = { (time_t)watch_interval, 0 };
+  PGnotify * n;
+  fd_set fds;
+  int sock = PQsocket(conn), notified = 0;
+
+  // notifications may have come in with the last query results
+  PQconsumeInput(conn);
+  while ((n = PQnotifies(conn)) != NULL) {
+    notified = 1;
+    PQfreemem(n);
+  }
+  if (notified)
+    return;
+
+  if (sock < 0) {
+    sleep(watch_interval);
+    return;
+  }
+
+  FD_ZERO(&fds);
+  FD_SET(sock, &fds);
+  if (select(sock + 1, &fds, NULL, NULL, &tv) > 0 && PQconsumeInput(conn))
+    while ((n = PQnotifies(conn)) != NULL)
+      PQfreemem(n);
+}
+
+/** Open (or reopen) the watcher session and subscribe to the channel */
+static PGconn * watch_connect(PGconn * conn)
+{
+  PGresult * res;
+
+  if (conn == NULL) {
+    conn = TFS_PG_connect();
+  } else if (PQstatus(conn) != CONNECTION_OK) {
+    PQreset(conn);
+    if (PQstatus(conn) != CONNECTION_OK)
+      return conn;
+  } else {
+    return conn;
+  }
+
+  if (conn != NULL) {
+    res = PQexec(conn, "LISTEN " TFS_WATCH_CHANNEL);
+    PQclear(res);
+  }
+
+  return conn;
+}
+
+static void * watch_main(void * arg)
+{
+  PGconn * conn = NULL;
+  uint64_t start;
+  int ret;
+
+  (void)arg;
+
+  for (;;) {
+    conn = watch_connect(conn);
+    if (conn == NULL || PQstatus(conn) != CONNECTION_OK) {
+      sleep(watch_interval);
+      continue;
+    }
+
+    start = TFS_STATS_now();
+    ret = poll_changes(conn);
+    TFS_STATS_record(TFS_STATS_SQL_WATCH, start, ret);
+
+    wait_for_change(conn);
+  }
+
+  return NULL;
+}
+
+int TFS_WATCH_start(unsigned int interval)
+{
+  pthread_t thread;
+
+  if (interval == 0)
+    return 0;
+
+  watch_interval = interval;
+
+  if (pthread_create(&thread, NULL, watch_main, NULL) != 0)
+    return -1;
+
+  pthread_detach(thread);
+  return 0;
+}
@@ -0,0 +1,61 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_watch_h
+#define tableaufs_watch_h
+
+/** Channel a repository trigger can NOTIFY to trigger a poll at once */
+#define TFS_WATCH_CHANNEL "tableaufs"
+
+/** Seconds a change may become visible later than its updated_at */
+#define TFS_WATCH_OVERLAP 60
+
+/**
+ * Called for every change with names as they appear in the mount. A
+ * changed file comes with all three names, once for each of its
+ * possible extensions (.twb and .twbx, .tds and .tdsx). Only a site
+ * means anything in that site may have changed (a project changed or
+ * was renamed), all NULL means anything at all (a site changed or rows
+ * were deleted).
+ */
+typedef void (* tfs_watch_notify_t)(const char * site, const char * project,
+    const char * file);
+
+/** Forward changes to notify as well, after the internal caches */
+extern void TFS_WATCH_set_notify(tfs_watch_notify_t notify);
+
+/**
+ * Pass a change made through the mount to notify, if set. Must not be
+ * called while a request on the object or its directory is served.
+ */
+extern void TFS_WATCH_notify(const char * site, const char * project,
+    const char * file);
+
+/**
+ * Start the thread polling the repository for changes every interval
+ * seconds, or as soon as TFS_WATCH_CHANNEL is notified. Changes drop
+ * the affected entries of the stat cache and refresh the snapshot.
+ */
+extern int TFS_WATCH_start(unsigned int interval);
+
+#endif /* tableaufs_watch_h */
@@ -0,0 +1,99 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "worker.h"
+
+typedef struct tfs_worker_job_t {
+  tfs_worker_fn_t fn;
+  void * arg;
+  struct tfs_worker_job_t * next;
+} tfs_worker_job_t;
+
+/** FIFO of queued jobs */
+static tfs_worker_job_t * queue_head;
+static tfs_worker_job_t * queue_tail;
+static unsigned int running;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static void * worker_main(void * arg)
+{
+  tfs_worker_job_t * job;
+
+  for (;;) {
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_head == NULL)
+      pthread_cond_wait(&queue_cond, &queue_mutex);
+
+    job = queue_head;
+    queue_head = job->next;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    pthread_mutex_unlock(&queue_mutex);
+
+    job->fn(job->arg);
+    free(job);
+  }
+
+  return NULL;
+}
+
+int TFS_WORKER_start(unsigned int threads)
+{
+  pthread_t thread;
+
+  for ( ; threads > 0; threads--) {
+    if (pthread_create(&thread, NULL, worker_main, NULL) != 0)
+      break;
+    pthread_detach(thread);
+    running++;
+  }
+
+  return running > 0 ? 0 : -1;
+}
+
+int TFS_WORKER_submit(tfs_worker_fn_t fn, void * arg)
+{
+  tfs_worker_job_t * job;
+
+  if (running == 0 || (job = malloc(sizeof(tfs_worker_job_t))) == NULL)
+    return -1;
+
+  job->fn = fn;
+  job->arg = arg;
+  job->next = NULL;
+
+  pthread_mutex_lock(&queue_mutex);
+  if (queue_tail)
+    queue_tail->next = job;
+  else
+    queue_head = job;
+  queue_tail = job;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_mutex);
+
+  return 0;
+}
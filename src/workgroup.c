@@ -28,9 +28,15 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
-#include <pthread.h>
 #include "workgroup.h"
+#include "log.h"
 #include "tableaufs.h"
+#include "pgpool.h"
+#include "cache.h"
+#include "namespace.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "flight.h"
 #include "libpq-fe.h"
 #include "libpq/libpq-fs.h"
 
@@ -39,7 +45,7 @@
 #define _NAME_MAX "255"
 
 #define TFS_WG_MTIME \
-  ", extract(epoch from coalesce(c.updated_at,'2000-01-01')) ctime "
+  ", extract(epoch from coalesce(c.updated_at,'2000-01-01'))::int8 ctime "
 
 #define TFS_WG_LIST_SITES  \
   "select c.name" TFS_WG_MTIME "from sites c where 1 = 1 "
@@ -50,9 +56,9 @@
 
 #define TFS_WG_LIST_FILE( entity, ext ) \
   "select c.name || '." #ext "' || case when substring(data from 1 for 2) = " \
-  "'PK' then 'x' else '' end filename " TFS_WG_MTIME ", content," \
+  "'PK' then 'x' else '' end filename " TFS_WG_MTIME ", content::int8," \
   "(select sum(length(data)) from pg_largeobject where pg_largeobject.loid = " \
-  "repository_data.content) size from " #entity " c inner join repository_data " \
+  "repository_data.content)::int8 size from " #entity " c inner join repository_data " \
   " on (repository_data.tracking_id = coalesce(data_id,reduced_data_id))" \
   "inner join projects on (c.project_id = projects.id) inner join sites on " \
   "(sites.id = projects.site_id) inner join pg_largeobject on " \
@@ -66,90 +72,486 @@
 #define TFS_WG_NAMES_WITHOUT_SLASH(ext) \
   "replace(c.name,'/','_')||'." #ext "x', replace(c.name,'/','_')||'." #ext "' "
 
+/** A read failed because its connection was lost, see TFS_PG_lost */
+#define TFS_WG_LOST (-ENOTCONN)
 
-/** The global connection object */
-static PGconn* global_conn;
-
-/** Mutex for transaction LO access */
-static pthread_mutex_t tfs_wg_transaction_block_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Size of a pg_largeobject page (LOBLKSIZE), a quarter of the block size */
+#define TFS_WG_LOBLKSIZE \
+  "select current_setting('block_size')::int4 / 4"
 
+#define TFS_WG_READ_PAGES \
+  "select pageno, data from pg_largeobject where loid = $1 " \
+  " and pageno between $2 and $3 order by pageno"
 
+/**
+ * Digest of the content: md5 over the md5 of every page, so the server
+ * hashes the object page by page instead of assembling it in memory
+ */
+#define TFS_WG_DIGEST \
+  "select md5(coalesce(string_agg(md5(data), '' order by pageno), '')) " \
+  "from pg_largeobject where loid = $1"
+
+/** One chunk of a large object, for pipelined reads (server 9.4+) */
+#define TFS_WG_LO_GET "select lo_get($1::oid, $2::int8, $3::int4)"
+
+/** Empty a large object before it is copied over, 131072 is INV_WRITE */
+#define TFS_WG_LO_EMPTY "select lo_truncate(lo_open($1::oid, 131072), 0)"
+
+/** Copy one chunk from large object $1 to $2 on the server (9.4+) */
+#define TFS_WG_LO_COPY \
+  "select octet_length(c)::int8, lo_put($2::oid, $3::int8, c) " \
+  "from (select lo_get($1::oid, $3::int8, $4::int4) c) s"
+
+/** Bytes copied per statement: bounds the memory the server needs */
+#define TFS_WG_COPY_CHUNK (8 * 1024 * 1024)
+
+/** The statements prepared on every pooled connection */
+typedef enum {
+  TFS_WG_STMT_LIST_SITES = 0,
+  TFS_WG_STMT_LIST_PROJECTS,
+  TFS_WG_STMT_LIST_FILES,
+  TFS_WG_STMT_STAT_SITE,
+  TFS_WG_STMT_STAT_PROJECT,
+  TFS_WG_STMT_STAT_FILE,
+  TFS_WG_STMT_READ_PAGES,
+  TFS_WG_STMT_DIGEST
+} tfs_wg_stmt_t;
+
+static const struct {
+  const char * name;
+  const char * sql;
+  int nparams;
+  tfs_stats_metric_t metric;
+} statements[] = {
+  { "tfs_list_sites", TFS_WG_LIST_SITES, 0, TFS_STATS_SQL_LIST_SITES },
+  { "tfs_list_projects", TFS_WG_LIST_PROJECTS, 1,
+    TFS_STATS_SQL_LIST_PROJECTS },
+  { "tfs_list_files",
+    TFS_WG_LIST_WORKBOOKS " union all " TFS_WG_LIST_DATASOURCES, 2,
+    TFS_STATS_SQL_LIST_FILES },
+  { "tfs_stat_site", TFS_WG_LIST_SITES " and c.name = $1", 1,
+    TFS_STATS_SQL_STAT_SITE },
+  { "tfs_stat_project", TFS_WG_LIST_PROJECTS " and c.name = $2", 2,
+    TFS_STATS_SQL_STAT_PROJECT },
+  { "tfs_stat_file",
+    TFS_WG_LIST_WORKBOOKS " and $3 IN (" TFS_WG_NAMES_WITHOUT_SLASH(twb) ") "
+    "union all "
+    TFS_WG_LIST_DATASOURCES " and $3 IN (" TFS_WG_NAMES_WITHOUT_SLASH(tds) ") ",
+    3, TFS_STATS_SQL_STAT_FILE },
+  { "tfs_read_pages", TFS_WG_READ_PAGES, 3, TFS_STATS_SQL_READ_PAGES },
+  { "tfs_digest", TFS_WG_DIGEST, 1, TFS_STATS_SQL_DIGEST },
+};
 
 /**
- * Connection data for postgres.
+ * Run one of the statements above with binary results.
  *
- * This gets filled on the call to TFS_WG_connect_db.
+ * Statements are prepared lazily, once per connection, so Postgres plans
+ * the heavy listing joins only on their first use.
  */
-static struct tableau_cmdargs pg_connection_data;
+static PGresult * exec_stmt(tfs_pg_conn_t * pc, tfs_wg_stmt_t stmt,
+    const char * const * paramValues)
+{
+  PGresult * res;
+  uint64_t start = TFS_STATS_now();
+
+  if (!(pc->prepared & (1u << stmt))) {
+    res = PQprepare(pc->conn, statements[stmt].name, statements[stmt].sql,
+        statements[stmt].nparams, NULL);
+    if (PQresultStatus(res) == PGRES_COMMAND_OK)
+      pc->prepared |= 1u << stmt;
+    else
+      TFS_LOG(TFS_LOG_ERROR, "Preparing %s failed: %s",
+          statements[stmt].name, PQresultErrorMessage(res));
+    PQclear(res);
+  }
 
-/** Helper function to wrap connecting to a database using the connection data */
-static PGconn* connect_to_pg( struct tableau_cmdargs conn_data)
+  res = PQexecPrepared(pc->conn, statements[stmt].name,
+      statements[stmt].nparams, paramValues, NULL, NULL, 1);
+  TFS_STATS_record(statements[stmt].metric, start,
+      PQresultStatus(res) == PGRES_TUPLES_OK ? 0 : -EIO);
+
+  return res;
+}
+
+/** Decode a binary int4 result column */
+static int32_t get_int4(const PGresult * res, int row, int col)
 {
-  PGconn* new_conn = PQsetdbLogin(
-      conn_data.pghost,
-      conn_data.pgport,
-      NULL, NULL, "workgroup",
-      conn_data.pguser,
-      conn_data.pgpass );
+  const unsigned char * p = (const unsigned char *)PQgetvalue(res, row, col);
 
-  /* check to see that the backend connection was successfully made */
-  if (PQstatus(new_conn) == CONNECTION_BAD)
-  {
-    fprintf(stderr, "Connection to database '%s' failed.\n", conn_data.pghost);
-    fprintf(stderr, "%s", PQerrorMessage(new_conn));
-    PQfinish(new_conn);
-    return NULL;
-  }
+  return (int32_t)((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+      (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+/** Engine used for reads, see TFS_WG_set_readmode. Read by all threads */
+static tfs_wg_readmode_t read_mode = TFS_WG_READMODE_LO;
+
+/** pg_largeobject page size of the servers, 0 until asked */
+static int32_t lo_blksize;
 
-  return new_conn;
+void TFS_WG_set_readmode(tfs_wg_readmode_t mode)
+{
+  __atomic_store_n(&read_mode, mode, __ATOMIC_RELAXED);
+}
+
+tfs_wg_readmode_t TFS_WG_get_readmode()
+{
+  return __atomic_load_n(&read_mode, __ATOMIC_RELAXED);
 }
 
 /**
- * Helper function to get the current connection to the database
+ * Page size of pg_largeobject, asked once from the server: it depends
+ * on the block size the server was built with. Standbys share it with
+ * the primary. Returns 0 if the server cannot tell.
+ */
+static int32_t get_lo_blksize(tfs_pg_conn_t * pc)
+{
+  PGresult * res;
+  int32_t blksize = __atomic_load_n(&lo_blksize, __ATOMIC_RELAXED);
+
+  if (blksize > 0)
+    return blksize;
+
+  res = PQexec(pc->conn, TFS_WG_LOBLKSIZE);
+  if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+    blksize = (int32_t)atoi(PQgetvalue(res, 0, 0));
+  else
+    TFS_LOG(TFS_LOG_ERROR, "Reading the block size failed: %s",
+        PQresultErrorMessage(res));
+  PQclear(res);
+
+  if (blksize > 0)
+    __atomic_store_n(&lo_blksize, blksize, __ATOMIC_RELAXED);
+  return blksize > 0 ? blksize : 0;
+}
+
+/**
+ * Read a range of a large object by selecting the covering pages from
+ * pg_largeobject in a single query.
  *
- * TODO: should this reconnect be wrapped in a mutex?
+ * No transaction and no LO descriptor is involved, so a read costs one
+ * round trip regardless of its size. Missing pages are holes and read as
+ * zeros. Returns -EACCES if the user cannot select from pg_largeobject
+ * and -ENOTSUP if the pages are not laid out as expected.
  */
-static PGconn* get_pg_connection()
+static int read_pages(tfs_pg_conn_t * pc, const uint64_t loid, char * dst,
+    const size_t size, const off_t offset)
 {
-  // List all cases, figure out which need reconnection
-  switch( PQstatus(global_conn) )
-  {
-    case CONNECTION_BAD:
-      fprintf(stderr, "CONNECTION_BAD encountered: '%s'. Trying to reconnect.\n", PQerrorMessage(global_conn));
-      // overwrite the existing global (EEEEEK) connection
-      global_conn = connect_to_pg( pg_connection_data );
-      return global_conn;
-
-
-    case CONNECTION_NEEDED:
-      // Postgres 9 Docs is silent about this enum value. What does this state mean?
-      // TODO: is it safe to return conn here?
-      return global_conn;
-
-
-    case CONNECTION_SETENV:
-    case CONNECTION_AUTH_OK:
-    case CONNECTION_SSL_STARTUP:
-    case CONNECTION_MADE:
-    case CONNECTION_AWAITING_RESPONSE:
-    case CONNECTION_STARTED:
-    case CONNECTION_OK:
-    default:
-      return global_conn;
+  PGresult * res;
+  char loid_str[24], first_str[24], last_str[24];
+  const char * paramValues[3] = { loid_str, first_str, last_str };
+  int64_t first, last, page_off, end = offset;
+  int32_t blksize;
+  size_t from, to, len;
+  int i, ret;
+
+  if (size == 0)
+    return 0;
+
+  if ((blksize = get_lo_blksize(pc)) == 0)
+    return -ENOTSUP;
+
+  first = offset / blksize;
+  last = (offset + (off_t)size - 1) / blksize;
+  snprintf(loid_str, sizeof(loid_str), "%llu", (unsigned long long)loid);
+  snprintf(first_str, sizeof(first_str), "%lld", (long long)first);
+  snprintf(last_str, sizeof(last_str), "%lld", (long long)last);
+
+  res = exec_stmt(pc, TFS_WG_STMT_READ_PAGES, paramValues);
+
+  if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+    TFS_LOG(TFS_LOG_ERROR, "Reading pages of %s failed: %s", loid_str,
+        PQresultErrorMessage(res));
+    ret = strcmp(PQresultErrorField(res, PG_DIAG_SQLSTATE) ?
+        PQresultErrorField(res, PG_DIAG_SQLSTATE) : "", "42501") == 0 ?
+      -EACCES : -EIO;
+    PQclear(res);
+    return ret;
+  }
+
+  memset(dst, 0, size);
+
+  for (i = 0; i < PQntuples(res); i++) {
+    page_off = (int64_t)get_int4(res, i, 0) * blksize;
+    len = (size_t)PQgetlength(res, i, 1);
+    if (len > (size_t)blksize) {
+      TFS_LOG(TFS_LOG_ERROR, "Page of %s larger than %d bytes", loid_str,
+          (int)blksize);
+      PQclear(res);
+      return -ENOTSUP;
+    }
+    TFS_STATS_add(TFS_STATS_BYTES_FETCHED, len);
+
+    // intersect [page_off, page_off+len) with [offset, offset+size)
+    from = page_off > offset ? (size_t)(page_off - offset) : 0;
+    to = (size_t)(page_off + (int64_t)len - offset);
+    if (to > size)
+      to = size;
+    if (to > from)
+      memcpy(dst + from, PQgetvalue(res, i, 1) + (from + (size_t)offset -
+            (size_t)page_off), to - from);
+
+    if (page_off + (int64_t)len > end)
+      end = page_off + (int64_t)len;
   }
+  PQclear(res);
+
+  // the object ends at the end of its last page
+  if (end - offset > (int64_t)size)
+    return (int)size;
+  return (int)(end - offset);
 }
 
+static int get_chunks(const uint64_t loid, char * dst, const size_t size,
+    const off_t offset, const size_t chunk)
+{
+  tfs_pg_conn_t * pc;
+  tfs_pl_t pl;
+  PGresult * res;
+  char loid_str[24], off_str[24], len_str[24];
+  const char * paramValues[3] = { loid_str, off_str, len_str };
+  size_t done = 0, want, len;
+  int i, nreq, ret = 0, eof = 0;
+  uint64_t start;
+
+  nreq = (int)((size + chunk - 1) / chunk);
+  if (nreq > TFS_PL_MAX)
+    return -EINVAL;
 
-int TFS_WG_IO_operation(tfs_wg_operations_t op, const uint64_t loid,
+  if ((pc = TFS_PG_checkout_read()) == NULL)
+    return -EIO;
+
+  if (PQserverVersion(pc->conn) < 90400) {
+    TFS_PG_checkin(pc);
+    return -ENOSYS;
+  }
+
+  snprintf(loid_str, sizeof(loid_str), "%llu", (unsigned long long)loid);
+
+  start = TFS_STATS_now();
+  TFS_PL_begin(&pl, pc);
+  for (i = 0; i < nreq && ret == 0; i++) {
+    want = size - (size_t)i * chunk < chunk ? size - (size_t)i * chunk : chunk;
+    snprintf(off_str, sizeof(off_str), "%lld",
+        (long long)(offset + (off_t)((size_t)i * chunk)));
+    snprintf(len_str, sizeof(len_str), "%zu", want);
+    ret = TFS_PL_send(&pl, TFS_WG_LO_GET, 3, paramValues, 1);
+  }
+
+  // results come back in order: copy until the first short chunk
+  for (i = 0; ret == 0 && (res = TFS_PL_next(&pl)) != NULL; i++) {
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+      TFS_LOG(TFS_LOG_ERROR, "Reading %s failed: %s", loid_str,
+          PQresultErrorMessage(res));
+      ret = -EIO;
+    } else if (!eof) {
+      want = size - done < chunk ? size - done : chunk;
+      len = (size_t)PQgetlength(res, 0, 0);
+      if (len > want)
+        len = want;
+      memcpy(dst + done, PQgetvalue(res, 0, 0), len);
+      done += len;
+      eof = len < want;
+    }
+    PQclear(res);
+  }
+
+  TFS_PL_end(&pl);
+  TFS_STATS_record(TFS_STATS_SQL_LO_GET, start, ret);
+  if (ret < 0 && TFS_PG_lost(pc))
+    ret = TFS_WG_LOST;
+  TFS_PG_checkin(pc);
+
+  if (ret == 0)
+    TFS_STATS_add(TFS_STATS_BYTES_FETCHED, done);
+
+  return ret < 0 ? ret : (int)done;
+}
+
+int TFS_WG_read_chunks(const uint64_t loid, char * dst, const size_t size,
+    const off_t offset, const size_t chunk)
+{
+  tfs_fl_call_t call;
+  char key[TFS_FL_READ_KEY_LEN];
+  int ret;
+
+  // readers missing the same cache blocks at once fetch them only once
+  TFS_FL_read_key(key, "lo_get", loid, offset, size);
+  if (!TFS_FL_join(&call, key, dst, size, &ret))
+    return ret;
+
+  // once more on the next host if the connection was lost
+  if ((ret = get_chunks(loid, dst, size, offset, chunk)) == TFS_WG_LOST)
+    ret = get_chunks(loid, dst, size, offset, chunk);
+  if (ret == TFS_WG_LOST)
+    ret = -EIO;
+  TFS_FL_finish(&call, ret, dst, ret > 0 ? (size_t)ret : 0);
+  return ret;
+}
+
+static int fetch_digest(const uint64_t loid, char * digest)
+{
+  PGresult * res;
+  tfs_pg_conn_t * pc;
+  char loid_str[24];
+  const char * paramValues[1] = { loid_str };
+  const char * state;
+  int ret = 0;
+
+  snprintf(loid_str, sizeof(loid_str), "%llu", (unsigned long long)loid);
+
+  if ((pc = TFS_PG_checkout_read()) == NULL)
+    return -EIO;
+
+  res = exec_stmt(pc, TFS_WG_STMT_DIGEST, paramValues);
+
+  if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1 ||
+      PQgetlength(res, 0, 0) != TFS_WG_DIGEST_LEN) {
+    TFS_LOG(TFS_LOG_ERROR, "Digest of %s failed: %s", loid_str,
+        PQresultErrorMessage(res));
+    state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    ret = state != NULL && strcmp(state, "42501") == 0 ? -EACCES : -EIO;
+  } else {
+    memcpy(digest, PQgetvalue(res, 0, 0), TFS_WG_DIGEST_LEN);
+    digest[TFS_WG_DIGEST_LEN] = '\0';
+  }
+
+  PQclear(res);
+  if (ret < 0 && TFS_PG_lost(pc))
+    ret = TFS_WG_LOST;
+  TFS_PG_checkin(pc);
+  return ret;
+}
+
+int TFS_WG_digest(const uint64_t loid, char * digest)
+{
+  int ret;
+
+  // once more on the next host if the connection was lost
+  if ((ret = fetch_digest(loid, digest)) == TFS_WG_LOST)
+    ret = fetch_digest(loid, digest);
+  return ret == TFS_WG_LOST ? -EIO : ret;
+}
+
+/** Run one step of a copy, returns the result or NULL after logging */
+static PGresult * copy_step(PGconn * conn, const char * sql, int nparams,
+    const char * const * paramValues, int * ret)
+{
+  PGresult * res = PQexecParams(conn, sql, nparams, NULL, paramValues, NULL,
+      NULL, 0);
+  const char * state;
+
+  if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+    return res;
+
+  TFS_LOG(TFS_LOG_ERROR, "Server-side copy failed: %s",
+      PQresultErrorMessage(res));
+  state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+  *ret = state != NULL && strcmp(state, "42501") == 0 ? -EACCES : -EIO;
+  PQclear(res);
+  return NULL;
+}
+
+int TFS_WG_copy(const uint64_t src, const uint64_t dst)
+{
+  tfs_pg_conn_t * pc;
+  PGresult * res;
+  char src_str[24], dst_str[24], off_str[24], len_str[24];
+  const char * paramValues[4] = { src_str, dst_str, off_str, len_str };
+  int64_t offset = 0, len;
+  uint64_t start;
+  int ret = 0;
+
+  if (src == dst)
+    return 0;
+
+  if ((pc = TFS_PG_checkout()) == NULL)
+    return -EIO;
+
+  if (PQserverVersion(pc->conn) < 90400) {
+    TFS_PG_checkin(pc);
+    return -ENOSYS;
+  }
+
+  snprintf(src_str, sizeof(src_str), "%llu", (unsigned long long)src);
+  snprintf(dst_str, sizeof(dst_str), "%llu", (unsigned long long)dst);
+  snprintf(len_str, sizeof(len_str), "%d", TFS_WG_COPY_CHUNK);
+
+  start = TFS_STATS_now();
+  res = PQexec(pc->conn, "BEGIN");
+  PQclear(res);
+
+  // a shorter source must not leave the tail of the old content behind
+  if ((res = copy_step(pc->conn, TFS_WG_LO_EMPTY, 1, paramValues + 1,
+          &ret)) != NULL)
+    PQclear(res);
+
+  // a short chunk is the last one
+  do {
+    snprintf(off_str, sizeof(off_str), "%lld", (long long)offset);
+    if (ret != 0 || (res = copy_step(pc->conn, TFS_WG_LO_COPY, 4,
+            paramValues, &ret)) == NULL)
+      break;
+    len = TFS_PG_get_int8(res, 0, 0);
+    offset += len;
+    PQclear(res);
+  } while (len == TFS_WG_COPY_CHUNK);
+
+  if (ret == 0) {
+    res = PQexec(pc->conn, "COMMIT");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK ||
+        strcmp(PQcmdStatus(res), "ROLLBACK") == 0)
+      ret = -EIO;
+    PQclear(res);
+  }
+
+  // the pool rolls back what is left open on checkin
+  TFS_PG_checkin(pc);
+  if (ret == 0)
+    TFS_PG_wrote();
+
+  TFS_STATS_record(TFS_STATS_SQL_COPY, start, ret);
+  return ret;
+}
+
+static int lo_operation(tfs_wg_operations_t op, const uint64_t loid,
     const char * src, char * dst, const size_t size, const off_t offset)
 {
   PGresult *res;
+  PGconn *conn;
+  tfs_pg_conn_t *pc;
   int fd, ret = 0;
   int mode;
+  uint64_t start;
 
-  // get the connection via a reconnect-capable backer
-  PGconn* conn = get_pg_connection();
+  // every operation runs on its own pooled session, so reads from
+  // different threads no longer queue up behind each other. Writes
+  // have to go to the primary
+  if ( op == TFS_WG_READ )
+    pc = TFS_PG_checkout_read();
+  else
+    pc = TFS_PG_checkout();
+  if (pc == NULL)
+    return -EIO;
+  conn = pc->conn;
+
+  if ( op == TFS_WG_READ &&
+      TFS_WG_get_readmode() == TFS_WG_READMODE_PAGES ) {
+    ret = read_pages(pc, loid, dst, size, offset);
+
+    if ( ret != -EACCES && ret != -ENOTSUP ) {
+      if ( ret < 0 && TFS_PG_lost(pc) )
+        ret = TFS_WG_LOST;
+      TFS_PG_checkin(pc);
+      return ret;
+    }
 
+    // lo_read works with the privileges of the LO and knows the page
+    // layout, keep using that
+    TFS_LOG(TFS_LOG_WARN, "%s, falling back to readmode=lo",
+        ret == -EACCES ? "No access to pg_largeobject" :
+        "Unexpected pg_largeobject pages");
+    TFS_WG_set_readmode(TFS_WG_READMODE_LO);
+  }
 
   if ( op == TFS_WG_READ )
     mode = INV_READ;
@@ -158,16 +560,13 @@ int TFS_WG_IO_operation(tfs_wg_operations_t op, const uint64_t loid,
 
   // LO operations only supported within transactions
   // On our FS one read is one transaction
-  // While libpq is thread safe, still, we cannot have parallel
-  // transactions from multiple threads on the same connection
-  pthread_mutex_lock(&tfs_wg_transaction_block_mutex);
-
+  start = TFS_STATS_now();
   res = PQexec(conn, "BEGIN");
   PQclear(res);
 
   fd = lo_open(conn, (Oid)loid, mode);
 
-  fprintf(stderr, "TFS_WG_open: reading from fd %d (l:%lu:o:%tu)\n",
+  TFS_LOG(TFS_LOG_DEBUG, "TFS_WG_IO_operation: fd %d (l:%lu:o:%tu)",
       fd, size, offset);
 
 #ifdef HAVE_LO_LSEEK64
@@ -198,23 +597,189 @@ int TFS_WG_IO_operation(tfs_wg_operations_t op, const uint64_t loid,
   }
 
   res = PQexec(conn, "END");
-  pthread_mutex_unlock(&tfs_wg_transaction_block_mutex);
-
   PQclear(res);
 
+  TFS_STATS_record(TFS_STATS_SQL_LO_IO, start, ret);
+  if ( op == TFS_WG_READ && ret < 0 && TFS_PG_lost(pc) )
+    ret = TFS_WG_LOST;
+
+  TFS_PG_checkin(pc);
+  if ( op != TFS_WG_READ )
+    TFS_PG_wrote();
+
+  if ( op == TFS_WG_READ && ret > 0 )
+    TFS_STATS_add(TFS_STATS_BYTES_FETCHED, (uint64_t)ret);
+
+  return ret;
+}
+
+int TFS_WG_IO_operation(tfs_wg_operations_t op, const uint64_t loid,
+    const char * src, char * dst, const size_t size, const off_t offset)
+{
+  tfs_fl_call_t call;
+  char key[TFS_FL_READ_KEY_LEN];
+  int ret;
+
+  if ( op != TFS_WG_READ )
+    return lo_operation(op, loid, src, dst, size, offset);
+
+  // identical reads in flight wait for the first one and share its data
+  TFS_FL_read_key(key, "read", loid, offset, size);
+  if ( !TFS_FL_join(&call, key, dst, size, &ret) )
+    return ret;
+
+  // once more on the next host if the connection was lost
+  if ( (ret = lo_operation(op, loid, src, dst, size, offset)) == TFS_WG_LOST )
+    ret = lo_operation(op, loid, src, dst, size, offset);
+  if ( ret == TFS_WG_LOST )
+    ret = -EIO;
+  TFS_FL_finish(&call, ret, dst, ret > 0 ? (size_t)ret : 0);
   return ret;
 }
 
 
-int TFS_WG_open(const tfs_wg_node_t * node, int mode, uint64_t * fh)
+/** Fill the parts of the stat structure that only depend on the level */
+static void init_node_stat(tfs_wg_node_t * node)
 {
+  node->st.st_blksize = TFS_WG_BLOCKSIZE;
 
-  if (node->level != TFS_WG_FILE )
-    return -EISDIR;
-  else
-    *fh = node->loid;
+  // basic stat stuff: file type, nlinks, size of dirs
+  if ( node->level < TFS_WG_FILE) {
+    node->st.st_mode = S_IFDIR | 0555;   // read only
+    node->st.st_nlink = 2;
+    node->st.st_size = TFS_WG_BLOCKSIZE;
+    node->st.st_blocks = 1;
+  } else if (node->level == TFS_WG_FILE) {
+    node->st.st_mode = S_IFREG | 0444;   // read only
+    node->st.st_nlink = 1;
+  }
+}
 
-  return 0;
+/** Fill mtime, loid and size of node from a TFS_WG_LIST_* result row */
+static void fill_node_from_row(tfs_wg_node_t * node, const PGresult * res,
+    int row)
+{
+  node->st.st_mtime = (time_t)TFS_PG_get_int8(res, row, TFS_WG_QUERY_MTIME);
+
+  if ( node->level == TFS_WG_FILE ) {
+    node->loid = (uint64_t)TFS_PG_get_int8(res, row, TFS_WG_QUERY_CONTENT);
+    node->st.st_ino = (ino_t)node->loid;
+    node->st.st_size = (off_t)TFS_PG_get_int8(res, row, TFS_WG_QUERY_SIZE);
+    if ( node->st.st_size > 0 )
+      node->st.st_blocks = (int) node->st.st_size / TFS_WG_BLOCKSIZE + 1;
+  }
+}
+
+/** Fill mtime, loid and size of node from a namespace snapshot entry */
+static void fill_node_from_ns(tfs_wg_node_t * node, const tfs_ns_attr_t * attr)
+{
+  node->st.st_mtime = attr->mtime;
+
+  if ( node->level == TFS_WG_FILE ) {
+    node->loid = attr->loid;
+    node->st.st_ino = (ino_t)node->loid;
+    node->st.st_size = attr->size;
+    if ( node->st.st_size > 0 )
+      node->st.st_blocks = (int) node->st.st_size / TFS_WG_BLOCKSIZE + 1;
+  }
+}
+
+typedef struct {
+  tfs_wg_node_t child;
+  void * buffer;
+  tfs_wg_add_dir_t filler;
+  off_t pos;      // children visited so far
+  off_t start;    // first child passed to filler
+  int offsets;    // pass the offsets of TFS_WG_readdir_at to filler
+} tfs_wg_ns_readdir_t;
+
+static int ns_readdir_visit(void * ctx, const char * name,
+    const tfs_ns_attr_t * attr)
+{
+  tfs_wg_ns_readdir_t * rd = ctx;
+  off_t i = rd->pos++;
+
+  if (i < rd->start)
+    return 0;
+
+  memset(&rd->child.st, 0, sizeof(struct stat));
+  init_node_stat(&rd->child);
+  fill_node_from_ns(&rd->child, attr);
+
+  return rd->filler(rd->buffer, name, &rd->child.st,
+      rd->offsets ? TFS_WG_DIR_OFFSET(i) : 0);
+}
+
+/** Walk the children of node in the snapshot, from child start on */
+static int ns_readdir(const tfs_wg_node_t * node, off_t start, int offsets,
+    void * buffer, tfs_wg_add_dir_t filler)
+{
+  tfs_wg_ns_readdir_t rd;
+
+  memcpy(&rd.child, node, sizeof(tfs_wg_node_t));
+  rd.child.level = (tfs_wg_level_t)(node->level + 1);
+  rd.buffer = buffer;
+  rd.filler = filler;
+  rd.pos = 0;
+  rd.start = start;
+  rd.offsets = offsets;
+
+  return TFS_NS_readdir(node, ns_readdir_visit, &rd);
+}
+
+/** Build the mount-relative path of node, as TFS_WG_parse_path expects it */
+static void node_path(const tfs_wg_node_t * node, char * path, size_t len)
+{
+  switch (node->level) {
+    case TFS_WG_SITE:
+      snprintf(path, len, "/%s", node->site);
+      break;
+    case TFS_WG_PROJECT:
+      snprintf(path, len, "/%s/%s", node->site, node->project);
+      break;
+    case TFS_WG_FILE:
+      snprintf(path, len, "/%s/%s/%s", node->site, node->project, node->file);
+      break;
+    default:
+      snprintf(path, len, "/");
+      break;
+  }
+}
+
+/**
+ * Turn row of a TFS_WG_LIST_* result into child, whose level and parent
+ * names are already set. The listing already has everything a stat
+ * needs, so the child goes to the cache and the getattr calls following
+ * the readdir need no query. Returns the name of the child, or NULL if
+ * it is too long.
+ */
+static const char * row_child(PGresult * res, int row, tfs_wg_node_t * child)
+{
+  char * name = PQgetvalue(res, row, TFS_WG_QUERY_NAME);
+  char path[PATH_MAX];
+  size_t j, len = strlen( name );
+
+  for ( j = 0 ; j < len ; j++ )
+    if ( name[j] == '/' )
+      name[j] = '_';
+
+  if ( len > NAME_MAX )
+    return NULL;
+
+  memset(&child->st, 0, sizeof(struct stat));
+  child->loid = 0;
+  switch (child->level) {
+    case TFS_WG_SITE: strcpy(child->site, name); break;
+    case TFS_WG_PROJECT: strcpy(child->project, name); break;
+    default: strcpy(child->file, name); break;
+  }
+  init_node_stat(child);
+  fill_node_from_row(child, res, row);
+
+  node_path(child, path, sizeof(path));
+  TFS_CACHE_store(path, child, 0);
+
+  return name;
 }
 
 int TFS_WG_readdir(const tfs_wg_node_t * node, void * buffer,
@@ -222,42 +787,47 @@ int TFS_WG_readdir(const tfs_wg_node_t * node, void * buffer,
 {
   PGresult *res;
   int i, ret;
-  size_t j, len;
-  char * name;
+  const char * name;
   const char *paramValues[2] = { node->site, node->project };
+  PGconn *conn;
+  tfs_pg_conn_t *pc;
+  tfs_wg_node_t child;
 
-  // get the connection via a reconnect-capable backer
-  PGconn* conn = get_pg_connection();
+  // the snapshot already knows the whole tree
+  if ( TFS_NS_enabled() )
+    return ns_readdir(node, 0, 0, buffer, filler);
 
+  pc = TFS_PG_checkout_read();
+  if (pc == NULL)
+    return -EIO;
+  conn = pc->conn;
 
   switch(node->level)
   {
     case TFS_WG_ROOT:
-      res = PQexec(conn, TFS_WG_LIST_SITES);
+      res = exec_stmt(pc, TFS_WG_STMT_LIST_SITES, NULL);
       break;
 
     case TFS_WG_SITE:
-      res = PQexecParams(conn, TFS_WG_LIST_PROJECTS, 1, NULL, paramValues, NULL, NULL, 0);
+      res = exec_stmt(pc, TFS_WG_STMT_LIST_PROJECTS, paramValues);
       break;
 
 
     case TFS_WG_PROJECT:
-      res = PQexecParams(conn,
-          TFS_WG_LIST_WORKBOOKS " union all " TFS_WG_LIST_DATASOURCES,
-          2, NULL, paramValues, NULL, NULL, 0);
+      res = exec_stmt(pc, TFS_WG_STMT_LIST_FILES, paramValues);
       break;
 
     default:
       // make sure res is initialized, so the code is clean and we dont get a warning
       res = NULL;
-      fprintf(stderr, "Unknown node level found: %u\n", node->level);
+      TFS_LOG(TFS_LOG_ERROR, "Unknown node level found: %u", node->level);
       break;
 
   }
 
   if (PQresultStatus(res) != PGRES_TUPLES_OK)
   {
-    fprintf(stderr, "SELECT entries failed: %s", PQerrorMessage(conn));
+    TFS_LOG(TFS_LOG_ERROR, "SELECT entries failed: %s", PQerrorMessage(conn));
     // TODO: error handling
     ret = -EIO;
   } else if (PQntuples(res) == 0 ) {
@@ -265,65 +835,414 @@ int TFS_WG_readdir(const tfs_wg_node_t * node, void * buffer,
   } else {
     // return a zero as the universal OK sign
     ret = 0;
-    for (i = 0; i < PQntuples(res); i++) {
-      name = PQgetvalue(res, i, TFS_WG_QUERY_NAME);
-      len = strlen( name );
 
-      for ( j = 0 ; j < len ; j++ )
-        if ( name[j] == '/' )
-          name[j] = '_';
+    memcpy(&child, node, sizeof(tfs_wg_node_t));
+    child.level = (tfs_wg_level_t)(node->level + 1);
 
-      filler(buffer, name, NULL, 0);
+    for (i = 0; i < PQntuples(res); i++) {
+      if ( (name = row_child(res, i, &child)) == NULL )
+        continue;
+
+      if ( filler(buffer, name, &child.st, 0) != 0 )
+        break;
     }
   }
 
   PQclear(res);
+  TFS_PG_checkin(pc);
 
   return ret;
 }
 
-int TFS_WG_stat_file(tfs_wg_node_t * node)
+/** Rows fetched from a directory cursor at a time */
+#define TFS_WG_DIR_BATCH 256
+#define TFS_WG_DIR_BATCH_SQL "256"
+
+/**
+ * Listings are ordered by name, so a cursor declared again continues
+ * after the last name taken instead of skipping rows on the server
+ */
+#define TFS_WG_ORDERED( sql ) \
+  "select * from (" sql ") tfs_list(tfs_key) order by tfs_key"
+
+#define TFS_WG_ORDERED_AFTER( sql, key ) \
+  "select * from (" sql ") tfs_list(tfs_key) where tfs_key > $" #key \
+  " order by tfs_key"
+
+#define TFS_WG_DECLARE( sql ) \
+  "declare tfs_dir binary no scroll cursor for " TFS_WG_ORDERED(sql)
+
+#define TFS_WG_DECLARE_AFTER( sql, key ) \
+  "declare tfs_dir binary no scroll cursor for " TFS_WG_ORDERED_AFTER(sql, key)
+
+/** One batch without a cursor, for when no connection can be kept */
+#define TFS_WG_PAGE_AFTER( sql, key ) \
+  TFS_WG_ORDERED_AFTER(sql, key) " limit " TFS_WG_DIR_BATCH_SQL
+
+#define TFS_WG_LIST_FILES \
+  TFS_WG_LIST_WORKBOOKS " union all " TFS_WG_LIST_DATASOURCES
+
+/** The listing cursors, by the level of the listed directory */
+static const struct {
+  const char * sql;
+  const char * sql_after;      // continue after the name in the last param
+  const char * page_after;     // one batch after the name in the last param
+  int nparams;
+  tfs_stats_metric_t metric;
+} cursors[] = {
+  { TFS_WG_DECLARE(TFS_WG_LIST_SITES),
+    TFS_WG_DECLARE_AFTER(TFS_WG_LIST_SITES, 1),
+    TFS_WG_PAGE_AFTER(TFS_WG_LIST_SITES, 1), 0,
+    TFS_STATS_SQL_LIST_SITES },
+  { TFS_WG_DECLARE(TFS_WG_LIST_PROJECTS),
+    TFS_WG_DECLARE_AFTER(TFS_WG_LIST_PROJECTS, 2),
+    TFS_WG_PAGE_AFTER(TFS_WG_LIST_PROJECTS, 2), 1,
+    TFS_STATS_SQL_LIST_PROJECTS },
+  { TFS_WG_DECLARE(TFS_WG_LIST_FILES),
+    TFS_WG_DECLARE_AFTER(TFS_WG_LIST_FILES, 3),
+    TFS_WG_PAGE_AFTER(TFS_WG_LIST_FILES, 3), 2,
+    TFS_STATS_SQL_LIST_FILES },
+};
+
+/** State behind the handle of an open directory */
+typedef struct tfs_wg_dir_t {
+  tfs_wg_node_t node;          // the listed directory
+  tfs_pg_conn_t * pc;          // connection of the cursor, NULL if closed
+  int done;                    // the cursor reached the end
+  off_t cursor;                // rows taken from the cursor so far
+  char * key;                  // name of the last row taken, as selected
+  PGresult * res;              // the last fetched batch
+  off_t first;                 // position of the first row of res
+  time_t last_used;            // last readdir on the handle
+  pthread_mutex_t mutex;       // serializes the readdirs of the handle
+  struct tfs_wg_dir_t * prev;  // list of open directories
+  struct tfs_wg_dir_t * next;
+} tfs_wg_dir_t;
+
+/** Open directories, walked by the idle reaper */
+static tfs_wg_dir_t * open_dirs;
+static pthread_mutex_t open_dirs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** End the transaction of a cursor and give back its connection */
+static void end_cursor(tfs_pg_conn_t * pc)
 {
-  const char *paramValues[3] = { node->site, node->project, node->file };
+  PGresult * res = PQexec(pc->conn, "END");
+
+  PQclear(res);
+  TFS_PG_checkin(pc);
+}
+
+static void close_cursor(tfs_wg_dir_t * d)
+{
+  if (d->pc == NULL)
+    return;
+
+  end_cursor(d->pc);
+  d->pc = NULL;
+}
+
+/**
+ * Declare the listing cursor of d, after the last row taken if any.
+ *
+ * The connection is kept until the listing is read to its end, the
+ * handle is released or the idle reaper takes it back. Returns -EBUSY
+ * if no connection can be spared for that.
+ */
+static int open_cursor(tfs_wg_dir_t * d)
+{
+  const char * paramValues[3] = { d->node.site, d->node.project, NULL };
+  int nparams = cursors[d->node.level].nparams;
   PGresult * res;
+  uint64_t start = TFS_STATS_now();
+  int ret = 0;
+
+  if ((d->pc = TFS_PG_try_checkout_read()) == NULL)
+    return -EBUSY;
+
+  res = PQexec(d->pc->conn, "BEGIN");
+  PQclear(res);
+
+  if (d->key != NULL) {
+    // the key goes after the parameters of the listing
+    paramValues[nparams] = d->key;
+    res = PQexecParams(d->pc->conn, cursors[d->node.level].sql_after,
+        nparams + 1, NULL, paramValues, NULL, NULL, 0);
+  } else {
+    res = PQexecParams(d->pc->conn, cursors[d->node.level].sql, nparams,
+        NULL, paramValues, NULL, NULL, 0);
+  }
+  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    TFS_LOG(TFS_LOG_ERROR, "Declaring the listing cursor failed: %s",
+        PQresultErrorMessage(res));
+    ret = -EIO;
+  }
+  PQclear(res);
+
+  TFS_STATS_record(cursors[d->node.level].metric, start, ret);
+
+  if (ret != 0)
+    close_cursor(d);
+  return ret;
+}
+
+/** Take the batch of rows in d->res. Returns their number */
+static int take_rows(tfs_wg_dir_t * d, uint64_t start)
+{
+  char * key;
+  int n;
+
+  if (PQresultStatus(d->res) != PGRES_TUPLES_OK) {
+    TFS_LOG(TFS_LOG_ERROR, "Fetching the listing failed: %s",
+        PQresultErrorMessage(d->res));
+    TFS_STATS_record(cursors[d->node.level].metric, start, -EIO);
+    PQclear(d->res);
+    d->res = NULL;
+    close_cursor(d);
+    return -EIO;
+  }
+
+  n = PQntuples(d->res);
+
+  // row_child rewrites the names in place, keep the key as selected
+  if (n > 0) {
+    if ((key = strdup(PQgetvalue(d->res, n - 1, TFS_WG_QUERY_NAME))) == NULL) {
+      TFS_STATS_record(cursors[d->node.level].metric, start, -ENOMEM);
+      PQclear(d->res);
+      d->res = NULL;
+      close_cursor(d);
+      return -ENOMEM;
+    }
+    free(d->key);
+    d->key = key;
+  }
+
+  d->first = d->cursor;
+  d->cursor += n;
+  TFS_STATS_record(cursors[d->node.level].metric, start, 0);
+
+  // the last batch stays in memory, the connection is not needed anymore
+  if (n < TFS_WG_DIR_BATCH) {
+    d->done = 1;
+    close_cursor(d);
+  }
+
+  return n;
+}
+
+/** Fetch the next batch of rows from the cursor. Returns their number */
+static int fetch_rows(tfs_wg_dir_t * d)
+{
+  uint64_t start = TFS_STATS_now();
+  char fetch[64];
+
+  snprintf(fetch, sizeof(fetch), "fetch forward %d from tfs_dir",
+      TFS_WG_DIR_BATCH);
+  PQclear(d->res);
+  d->res = PQexec(d->pc->conn, fetch);
+
+  return take_rows(d, start);
+}
+
+/**
+ * Fetch the next batch of rows in a single query, on a connection given
+ * back right away. Returns their number.
+ */
+static int fetch_page(tfs_wg_dir_t * d)
+{
+  const char * paramValues[3] = { d->node.site, d->node.project, NULL };
+  int nparams = cursors[d->node.level].nparams;
+  uint64_t start = TFS_STATS_now();
+  tfs_pg_conn_t * pc;
+
+  if ((pc = TFS_PG_checkout_read()) == NULL)
+    return -EIO;
+
+  // names are never empty, so the first batch comes after ''
+  paramValues[nparams] = d->key != NULL ? d->key : "";
+  PQclear(d->res);
+  d->res = PQexecParams(pc->conn, cursors[d->node.level].page_after,
+      nparams + 1, NULL, paramValues, NULL, NULL, 1);
+  TFS_PG_checkin(pc);
+
+  return take_rows(d, start);
+}
+
+/** Returns non-zero if row i of the listing is in the fetched batch */
+static int in_batch(const tfs_wg_dir_t * d, off_t i)
+{
+  return d->res != NULL && i >= d->first &&
+    i < d->first + PQntuples(d->res);
+}
+
+/**
+ * Fetch the batch holding row i of the listing. A seek back starts the
+ * listing over, a closed cursor is declared again after the last row
+ * taken. Returns 1 if row i exists, 0 past the end.
+ */
+static int seek_row(tfs_wg_dir_t * d, off_t i)
+{
   int ret;
 
-  // get the connection via a reconnect-capable backer
-  PGconn* conn = get_pg_connection();
+  if (i < d->cursor) {
+    close_cursor(d);
+    PQclear(d->res);
+    d->res = NULL;
+    free(d->key);
+    d->key = NULL;
+    d->cursor = 0;
+    d->done = 0;
+  }
 
-  node->st.st_blksize = TFS_WG_BLOCKSIZE;
+  while (!in_batch(d, i)) {
+    if (d->done)
+      return 0;
+    if (d->pc == NULL && (ret = open_cursor(d)) != 0 && ret != -EBUSY)
+      return ret;
+    // the pool has no connection to spare for the whole listing
+    if ((ret = d->pc != NULL ? fetch_rows(d) : fetch_page(d)) < 0)
+      return ret;
+  }
 
-  // basic stat stuff: file type, nlinks, size of dirs
-  if ( node->level < TFS_WG_FILE) {
-    node->st.st_mode = S_IFDIR | 0555;   // read only
-    node->st.st_nlink = 2;
-    node->st.st_size = TFS_WG_BLOCKSIZE;
-    node->st.st_blocks = 1;
-  } else if (node->level == TFS_WG_FILE) {
-    node->st.st_mode = S_IFREG | 0444;   // read only
-    node->st.st_nlink = 1;
+  return 1;
+}
+
+int TFS_WG_opendir(const tfs_wg_node_t * node, uint64_t * dh)
+{
+  tfs_wg_dir_t * d;
+
+  if (node->level == TFS_WG_FILE)
+    return -ENOTDIR;
+
+  if ((d = calloc(1, sizeof(tfs_wg_dir_t))) == NULL)
+    return -ENOMEM;
+
+  memcpy(&d->node, node, sizeof(tfs_wg_node_t));
+  d->last_used = time(NULL);
+  pthread_mutex_init(&d->mutex, NULL);
+
+  pthread_mutex_lock(&open_dirs_mutex);
+  d->next = open_dirs;
+  if (open_dirs)
+    open_dirs->prev = d;
+  open_dirs = d;
+  pthread_mutex_unlock(&open_dirs_mutex);
+
+  *dh = (uint64_t)(uintptr_t)d;
+  return 0;
+}
+
+int TFS_WG_readdir_at(uint64_t dh, off_t off, void * buffer,
+    tfs_wg_add_dir_t filler)
+{
+  tfs_wg_dir_t * d = (tfs_wg_dir_t *)(uintptr_t)dh;
+  tfs_wg_node_t child;
+  const char * name;
+  off_t i;
+  int ret = 0;
+
+  if (off < 0)
+    return -EINVAL;
+
+  // . and .. take the first two positions
+  for (; off < 2; off++)
+    if (filler(buffer, off == 0 ? "." : "..", NULL, off + 1) != 0)
+      return 0;
+
+  if ( TFS_NS_enabled() )
+    return ns_readdir(&d->node, off - 2, 1, buffer, filler);
+
+  pthread_mutex_lock(&d->mutex);
+  d->last_used = time(NULL);
+
+  memcpy(&child, &d->node, sizeof(tfs_wg_node_t));
+  child.level = (tfs_wg_level_t)(d->node.level + 1);
+
+  for (i = off - 2; ; i++) {
+    // sequential readdirs continue the cursor
+    if (!in_batch(d, i) && (ret = seek_row(d, i)) <= 0)
+      break;
+
+    if ((name = row_child(d->res, (int)(i - d->first), &child)) == NULL)
+      continue;
+
+    if (filler(buffer, name, &child.st, TFS_WG_DIR_OFFSET(i)) != 0)
+      break;
+  }
+
+  pthread_mutex_unlock(&d->mutex);
+  return ret < 0 ? ret : 0;
+}
+
+int TFS_WG_releasedir(uint64_t dh)
+{
+  tfs_wg_dir_t * d = (tfs_wg_dir_t *)(uintptr_t)dh;
+
+  pthread_mutex_lock(&open_dirs_mutex);
+  if (d->prev) d->prev->next = d->next; else open_dirs = d->next;
+  if (d->next) d->next->prev = d->prev;
+  pthread_mutex_unlock(&open_dirs_mutex);
+
+  close_cursor(d);
+  PQclear(d->res);
+  free(d->key);
+  pthread_mutex_destroy(&d->mutex);
+  free(d);
+
+  return 0;
+}
+
+void TFS_WG_reap_dirs(time_t now, unsigned int timeout)
+{
+  tfs_pg_conn_t * pcs[TFS_WG_REAP_BATCH];
+  tfs_wg_dir_t * d;
+  size_t i, n = 0;
+
+  // as for file handles, give the connections back after unlocking
+  pthread_mutex_lock(&open_dirs_mutex);
+  for (d = open_dirs; d != NULL && n < TFS_WG_REAP_BATCH; d = d->next) {
+    if (pthread_mutex_trylock(&d->mutex) != 0)
+      continue;
+
+    // the position is kept, the next readdir continues after the key
+    if (d->pc != NULL && now - d->last_used >= (time_t)timeout) {
+      pcs[n++] = d->pc;
+      d->pc = NULL;
+    }
+
+    pthread_mutex_unlock(&d->mutex);
   }
+  pthread_mutex_unlock(&open_dirs_mutex);
+
+  for (i = 0; i < n; i++)
+    end_cursor(pcs[i]);
+}
+
+static int stat_node(tfs_wg_node_t * node)
+{
+  const char *paramValues[3] = { node->site, node->project, node->file };
+  PGresult * res;
+  PGconn *conn;
+  tfs_pg_conn_t *pc;
+  int ret;
+
+  init_node_stat(node);
 
   if (node->level == TFS_WG_ROOT) {
     time(&(node->st.st_mtime));
     return 0;
-  } else if (node->level == TFS_WG_SITE) {
+  }
 
-    res = PQexecParams(conn, TFS_WG_LIST_SITES " and c.name = $1", 1, NULL,
-        paramValues, NULL, NULL, 0);
+  pc = TFS_PG_checkout_read();
+  if (pc == NULL)
+    return -EIO;
+  conn = pc->conn;
 
+  if (node->level == TFS_WG_SITE) {
+    res = exec_stmt(pc, TFS_WG_STMT_STAT_SITE, paramValues);
   } else if (node->level ==  TFS_WG_PROJECT) {
-
-    res = PQexecParams(conn, TFS_WG_LIST_PROJECTS " and c.name = $2",
-        2, NULL, paramValues, NULL, NULL, 0);
-
+    res = exec_stmt(pc, TFS_WG_STMT_STAT_PROJECT, paramValues);
   } else if (node->level == TFS_WG_FILE) {
-
-    res = PQexecParams(conn,
-        TFS_WG_LIST_WORKBOOKS " and $3 IN (" TFS_WG_NAMES_WITHOUT_SLASH(twb) ") "
-        "union all "
-        TFS_WG_LIST_DATASOURCES " and $3 IN (" TFS_WG_NAMES_WITHOUT_SLASH(tds) ") ",
-        3, NULL, paramValues, NULL, NULL, 0);
+    res = exec_stmt(pc, TFS_WG_STMT_STAT_FILE, paramValues);
   } else {
     // res defaults to NULL
     res = NULL;
@@ -331,28 +1250,82 @@ int TFS_WG_stat_file(tfs_wg_node_t * node)
 
   if (PQresultStatus(res) != PGRES_TUPLES_OK)
   {
-    fprintf(stderr, "SELECT entries failed: %s/%s", PQresultErrorMessage(res), PQerrorMessage(conn));
+    TFS_LOG(TFS_LOG_ERROR, "SELECT entries failed: %s/%s", PQresultErrorMessage(res), PQerrorMessage(conn));
     // TODO: error handling
     ret = -EINVAL;
   } else if (PQntuples(res) == 0 ) {
     ret =  -ENOENT;
   } else {
-    node->st.st_mtime = atoll( PQgetvalue(res, 0, TFS_WG_QUERY_MTIME) );
-
-    if ( node->level == TFS_WG_FILE ) {
-      node->loid = (uint64_t)atoll( PQgetvalue(res, 0, TFS_WG_QUERY_CONTENT) );
-      node->st.st_size = atoll( PQgetvalue(res, 0, TFS_WG_QUERY_SIZE) );
-      if ( node->st.st_size > 0 )
-        node->st.st_blocks = (int) node->st.st_size / TFS_WG_BLOCKSIZE + 1;
-    }
-
+    fill_node_from_row(node, res, 0);
     ret = 0;
   }
 
   PQclear(res);
+  if (ret < 0 && ret != -ENOENT && TFS_PG_lost(pc))
+    ret = TFS_WG_LOST;
+  TFS_PG_checkin(pc);
+  return ret;
+}
+
+int TFS_WG_stat_file(tfs_wg_node_t * node)
+{
+  tfs_fl_call_t call;
+  char key[3 * NAME_MAX + 16];
+  int ret;
+
+  if (node->level == TFS_WG_ROOT)
+    return stat_node(node);
+
+  // a burst of lookups of the same path asks the repository once
+  snprintf(key, sizeof(key), "stat/%d/%s/%s/%s", (int)node->level,
+      node->site, node->project, node->file);
+  if (!TFS_FL_join(&call, key, node, sizeof(tfs_wg_node_t), &ret))
+    return ret;
+
+  // once more on the next host if the connection was lost
+  if ((ret = stat_node(node)) == TFS_WG_LOST)
+    ret = stat_node(node);
+  if (ret == TFS_WG_LOST)
+    ret = -EIO;
+  TFS_FL_finish(&call, ret, node, ret == 0 ? sizeof(tfs_wg_node_t) : 0);
   return ret;
 }
 
+/** Check whether name ends with one of the extensions TFS_WG_LIST_FILE produces */
+static int has_tableau_extension(const char * name)
+{
+  static const char * exts[] = { ".twb", ".twbx", ".tds", ".tdsx" };
+  size_t i, len = strlen(name), elen;
+
+  for ( i = 0; i < sizeof(exts) / sizeof(exts[0]); i++ ) {
+    elen = strlen(exts[i]);
+    if ( len > elen && strcmp(name + len - elen, exts[i]) == 0 )
+      return 1;
+  }
+
+  return 0;
+}
+
+int TFS_WG_resolve(tfs_wg_node_t * node)
+{
+  int ret;
+  tfs_ns_attr_t attr;
+
+  // desktop.ini, .DS_Store, ._* and friends can never be a workbook
+  // or a datasource, no need to ask the repository about them
+  if ( node->level == TFS_WG_FILE && !has_tableau_extension(node->file) )
+    return -ENOENT;
+
+  if ( TFS_NS_enabled() && node->level != TFS_WG_ROOT ) {
+    init_node_stat(node);
+    if ( (ret = TFS_NS_lookup(node, &attr)) == 0 )
+      fill_node_from_ns(node, &attr);
+    return ret;
+  }
+
+  return TFS_WG_stat_file(node);
+}
+
 int TFS_WG_parse_path(const char * path, tfs_wg_node_t * node)
 {
   int ret;
@@ -376,32 +1349,29 @@ int TFS_WG_parse_path(const char * path, tfs_wg_node_t * node)
     return -EINVAL;
   } else {
 
-    fprintf(stderr, "TFS_WG_parse_path: site: %s proj: %s file: %s\n",
+    TFS_LOG(TFS_LOG_DEBUG, "TFS_WG_parse_path: site: %s proj: %s file: %s",
         node->site, node->project, node->file);
 
     // cast so the signed conversion warning goes away
     node->level = (tfs_wg_level_t)ret;
 
-    // get stat from node
-    ret = TFS_WG_stat_file(node);
+    // the snapshot is faster than the path cache
+    if ( TFS_NS_enabled() || (node->level == TFS_WG_FILE &&
+          !has_tableau_extension(node->file)) )
+      return TFS_WG_resolve(node);
+
+    ret = TFS_CACHE_lookup(path, node);
+    if ( ret != 0 )
+      return ret < 0 ? ret : 0;
+
+    ret = TFS_WG_resolve(node);
+    TFS_CACHE_store(path, node, ret);
 
     return ret;
   }
 }
 
-int TFS_WG_connect_db(const char * pghost, const char * pgport,
-    const char * login, const char * pwd)
+int TFS_WG_connect_db(const struct tableau_cmdargs * args)
 {
-  // save the connection data to the global (eeeeek) state.
-  struct tableau_cmdargs conn_data = {pghost, pgport, login, pwd};
-  /*struct tableau_cmdargs conn_data = {(char*)pghost, (char*)pgport, (char*)login, (char*)pwd};*/
-  pg_connection_data = conn_data;
-
-  // Set up the connection
-  global_conn = connect_to_pg( conn_data );
-
-  // return based on whether we have the connection
-  if (global_conn == NULL) return -1;
-  return 0;
+  return TFS_PG_pool_init(args);
 }
-
@@ -26,7 +26,11 @@
 #include <stdint.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include "readahead.h"
+#include "writeback.h"
 
 typedef enum
 {
@@ -35,6 +39,12 @@ typedef enum
   TFS_WG_TRUNCATE = 2
 } tfs_wg_operations_t;
 
+typedef enum
+{
+  TFS_WG_READMODE_LO = 0,    // lo_open/lo_lseek/lo_read in a transaction
+  TFS_WG_READMODE_PAGES = 1  // select the pages from pg_largeobject
+} tfs_wg_readmode_t;
+
 typedef enum
 {
   TFS_WG_ROOT = 0,
@@ -59,23 +69,168 @@ typedef enum {
   TFS_WG_QUERY_SIZE = 3
 } tfs_wg_list_query_cols_t;
 
+/** Default idle time (sec) after which an open file gives back its connection */
+#define TFS_WG_DEFAULT_IDLE_TIMEOUT 5
+
+/** Connections of open files and directories reaped per pass at most */
+#define TFS_WG_REAP_BATCH 64
+
+struct tfs_pg_conn_t;
+
+/** State behind a FUSE file handle of a workbook or datasource */
+typedef struct tfs_wg_handle_t {
+  uint64_t loid;               // repo id of the file
+  time_t mtime;                // mtime of the file at open
+  int mode;                    // INV_READ or INV_READ|INV_WRITE
+  struct tfs_pg_conn_t * pc;   // bound connection, NULL while detached
+  int fd;                      // LO descriptor inside the bound transaction
+  off_t pos;                   // current position of fd
+  time_t last_used;            // last I/O on the handle
+  pthread_mutex_t mutex;       // serializes I/O on the handle
+  tfs_ra_state_t ra;           // sequential readahead of read-only handles
+  tfs_wb_t wb;                 // uncommitted writes of write handles
+  struct tfs_wg_handle_t * prev;  // list of open handles
+  struct tfs_wg_handle_t * next;
+} tfs_wg_handle_t;
+
 typedef int(* tfs_wg_add_dir_t )(void *buf, const char *name,
     const struct stat *stbuf, off_t off);
 
 extern int TFS_WG_IO_operation(tfs_wg_operations_t op, const uint64_t loid,
     const char * src, char * dst, const size_t size, const off_t offset);
 
+/**
+ * Read size bytes at offset with one lo_get request per chunk bytes, all
+ * sent in a single pipeline. At most TFS_PL_MAX chunks.
+ *
+ * Returns the bytes read, -EIO on any failure or -ENOSYS if the server
+ * has no lo_get.
+ */
+extern int TFS_WG_read_chunks(const uint64_t loid, char * dst,
+    const size_t size, const off_t offset, const size_t chunk);
+
+/** Length of a content digest in hex, without the terminating zero */
+#define TFS_WG_DIGEST_LEN 32
+
+/**
+ * Compute the content digest of loid on the server: the md5 of the hex
+ * md5 of every pg_largeobject page, in page order. Needs select on
+ * pg_largeobject, returns -EACCES without it. digest has to hold
+ * TFS_WG_DIGEST_LEN + 1 bytes.
+ */
+extern int TFS_WG_digest(const uint64_t loid, char * digest);
+
+/**
+ * Replace the content of the large object dst with the content of src,
+ * in one transaction on the server: the data never leaves the database
+ * host. Needs a 9.4+ server (-ENOSYS) and write access to dst
+ * (-EACCES).
+ */
+extern int TFS_WG_copy(const uint64_t src, const uint64_t dst);
+
+extern void TFS_WG_set_readmode(tfs_wg_readmode_t mode);
+
+extern tfs_wg_readmode_t TFS_WG_get_readmode();
+
 extern int TFS_WG_modife(const uint64_t fd, char * buf, const size_t size,
     const off_t offset, tfs_wg_operations_t op);
 
 extern int TFS_WG_open(const tfs_wg_node_t * node, int mode, uint64_t * fh);
 
+/**
+ * Returns non-zero if node has the same mtime and size as at its last
+ * open, i.e. pages the kernel cached back then are still valid.
+ */
+extern int TFS_WG_keep_cache(const tfs_wg_node_t * node);
+
+/**
+ * Make the next open of loid drop the pages the kernel cached, for
+ * content replaced without a new mtime or size.
+ */
+extern void TFS_WG_forget_cache(uint64_t loid);
+
+extern int TFS_WG_read(uint64_t fh, char * buf, size_t size, off_t offset);
+
+/** A piece of file content inside a block cache file */
+typedef struct tfs_wg_extent_t {
+  int fd;       // open block file, closed by the caller
+  off_t pos;    // offset of the piece in the block file
+  size_t len;
+} tfs_wg_extent_t;
+
+/**
+ * Map size bytes at offset of a read-only handle to at most max pieces
+ * of block cache files, fetching the missing blocks into the cache
+ * first. The content can then be spliced to the reader without copying
+ * it. Returns the number of pieces, short at the end of the file, or
+ * -ENOTSUP without a block cache; callers use TFS_WG_read then.
+ */
+extern int TFS_WG_read_extents(uint64_t fh, size_t size, off_t offset,
+    tfs_wg_extent_t * ext, int max);
+
+extern int TFS_WG_write(uint64_t fh, const char * buf, size_t size,
+    off_t offset);
+
+extern int TFS_WG_ftruncate(uint64_t fh, off_t size);
+
+/** Size of the open file: size, or the buffered size for write handles */
+extern off_t TFS_WG_size(uint64_t fh, off_t size);
+
+extern int TFS_WG_flush(uint64_t fh);
+
+/**
+ * Returns non-zero if a handle holds uncommitted writes to loid: its
+ * next flush would overwrite whatever else replaces the content.
+ */
+extern int TFS_WG_dirty(uint64_t loid);
+
+extern int TFS_WG_release(uint64_t fh);
+
+extern int TFS_WG_start_handles(unsigned int idle_timeout);
+
+extern int TFS_WG_start_workers();
+
+/**
+ * Call filler for every child of node. The st_ino of the listed files
+ * is their loid.
+ */
 extern int TFS_WG_readdir(const tfs_wg_node_t * node, void * buffer,
     tfs_wg_add_dir_t filler);
 
-extern int TFS_WG_connect_db(const char * pghost, const char * pgport,
-    const char * login, const char * pwd);
+/** Offset of the i-th child in a TFS_WG_readdir_at listing, after . and .. */
+#define TFS_WG_DIR_OFFSET( i ) ((off_t)(i) + 3)
+
+/**
+ * Open a directory for TFS_WG_readdir_at. The listing is read through
+ * a server-side cursor in small batches, so memory use does not grow
+ * with the size of the directory.
+ */
+extern int TFS_WG_opendir(const tfs_wg_node_t * node, uint64_t * dh);
+
+/**
+ * Call filler with ., .. and the children of the directory, starting at
+ * the entry following offset off, until filler returns non-zero. Every
+ * entry is passed with its own offset, so the listing can be continued
+ * from any of them.
+ */
+extern int TFS_WG_readdir_at(uint64_t dh, off_t off, void * buffer,
+    tfs_wg_add_dir_t filler);
+
+extern int TFS_WG_releasedir(uint64_t dh);
+
+/** Give back the connections of directories not read for timeout sec */
+extern void TFS_WG_reap_dirs(time_t now, unsigned int timeout);
+
+struct tableau_cmdargs;
+
+extern int TFS_WG_connect_db(const struct tableau_cmdargs * args);
 
 extern int TFS_WG_parse_path(const char * path, tfs_wg_node_t * node);
 
+/**
+ * Fill loid and stat of a node whose level and names are already set,
+ * from the snapshot or the repository. Uses no path cache.
+ */
+extern int TFS_WG_resolve(tfs_wg_node_t * node);
+
 #endif /* tableaufs_workgroup_h */
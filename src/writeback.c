@@ -0,0 +1,330 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "writeback.h"
+#include "log.h"
+#include "pgpool.h"
+#include "stats.h"
+#include "libpq-fe.h"
+#include "libpq/libpq-fs.h"
+
+void TFS_WB_init(tfs_wb_t * wb, off_t size)
+{
+  memset(wb, 0, sizeof(tfs_wb_t));
+  wb->base_size = size;
+  wb->size = size;
+}
+
+/** Move the buffered bytes from memory to a temp file */
+static int spill(tfs_wb_t * wb)
+{
+  if ((wb->spill = tmpfile()) == NULL)
+    return -errno;
+
+  if (wb->mem_len > 0 &&
+      pwrite(fileno(wb->spill), wb->mem, wb->mem_len, 0) !=
+      (ssize_t)wb->mem_len) {
+    fclose(wb->spill);
+    wb->spill = NULL;
+    return -EIO;
+  }
+
+  free(wb->mem);
+  wb->mem = NULL;
+  wb->mem_len = 0;
+  return 0;
+}
+
+/** Store bytes at their file offset */
+static int store(tfs_wb_t * wb, const char * buf, size_t size, off_t offset)
+{
+  size_t end = (size_t)offset + size;
+  char * mem;
+  int ret;
+
+  if (wb->spill == NULL && end > TFS_WB_MEM_MAX && (ret = spill(wb)) != 0)
+    return ret;
+
+  if (wb->spill != NULL)
+    return pwrite(fileno(wb->spill), buf, size, offset) == (ssize_t)size ?
+      0 : -EIO;
+
+  if (end > wb->mem_len) {
+    if ((mem = realloc(wb->mem, end)) == NULL)
+      return -ENOMEM;
+    // keep the gap defined, it may end up in an extent later
+    memset(mem + wb->mem_len, 0, end - wb->mem_len);
+    wb->mem = mem;
+    wb->mem_len = end;
+  }
+
+  memcpy(wb->mem + offset, buf, size);
+  return 0;
+}
+
+/** Read bytes stored at their file offset */
+static int load(const tfs_wb_t * wb, char * buf, size_t size, off_t offset)
+{
+  if (wb->spill != NULL)
+    return pread(fileno(wb->spill), buf, size, offset) == (ssize_t)size ?
+      0 : -EIO;
+
+  memcpy(buf, wb->mem + offset, size);
+  return 0;
+}
+
+/** Add [start, end) to the extents, merging touching ranges */
+static int add_extent(tfs_wb_t * wb, off_t start, off_t end)
+{
+  tfs_wb_extent_t ** ep = &wb->extents, * e, * n;
+
+  while (*ep != NULL && (*ep)->end < start)
+    ep = &(*ep)->next;
+
+  if (*ep == NULL || (*ep)->start > end) {
+    if ((e = malloc(sizeof(tfs_wb_extent_t))) == NULL)
+      return -ENOMEM;
+    e->start = start;
+    e->end = end;
+    e->next = *ep;
+    *ep = e;
+    return 0;
+  }
+
+  e = *ep;
+  if (start < e->start)
+    e->start = start;
+  if (end > e->end)
+    e->end = end;
+
+  while ((n = e->next) != NULL && n->start <= e->end) {
+    if (n->end > e->end)
+      e->end = n->end;
+    e->next = n->next;
+    free(n);
+  }
+
+  return 0;
+}
+
+int TFS_WB_write(tfs_wb_t * wb, const char * buf, size_t size, off_t offset)
+{
+  int ret;
+
+  if (size == 0)
+    return 0;
+
+  if ((ret = store(wb, buf, size, offset)) != 0 ||
+      (ret = add_extent(wb, offset, offset + (off_t)size)) != 0)
+    return ret;
+
+  if (offset + (off_t)size > wb->size)
+    wb->size = offset + (off_t)size;
+
+  return (int)size;
+}
+
+void TFS_WB_truncate(tfs_wb_t * wb, off_t size)
+{
+  tfs_wb_extent_t ** ep = &wb->extents, * e;
+
+  // written bytes past the new end are gone, even if the file grows again
+  while ((e = *ep) != NULL) {
+    if (e->start >= size) {
+      *ep = e->next;
+      free(e);
+      continue;
+    }
+    if (e->end > size)
+      e->end = size;
+    ep = &e->next;
+  }
+
+  if (size < wb->base_size)
+    wb->base_size = size;
+  wb->size = size;
+  wb->truncated = 1;
+}
+
+int TFS_WB_dirty(const tfs_wb_t * wb)
+{
+  return wb->extents != NULL || wb->truncated;
+}
+
+void TFS_WB_overlay(const tfs_wb_t * wb, char * buf, size_t size,
+    off_t offset)
+{
+  const tfs_wb_extent_t * e;
+  off_t end = offset + (off_t)size, from, to;
+
+  // committed bytes cut by a truncate
+  if (end > wb->base_size) {
+    from = offset > wb->base_size ? offset : wb->base_size;
+    memset(buf + (from - offset), 0, (size_t)(end - from));
+  }
+
+  for (e = wb->extents; e != NULL && e->start < end; e = e->next) {
+    if (e->end <= offset)
+      continue;
+    from = e->start > offset ? e->start : offset;
+    to = e->end < end ? e->end : end;
+    if (load(wb, buf + (from - offset), (size_t)(to - from), from) != 0)
+      memset(buf + (from - offset), 0, (size_t)(to - from));
+  }
+}
+
+static int truncate_lo(PGconn * conn, int fd, off_t size)
+{
+#ifdef HAVE_LO_TRUNCATE64
+  return lo_truncate64(conn, fd, size);
+#else
+  return lo_truncate(conn, fd, (size_t)size);
+#endif
+}
+
+static int seek_lo(PGconn * conn, int fd, off_t offset)
+{
+#ifdef HAVE_LO_LSEEK64
+  return lo_lseek64(conn, fd, offset, SEEK_SET) < 0 ? -1 : 0;
+#else
+  return lo_lseek(conn, fd, (int)offset, SEEK_SET) < 0 ? -1 : 0;
+#endif // HAVE_LO_LSEEK64
+}
+
+/** Send the buffered changes through fd. Returns 0 on success */
+static int apply(tfs_wb_t * wb, PGconn * conn, int fd, char * chunk)
+{
+  const tfs_wb_extent_t * e;
+  off_t off, written_end = wb->base_size;
+  size_t n;
+
+  if (wb->truncated && truncate_lo(conn, fd, wb->base_size) < 0)
+    return -EIO;
+
+  for (e = wb->extents; e != NULL; e = e->next) {
+    if (seek_lo(conn, fd, e->start) != 0)
+      return -EIO;
+
+    for (off = e->start; off < e->end; off += (off_t)n) {
+      n = (size_t)(e->end - off) < TFS_WB_CHUNK ?
+        (size_t)(e->end - off) : TFS_WB_CHUNK;
+      if (load(wb, chunk, n, off) != 0 ||
+          lo_write(conn, fd, chunk, n) != (int)n)
+        return -EIO;
+    }
+
+    if (e->end > written_end)
+      written_end = e->end;
+  }
+
+  // a truncate past the end leaves a hole the writes did not cover
+  if (wb->truncated && wb->size > written_end &&
+      truncate_lo(conn, fd, wb->size) < 0)
+    return -EIO;
+
+  return 0;
+}
+
+int TFS_WB_commit(tfs_wb_t * wb, uint64_t loid)
+{
+  tfs_pg_conn_t * pc;
+  PGresult * res;
+  char * chunk;
+  off_t size;
+  uint64_t start;
+  int fd, ret = -EIO;
+
+  if (!TFS_WB_dirty(wb))
+    return 0;
+
+  if ((chunk = malloc(TFS_WB_CHUNK)) == NULL)
+    return -ENOMEM;
+
+  if ((pc = TFS_PG_checkout()) == NULL) {
+    free(chunk);
+    return -EIO;
+  }
+  start = TFS_STATS_now();
+
+  res = PQexec(pc->conn, "BEGIN");
+  if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+    fd = lo_open(pc->conn, (Oid)loid, INV_READ | INV_WRITE);
+    if (fd >= 0 && apply(wb, pc->conn, fd, chunk) == 0 &&
+        lo_close(pc->conn, fd) == 0)
+      ret = 0;
+  }
+  PQclear(res);
+
+  if (ret == 0) {
+    res = PQexec(pc->conn, "COMMIT");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK ||
+        strcmp(PQcmdStatus(res), "ROLLBACK") == 0)
+      ret = -EIO;
+    PQclear(res);
+  }
+
+  if (ret != 0) {
+    TFS_LOG(TFS_LOG_ERROR, "Committing writes to %lu failed: %s",
+        (unsigned long)loid, PQerrorMessage(pc->conn));
+    res = PQexec(pc->conn, "ROLLBACK");
+    PQclear(res);
+  }
+
+  TFS_PG_checkin(pc);
+  if (ret == 0)
+    TFS_PG_wrote();
+  free(chunk);
+  TFS_STATS_record(TFS_STATS_SQL_COMMIT, start, ret);
+
+  if (ret == 0) {
+    size = wb->size;
+    TFS_WB_destroy(wb);
+    TFS_WB_init(wb, size);
+  }
+
+  return ret;
+}
+
+void TFS_WB_destroy(tfs_wb_t * wb)
+{
+  tfs_wb_extent_t * e, * next;
+
+  for (e = wb->extents; e != NULL; e = next) {
+    next = e->next;
+    free(e);
+  }
+  wb->extents = NULL;
+
+  if (wb->spill != NULL)
+    fclose(wb->spill);
+  wb->spill = NULL;
+
+  free(wb->mem);
+  wb->mem = NULL;
+  wb->mem_len = 0;
+}
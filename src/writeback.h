@@ -0,0 +1,90 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_writeback_h
+#define tableaufs_writeback_h
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Buffered bytes kept in memory before spilling to a temp file */
+#define TFS_WB_MEM_MAX (8 * 1024 * 1024)
+
+/** Bytes sent per lo_write call during a commit */
+#define TFS_WB_CHUNK (256 * 1024)
+
+/** A written range of the file, [start, end) */
+typedef struct tfs_wb_extent_t {
+  off_t start;
+  off_t end;
+  struct tfs_wb_extent_t * next;   // sorted by start, never overlapping
+} tfs_wb_extent_t;
+
+/**
+ * Uncommitted changes of a file handle.
+ *
+ * Written bytes are stored at their file offset, in memory up to
+ * TFS_WB_MEM_MAX and in an unlinked temp file above that.
+ */
+typedef struct tfs_wb_t {
+  char * mem;                  // data while not spilled
+  size_t mem_len;
+  FILE * spill;                // data once spilled, NULL before
+  tfs_wb_extent_t * extents;   // ranges holding written data
+  off_t base_size;             // bytes of the committed content still visible
+  off_t size;                  // size of the file after the commit
+  int truncated;               // base_size was cut or extended by a truncate
+} tfs_wb_t;
+
+/** Start buffering on top of a file of size bytes */
+extern void TFS_WB_init(tfs_wb_t * wb, off_t size);
+
+/** Buffer a write. Returns size or a negative errno */
+extern int TFS_WB_write(tfs_wb_t * wb, const char * buf, size_t size,
+    off_t offset);
+
+/** Buffer a truncate to size bytes */
+extern void TFS_WB_truncate(tfs_wb_t * wb, off_t size);
+
+/** Returns non-zero if there is anything to commit */
+extern int TFS_WB_dirty(const tfs_wb_t * wb);
+
+/**
+ * Copy the buffered bytes over buf, which holds size bytes of the
+ * committed content at offset. Bytes cut by a truncate read as zero.
+ */
+extern void TFS_WB_overlay(const tfs_wb_t * wb, char * buf, size_t size,
+    off_t offset);
+
+/**
+ * Apply the buffered truncates and writes to loid in one transaction.
+ *
+ * Either every change makes it or none does. The buffer is emptied on
+ * success and kept on failure.
+ */
+extern int TFS_WB_commit(tfs_wb_t * wb, uint64_t loid);
+
+/** Drop the buffered changes */
+extern void TFS_WB_destroy(tfs_wb_t * wb);
+
+#endif /* tableaufs_writeback_h */
@@ -0,0 +1,108 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "xattr.h"
+
+typedef struct {
+  uint64_t loid;
+  time_t mtime;
+  char digest[TFS_WG_DIGEST_LEN + 1];
+} tfs_xattr_slot_t;
+
+static tfs_xattr_slot_t slots[TFS_XATTR_SLOTS];
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Digest of node, from the cache or from the repository */
+static int get_digest(const tfs_wg_node_t * node, char * digest)
+{
+  tfs_xattr_slot_t * slot = &slots[node->loid % TFS_XATTR_SLOTS];
+  int ret;
+
+  pthread_mutex_lock(&slots_mutex);
+  ret = slot->loid == node->loid && slot->mtime == node->st.st_mtime;
+  if (ret)
+    memcpy(digest, slot->digest, sizeof(slot->digest));
+  pthread_mutex_unlock(&slots_mutex);
+
+  if (ret)
+    return 0;
+
+  if ((ret = TFS_WG_digest(node->loid, digest)) != 0)
+    return ret;
+
+  pthread_mutex_lock(&slots_mutex);
+  slot->loid = node->loid;
+  slot->mtime = node->st.st_mtime;
+  memcpy(slot->digest, digest, sizeof(slot->digest));
+  pthread_mutex_unlock(&slots_mutex);
+
+  return 0;
+}
+
+int TFS_XATTR_get(const tfs_wg_node_t * node, const char * name,
+    char * value, size_t size)
+{
+  char digest[TFS_WG_DIGEST_LEN + 1];
+  int ret;
+
+  if (node->level != TFS_WG_FILE || strcmp(name, TFS_XATTR_DIGEST) != 0)
+    return -ENOATTR;
+
+  if (size == 0)
+    return TFS_WG_DIGEST_LEN;
+  else if (size < TFS_WG_DIGEST_LEN)
+    return -ERANGE;
+
+  if ((ret = get_digest(node, digest)) != 0)
+    return ret;
+
+  memcpy(value, digest, TFS_WG_DIGEST_LEN);
+  return TFS_WG_DIGEST_LEN;
+}
+
+int TFS_XATTR_list(const tfs_wg_node_t * node, char * list, size_t size)
+{
+  if (node->level != TFS_WG_FILE)
+    return 0;
+
+  if (size == 0)
+    return sizeof(TFS_XATTR_DIGEST);
+  else if (size < sizeof(TFS_XATTR_DIGEST))
+    return -ERANGE;
+
+  memcpy(list, TFS_XATTR_DIGEST, sizeof(TFS_XATTR_DIGEST));
+  return sizeof(TFS_XATTR_DIGEST);
+}
+
+void TFS_XATTR_invalidate(uint64_t loid)
+{
+  tfs_xattr_slot_t * slot = &slots[loid % TFS_XATTR_SLOTS];
+
+  pthread_mutex_lock(&slots_mutex);
+  if (slot->loid == loid)
+    memset(slot, 0, sizeof(tfs_xattr_slot_t));
+  pthread_mutex_unlock(&slots_mutex);
+}
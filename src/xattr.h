@@ -0,0 +1,56 @@
+/*
+   Copyright (c) 2015, Tamas Foldi, Starschema
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+   IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+   INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+   NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+   */
+
+#ifndef tableaufs_xattr_h
+#define tableaufs_xattr_h
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include "workgroup.h"
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+/** Extended attribute of files with their content digest (TFS_WG_digest) */
+#define TFS_XATTR_DIGEST "user.tableaufs.digest"
+
+/** Digests kept in memory, indexed by loid */
+#define TFS_XATTR_SLOTS 4096
+
+/**
+ * Value of the attribute name of node, like getxattr(2): with size 0
+ * only the length is returned, -ERANGE if it does not fit into size.
+ * Digests are cached until the mtime of the file changes.
+ */
+extern int TFS_XATTR_get(const tfs_wg_node_t * node, const char * name,
+    char * value, size_t size);
+
+/** Names of the attributes of node, like listxattr(2) */
+extern int TFS_XATTR_list(const tfs_wg_node_t * node, char * list,
+    size_t size);
+
+/** Forget the digest of loid (after a write or a truncate) */
+extern void TFS_XATTR_invalidate(uint64_t loid);
+
+#endif /* tableaufs_xattr_h */